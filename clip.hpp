@@ -61,82 +61,21 @@ std::vector<std::pair<int, std::u32string>> bytes_to_unicode() {
 
 typedef std::function<bool(std::string&, std::vector<int32_t>&)> on_new_token_cb_t;
 
-class CLIPTokenizer {
-private:
-    std::map<int, std::u32string> byte_encoder;
-    std::map<std::u32string, int> byte_decoder;
-    std::map<std::u32string, int> encoder;
-    std::map<int, std::u32string> decoder;
-    std::map<std::pair<std::u32string, std::u32string>, int> bpe_ranks;
-    std::regex pat;
-    int encoder_len;
-    int bpe_len;
-
-public:
-    const std::string UNK_TOKEN = "<|endoftext|>";
-    const std::string BOS_TOKEN = "<|startoftext|>";
-    const std::string EOS_TOKEN = "<|endoftext|>";
-    const std::string PAD_TOKEN = "<|endoftext|>";
-
-    const int UNK_TOKEN_ID = 49407;
-    const int BOS_TOKEN_ID = 49406;
-    const int EOS_TOKEN_ID = 49407;
-    const int PAD_TOKEN_ID = 49407;
+#define CLIP_BPE_CACHE_SIZE 16384
 
-private:
-    static std::string strip(const std::string& str) {
-        std::string::size_type start = str.find_first_not_of(" \t\n\r\v\f");
-        std::string::size_type end   = str.find_last_not_of(" \t\n\r\v\f");
+// vocabulary and merge ranks built from the merges text, shared by all the tokenizers using the same merges
+struct CLIPVocab {
+    std::u32string byte_encoder[256];
+    std::unordered_map<std::u32string, int> encoder;
+    std::unordered_map<int, std::u32string> decoder;
+    std::unordered_map<std::u32string, int> bpe_ranks;  // "first second" => rank
 
-        if (start == std::string::npos) {
-            // String contains only whitespace characters
-            return "";
-        }
-
-        return str.substr(start, end - start + 1);
-    }
-
-    static std::string whitespace_clean(std::string text) {
-        text = std::regex_replace(text, std::regex(R"(\s+)"), " ");
-        text = strip(text);
-        return text;
-    }
-
-    static std::set<std::pair<std::u32string, std::u32string>> get_pairs(const std::vector<std::u32string>& subwords) {
-        std::set<std::pair<std::u32string, std::u32string>> pairs;
-        if (subwords.size() == 0) {
-            return pairs;
-        }
-        std::u32string prev_subword = subwords[0];
-        for (int i = 1; i < subwords.size(); i++) {
-            std::u32string subword = subwords[i];
-            std::pair<std::u32string, std::u32string> pair(prev_subword, subword);
-            pairs.insert(pair);
-            prev_subword = subword;
-        }
-        return pairs;
-    }
-
-public:
-    CLIPTokenizer(int pad_token_id = 49407, const std::string& merges_utf8_str = "")
-        : PAD_TOKEN_ID(pad_token_id) {
-        if (merges_utf8_str.size() > 0) {
-            load_from_merges(merges_utf8_str);
-        } else {
-            load_from_merges(ModelLoader::load_merges());
-        }
-    }
-
-    void load_from_merges(const std::string& merges_utf8_str) {
+    CLIPVocab(const std::string& merges_utf8_str) {
         auto byte_unicode_pairs = bytes_to_unicode();
         // printf("byte_unicode_pairs have %lu pairs \n", byte_unicode_pairs.size());
-        byte_encoder = std::map<int, std::u32string>(byte_unicode_pairs.begin(), byte_unicode_pairs.end());
         for (auto& pair : byte_unicode_pairs) {
-            byte_decoder[pair.second] = pair.first;
+            byte_encoder[pair.first] = pair.second;
         }
-        // for (auto & pair: byte_unicode_pairs) {
-        //     std::cout << pair.first << ": " << pair.second << std::endl;
-        // }
         std::vector<std::u32string> merges;
         size_t start = 0;
         size_t pos;
@@ -148,14 +87,6 @@ public:
         // LOG_DEBUG("merges size %llu", merges.size());
         GGML_ASSERT(merges.size() == 48895);
         merges = std::vector<std::u32string>(merges.begin() + 1, merges.end());
-        std::vector<std::pair<std::u32string, std::u32string>> merge_pairs;
-        for (const auto& merge : merges) {
-            size_t space_pos = merge.find(' ');
-            merge_pairs.emplace_back(merge.substr(0, space_pos), merge.substr(space_pos + 1));
-            // LOG_DEBUG("%s", utf32_to_utf8(merge.substr(space_pos + 1)).c_str());
-            // printf("%s :: %s | %s \n", utf32_to_utf8(merge).c_str(), utf32_to_utf8(merge.substr(0, space_pos)).c_str(),
-            //                     utf32_to_utf8(merge.substr(space_pos + 1)).c_str());
-        }
         std::vector<std::u32string> vocab;
         for (const auto& pair : byte_unicode_pairs) {
             vocab.push_back(pair.second);
@@ -163,8 +94,13 @@ public:
         for (const auto& pair : byte_unicode_pairs) {
             vocab.push_back(pair.second + utf8_to_utf32("</w>"));
         }
-        for (const auto& merge : merge_pairs) {
-            vocab.push_back(merge.first + merge.second);
+        encoder.reserve(vocab.size() + merges.size() + 2);
+        bpe_ranks.reserve(merges.size());
+        int rank = 0;
+        for (const auto& merge : merges) {
+            size_t space_pos = merge.find(' ');
+            vocab.push_back(merge.substr(0, space_pos) + merge.substr(space_pos + 1));
+            bpe_ranks[merge] = rank++;
         }
         vocab.push_back(utf8_to_utf32("<|startoftext|>"));
         vocab.push_back(utf8_to_utf32("<|endoftext|>"));
@@ -175,7 +111,6 @@ public:
             decoder[i]     = token;
             i++;
         }
-        encoder_len = i;
 
         auto it = encoder.find(utf8_to_utf32("img</w>"));
         if (it != encoder.end()) {
@@ -183,22 +118,169 @@ public:
         } else {
             LOG_DEBUG(" trigger word img not in vocab yet");
         }
+    }
 
-        int rank = 0;
-        for (const auto& merge : merge_pairs) {
-            bpe_ranks[merge] = rank++;
+    // The merges are parsed once per process. This spares the later tokenizers of a process, the
+    // first one still pays the whole parse, logged below.
+    static std::shared_ptr<const CLIPVocab> get_default() {
+        static std::mutex mutex;
+        static std::shared_ptr<const CLIPVocab> vocab;
+        std::lock_guard<std::mutex> lock(mutex);
+        if (vocab == NULL) {
+            int64_t t0 = ggml_time_ms();
+            vocab      = std::make_shared<CLIPVocab>(ModelLoader::load_merges());
+            int64_t t1 = ggml_time_ms();
+            LOG_DEBUG("parsing the clip vocab completed, taking %" PRId64 " ms", t1 - t0);
         }
-        bpe_len = rank;
-    };
+        return vocab;
+    }
+};
 
-    void add_token(const std::string& text) {
-        std::u32string token = utf8_to_utf32(text);
-        auto it              = encoder.find(token);
-        if (it != encoder.end()) {
-            encoder[token]       = encoder_len;
-            decoder[encoder_len] = token;
-            encoder_len++;
+class CLIPTokenizer {
+private:
+    std::shared_ptr<const CLIPVocab> vocab;
+    // word => tokens, prompts keep reusing the same words
+    std::unordered_map<std::string, std::vector<int32_t>> bpe_cache;
+
+public:
+    const std::string UNK_TOKEN = "<|endoftext|>";
+    const std::string BOS_TOKEN = "<|startoftext|>";
+    const std::string EOS_TOKEN = "<|endoftext|>";
+    const std::string PAD_TOKEN = "<|endoftext|>";
+
+    const int UNK_TOKEN_ID = 49407;
+    const int BOS_TOKEN_ID = 49406;
+    const int EOS_TOKEN_ID = 49407;
+    const int PAD_TOKEN_ID = 49407;
+
+private:
+    static bool is_space(unsigned char c) {
+        return c == ' ' || c == '\t' || c == '\n' || c == '\v' || c == '\f' || c == '\r';
+    }
+
+    static bool is_alpha(unsigned char c) {
+        return (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z');
+    }
+
+    static bool is_digit(unsigned char c) {
+        return c >= '0' && c <= '9';
+    }
+
+    static std::string strip(const std::string& str) {
+        std::string::size_type start = str.find_first_not_of(" \t\n\r\v\f");
+        std::string::size_type end   = str.find_last_not_of(" \t\n\r\v\f");
+
+        if (start == std::string::npos) {
+            // String contains only whitespace characters
+            return "";
+        }
+
+        return str.substr(start, end - start + 1);
+    }
+
+    // collapses whitespace runs into one space, like re.sub(r"\s+", " ", text).strip()
+    static std::string whitespace_clean(const std::string& text) {
+        std::string result;
+        result.reserve(text.size());
+        bool in_space = false;
+        for (unsigned char c : text) {
+            if (is_space(c)) {
+                in_space = true;
+                continue;
+            }
+            if (in_space && result.size() > 0) {
+                result += ' ';
+            }
+            in_space = false;
+            result += c;
+        }
+        return result;
+    }
+
+    // Hand written matcher of the pre-tokenization pattern
+    //   <\|startoftext\|>|<\|endoftext\|>|'s|'t|'re|'ve|'m|'ll|'d|[[:alpha:]]+|[[:digit:]]|[^[:space:][:alpha:][:digit:]]+
+    // returns the length of the match starting at pos, 0 if none starts there.
+    static size_t match_pre_token(const std::string& text, size_t pos) {
+        static const std::vector<std::string> literals = {"<|startoftext|>", "<|endoftext|>",
+                                                          "'s", "'t", "'re", "'ve", "'m", "'ll", "'d"};
+        for (const auto& literal : literals) {
+            if (text.compare(pos, literal.size(), literal) == 0) {
+                return literal.size();
+            }
+        }
+        unsigned char c = text[pos];
+        if (is_space(c)) {
+            return 0;
+        }
+        if (is_digit(c)) {
+            return 1;
+        }
+        size_t end = pos + 1;
+        if (is_alpha(c)) {
+            while (end < text.size() && is_alpha(text[end])) {
+                end++;
+            }
+        } else {
+            while (end < text.size() && !is_space(text[end]) && !is_alpha(text[end]) && !is_digit(text[end])) {
+                end++;
+            }
+        }
+        return end - pos;
+    }
+
+    int get_bpe_rank(const std::u32string& first, const std::u32string& second) {
+        std::u32string pair = first;
+        pair += U' ';
+        pair += second;
+        auto iter = vocab->bpe_ranks.find(pair);
+        return iter == vocab->bpe_ranks.end() ? INT_MAX : iter->second;
+    }
+
+    void encode_word(const std::string& word, std::vector<int32_t>& bpe_tokens) {
+        auto iter = bpe_cache.find(word);
+        if (iter != bpe_cache.end()) {
+            bpe_tokens.insert(bpe_tokens.end(), iter->second.begin(), iter->second.end());
+            return;
+        }
+
+        std::u32string utf32_token;
+        for (unsigned char b : word) {
+            utf32_token += vocab->byte_encoder[b];
+        }
+        auto bpe_strs = bpe(utf32_token);
+
+        std::vector<int32_t> tokens;
+        size_t start = 0;
+        while (start <= bpe_strs.size()) {
+            size_t pos = bpe_strs.find(' ', start);
+            if (pos == std::u32string::npos) {
+                pos = bpe_strs.size();
+            }
+            auto token_iter = vocab->encoder.find(bpe_strs.substr(start, pos - start));
+            tokens.push_back(token_iter == vocab->encoder.end() ? UNK_TOKEN_ID : token_iter->second);
+            start = pos + 1;
         }
+
+        if (bpe_cache.size() >= CLIP_BPE_CACHE_SIZE) {
+            bpe_cache.clear();
+        }
+        bpe_cache[word] = tokens;
+        bpe_tokens.insert(bpe_tokens.end(), tokens.begin(), tokens.end());
+    }
+
+public:
+    CLIPTokenizer(int pad_token_id = 49407, const std::string& merges_utf8_str = "")
+        : PAD_TOKEN_ID(pad_token_id) {
+        if (merges_utf8_str.size() > 0) {
+            load_from_merges(merges_utf8_str);
+        } else {
+            vocab = CLIPVocab::get_default();
+        }
+    }
+
+    void load_from_merges(const std::string& merges_utf8_str) {
+        vocab = std::make_shared<CLIPVocab>(merges_utf8_str);
+        bpe_cache.clear();
     }
 
     std::u32string bpe(const std::u32string& token) {
@@ -207,69 +289,47 @@ public:
         for (int i = 0; i < token.size() - 1; i++) {
             word.emplace_back(1, token[i]);
         }
-        word.push_back(token.substr(token.size() - 1) + utf8_to_utf32("</w>"));
-
-        std::set<std::pair<std::u32string, std::u32string>> pairs = get_pairs(word);
+        word.push_back(token.substr(token.size() - 1) + U"</w>");
 
-        if (pairs.empty()) {
-            return token + utf8_to_utf32("</w>");
+        if (word.size() == 1) {
+            return token + U"</w>";
         }
 
-        while (true) {
-            auto min_pair_iter = std::min_element(pairs.begin(),
-                                                  pairs.end(),
-                                                  [&](const std::pair<std::u32string, std::u32string>& a,
-                                                      const std::pair<std::u32string, std::u32string>& b) {
-                                                      if (bpe_ranks.find(a) == bpe_ranks.end()) {
-                                                          return false;
-                                                      } else if (bpe_ranks.find(b) == bpe_ranks.end()) {
-                                                          return true;
-                                                      }
-                                                      return bpe_ranks.at(a) < bpe_ranks.at(b);
-                                                  });
-
-            const std::pair<std::u32string, std::u32string>& bigram = *min_pair_iter;
-
-            if (bpe_ranks.find(bigram) == bpe_ranks.end()) {
+        while (word.size() > 1) {
+            // the pair with the lowest rank is merged first, everywhere in the word
+            int min_rank = INT_MAX;
+            size_t min_i = 0;
+            for (size_t i = 0; i + 1 < word.size(); i++) {
+                int rank = get_bpe_rank(word[i], word[i + 1]);
+                if (rank < min_rank) {
+                    min_rank = rank;
+                    min_i    = i;
+                }
+            }
+            if (min_rank == INT_MAX) {
                 break;
             }
 
-            std::u32string first  = bigram.first;
-            std::u32string second = bigram.second;
+            std::u32string first  = word[min_i];
+            std::u32string second = word[min_i + 1];
             std::vector<std::u32string> new_word;
-            int32_t i = 0;
-
-            while (i < word.size()) {
-                auto it = std::find(word.begin() + i, word.end(), first);
-                if (it == word.end()) {
-                    new_word.insert(new_word.end(), word.begin() + i, word.end());
-                    break;
-                }
-                new_word.insert(new_word.end(), word.begin() + i, it);
-                i = static_cast<int32_t>(std::distance(word.begin(), it));
-
-                if (word[i] == first && i < static_cast<int32_t>(word.size()) - 1 && word[i + 1] == second) {
+            new_word.reserve(word.size());
+            for (size_t i = 0; i < word.size(); i++) {
+                if (i + 1 < word.size() && word[i] == first && word[i + 1] == second) {
                     new_word.push_back(first + second);
-                    i += 2;
+                    i++;
                 } else {
                     new_word.push_back(word[i]);
-                    i += 1;
                 }
             }
-
-            word = new_word;
-
-            if (word.size() == 1) {
-                break;
-            }
-            pairs = get_pairs(word);
+            word = std::move(new_word);
         }
 
         std::u32string result;
         for (int i = 0; i < word.size(); i++) {
             result += word[i];
             if (i != word.size() - 1) {
-                result += utf8_to_utf32(" ");
+                result += U' ';
             }
         }
 
@@ -348,7 +408,8 @@ public:
         for (int t : tokens) {
             if (t == 49406 || t == 49407)
                 continue;
-            std::u32string ts = decoder[t];
+            auto iter         = vocab->decoder.find(t);
+            std::u32string ts = iter == vocab->decoder.end() ? std::u32string() : iter->second;
             // printf("%d, %s \n", t,  utf32_to_utf8(ts).c_str());
             std::string s = utf32_to_utf8(ts);
             if (s.length() >= 4 && ends_with(s, "</w>")) {
@@ -368,53 +429,30 @@ public:
     }
 
     std::vector<int> encode(std::string text, on_new_token_cb_t on_new_token_cb) {
-        std::string original_text = text;
         std::vector<int32_t> bpe_tokens;
         text = whitespace_clean(text);
         std::transform(text.begin(), text.end(), text.begin(), [](unsigned char c) { return std::tolower(c); });
 
-        std::regex pat(R"(<\|startoftext\|>|<\|endoftext\|>|'s|'t|'re|'ve|'m|'ll|'d|[[:alpha:]]+|[[:digit:]]|[^[:space:][:alpha:][:digit:]]+)",
-                       std::regex::icase);
-
-        std::smatch matches;
         std::string str = text;
-        std::vector<std::string> token_strs;
-        while (std::regex_search(str, matches, pat)) {
+        while (true) {
+            size_t begin = 0;
+            size_t len   = 0;
+            for (; begin < str.size(); begin++) {
+                len = match_pre_token(str, begin);
+                if (len > 0) {
+                    break;
+                }
+            }
+            if (len == 0) {
+                break;
+            }
             bool skip = on_new_token_cb(str, bpe_tokens);
             if (skip) {
                 continue;
             }
-            for (auto& token : matches) {
-                std::string token_str = token.str();
-                std::u32string utf32_token;
-                for (int i = 0; i < token_str.length(); i++) {
-                    unsigned char b = token_str[i];
-                    utf32_token += byte_encoder[b];
-                }
-                auto bpe_strs = bpe(utf32_token);
-                size_t start  = 0;
-                size_t pos;
-                while ((pos = bpe_strs.find(' ', start)) != std::u32string::npos) {
-                    auto bpe_str = bpe_strs.substr(start, pos - start);
-                    bpe_tokens.push_back(encoder[bpe_str]);
-                    token_strs.push_back(utf32_to_utf8(bpe_str));
-
-                    start = pos + 1;
-                }
-                auto bpe_str = bpe_strs.substr(start, bpe_strs.size() - start);
-                bpe_tokens.push_back(encoder[bpe_str]);
-                token_strs.push_back(utf32_to_utf8(bpe_str));
-            }
-            str = matches.suffix();
+            encode_word(str.substr(begin, len), bpe_tokens);
+            str.erase(0, begin + len);
         }
-        std::stringstream ss;
-        ss << "[";
-        for (auto token : token_strs) {
-            ss << "\"" << token << "\", ";
-        }
-        ss << "]";
-        // LOG_DEBUG("split prompt \"%s\" to tokens %s", original_text.c_str(), ss.str().c_str());
-        // printf("split prompt \"%s\" to tokens %s \n", original_text.c_str(), ss.str().c_str());
         return bpe_tokens;
     }
 };
@@ -695,8 +733,8 @@ public:
     struct ggml_tensor* forward(struct ggml_context* ctx,
                                 struct ggml_tensor* input_ids,
                                 struct ggml_tensor* tkn_embeddings,
-                                size_t max_token_idx = 0,
-                                bool return_pooled   = false) {
+                                const std::vector<size_t>& max_token_idxs = {},
+                                bool return_pooled                        = false) {
         // input_ids: [N, n_token]
         auto embeddings       = std::dynamic_pointer_cast<CLIPEmbeddings>(blocks["embeddings"]);
         auto encoder          = std::dynamic_pointer_cast<CLIPEncoder>(blocks["encoder"]);
@@ -709,9 +747,16 @@ public:
         }
 
         if (return_pooled) {
+            // one pooled vector per batch item, taken at the EOS token of that item
             auto text_projection = params["text_projection"];
-            ggml_tensor* pooled  = ggml_view_1d(ctx, x, hidden_size, x->nb[1] * max_token_idx);
-            pooled               = ggml_mul_mat(ctx, ggml_cont(ctx, ggml_transpose(ctx, text_projection)), pooled);
+            ggml_tensor* pooled  = NULL;
+            for (int64_t i = 0; i < x->ne[2]; i++) {
+                size_t max_token_idx = i < max_token_idxs.size() ? max_token_idxs[i] : 0;
+                ggml_tensor* item    = ggml_view_2d(ctx, x, hidden_size, 1, x->nb[1], x->nb[2] * i + x->nb[1] * max_token_idx);
+                item                 = ggml_cont(ctx, item);
+                pooled               = pooled == NULL ? item : ggml_concat(ctx, pooled, item, 1);
+            }
+            pooled = ggml_mul_mat(ctx, ggml_cont(ctx, ggml_transpose(ctx, text_projection)), pooled);  // [N, projection_dim]
             return pooled;
         }
 
@@ -865,8 +910,8 @@ struct CLIPTextModelRunner : public GGMLRunner {
     struct ggml_tensor* forward(struct ggml_context* ctx,
                                 struct ggml_tensor* input_ids,
                                 struct ggml_tensor* embeddings,
-                                size_t max_token_idx = 0,
-                                bool return_pooled   = false) {
+                                const std::vector<size_t>& max_token_idxs = {},
+                                bool return_pooled                        = false) {
         size_t N       = input_ids->ne[1];
         size_t n_token = input_ids->ne[0];
         if (input_ids->ne[0] > model.n_token) {
@@ -874,15 +919,15 @@ struct CLIPTextModelRunner : public GGMLRunner {
             input_ids = ggml_reshape_2d(ctx, input_ids, model.n_token, input_ids->ne[0] / model.n_token);
         }
 
-        return model.forward(ctx, input_ids, embeddings, max_token_idx, return_pooled);
+        return model.forward(ctx, input_ids, embeddings, max_token_idxs, return_pooled);
     }
 
     struct ggml_cgraph* build_graph(struct ggml_tensor* input_ids,
-                                    int num_custom_embeddings    = 0,
-                                    void* custom_embeddings_data = NULL,
-                                    size_t max_token_idx         = 0,
-                                    bool return_pooled           = false) {
-        struct ggml_cgraph* gf = ggml_new_graph(compute_ctx);
+                                    int num_custom_embeddings                 = 0,
+                                    void* custom_embeddings_data              = NULL,
+                                    const std::vector<size_t>& max_token_idxs = {},
+                                    bool return_pooled                        = false) {
+        struct ggml_cgraph* gf = ggml_new_graph_custom(compute_ctx, sd_graph_size(GGML_DEFAULT_GRAPH_SIZE), false);
 
         input_ids = to_backend(input_ids);
 
@@ -900,7 +945,7 @@ struct CLIPTextModelRunner : public GGMLRunner {
             embeddings = ggml_concat(compute_ctx, token_embed_weight, custom_embeddings, 1);
         }
 
-        struct ggml_tensor* hidden_states = forward(compute_ctx, input_ids, embeddings, max_token_idx, return_pooled);
+        struct ggml_tensor* hidden_states = forward(compute_ctx, input_ids, embeddings, max_token_idxs, return_pooled);
 
         ggml_build_forward_expand(gf, hidden_states);
 
@@ -911,12 +956,12 @@ struct CLIPTextModelRunner : public GGMLRunner {
                  struct ggml_tensor* input_ids,
                  int num_custom_embeddings,
                  void* custom_embeddings_data,
-                 size_t max_token_idx,
+                 const std::vector<size_t>& max_token_idxs,
                  bool return_pooled,
                  ggml_tensor** output,
                  ggml_context* output_ctx = NULL) {
         auto get_graph = [&]() -> struct ggml_cgraph* {
-            return build_graph(input_ids, num_custom_embeddings, custom_embeddings_data, max_token_idx, return_pooled);
+            return build_graph(input_ids, num_custom_embeddings, custom_embeddings_data, max_token_idxs, return_pooled);
         };
         GGMLRunner::compute(get_graph, n_threads, true, output, output_ctx);
     }
@@ -4,6 +4,8 @@
 #include "clip.hpp"
 #include "t5.hpp"
 
+#define CONDITION_CACHE_DEFAULT_SIZE (size_t)(256 * 1024 * 1024)
+
 struct SDCondition {
     struct ggml_tensor* c_crossattn = NULL;  // aka context
     struct ggml_tensor* c_vector    = NULL;  // aka y
@@ -14,6 +16,86 @@ struct SDCondition {
         : c_crossattn(c_crossattn), c_vector(c_vector), c_concat(c_concat) {}
 };
 
+// Scales each token embedding of a chunk by its prompt weight, then restores the original mean of the chunk
+__STATIC_INLINE__ void apply_token_weights(const float* src,
+                                           float* dst,
+                                           const float* weights,
+                                           int64_t hidden_size,
+                                           int64_t n_token) {
+    int64_t nelements   = hidden_size * n_token;
+    float original_mean = 0.f;
+    for (int64_t i = 0; i < nelements; i++) {
+        original_mean += src[i] / nelements;
+    }
+    float new_mean = 0.f;
+    for (int64_t i1 = 0; i1 < n_token; i1++) {
+        for (int64_t i0 = 0; i0 < hidden_size; i0++) {
+            float value                = src[i1 * hidden_size + i0] * weights[i1];
+            dst[i1 * hidden_size + i0] = value;
+            new_mean += value / nelements;
+        }
+    }
+    float scale = original_mean / new_mean;
+    for (int64_t i = 0; i < nelements; i++) {
+        dst[i] *= scale;
+    }
+}
+
+// t5 chunks are encoded up to their longest real token count, rounded up to a multiple of this
+#define T5_LENGTH_BUCKET 16
+
+// Encodes the t5 chunks stacked in tokens as one batch. With mask_padding the batch is cut after its longest
+// chunk (rounded up to T5_LENGTH_BUCKET) and the padding keys of every chunk are masked, lengths then holds
+// the real token count of each chunk. Returns [n_chunks, n_token, hidden_size].
+__STATIC_INLINE__ struct ggml_tensor* t5_encode_chunks(ggml_context* work_ctx,
+                                                       std::shared_ptr<T5Runner> t5,
+                                                       int n_threads,
+                                                       const std::vector<int>& tokens,
+                                                       int64_t chunk_len,
+                                                       int pad_id,
+                                                       bool mask_padding,
+                                                       std::vector<int64_t>& lengths) {
+    int64_t n_chunks = tokens.size() / chunk_len;
+    int64_t n_token  = chunk_len;
+    lengths.assign(n_chunks, chunk_len);
+    if (mask_padding) {
+        int64_t max_length = 1;
+        for (int64_t i = 0; i < n_chunks; i++) {
+            int64_t length = chunk_len;
+            while (length > 1 && tokens[i * chunk_len + length - 1] == pad_id) {
+                length--;
+            }
+            lengths[i] = length;
+            max_length = std::max(max_length, length);
+        }
+        n_token = std::min(chunk_len, (max_length + T5_LENGTH_BUCKET - 1) / T5_LENGTH_BUCKET * T5_LENGTH_BUCKET);
+    }
+
+    auto input_ids = ggml_new_tensor_2d(work_ctx, GGML_TYPE_I32, n_token, n_chunks);
+    for (int64_t i = 0; i < n_chunks; i++) {
+        memcpy((int32_t*)input_ids->data + i * n_token, tokens.data() + i * chunk_len, n_token * sizeof(int32_t));
+    }
+
+    struct ggml_tensor* attention_mask = NULL;
+    if (mask_padding) {
+        attention_mask = ggml_new_tensor_4d(work_ctx, GGML_TYPE_F32, n_token, 1, 1, n_chunks);
+        for (int64_t i = 0; i < n_chunks; i++) {
+            for (int64_t j = 0; j < n_token; j++) {
+                ggml_tensor_set_f32(attention_mask, j < lengths[i] ? 0.f : -INFINITY, j, 0, 0, i);
+            }
+        }
+        LOG_DEBUG("t5: %" PRId64 " chunks, %" PRId64 " of %" PRId64 " tokens encoded", n_chunks, n_token, chunk_len);
+    }
+
+    struct ggml_tensor* hidden_states = NULL;
+    t5->compute(n_threads,
+                input_ids,
+                attention_mask,
+                &hidden_states,
+                work_ctx);
+    return hidden_states;
+}
+
 struct Conditioner {
     virtual SDCondition get_learned_condition(ggml_context* work_ctx,
                                               int n_threads,
@@ -23,6 +105,15 @@ struct Conditioner {
                                               int height,
                                               int adm_in_channels        = -1,
                                               bool force_zero_embeddings = false)                                             = 0;
+    // encodes several prompts at once, e.g. the positive and negative prompt of a generation
+    virtual std::vector<SDCondition> get_learned_conditions(ggml_context* work_ctx,
+                                                            int n_threads,
+                                                            const std::vector<std::string>& texts,
+                                                            int clip_skip,
+                                                            int width,
+                                                            int height,
+                                                            int adm_in_channels                            = -1,
+                                                            const std::vector<bool>& force_zero_embeddings = {})              = 0;
     virtual void alloc_params_buffer()                                                                                        = 0;
     virtual void free_params_buffer()                                                                                         = 0;
     virtual void get_param_tensors(std::map<std::string, struct ggml_tensor*>& tensors)                                       = 0;
@@ -38,6 +129,10 @@ struct Conditioner {
                                                                                           bool force_zero_embeddings = false) = 0;
     virtual std::string remove_trigger_from_prompt(ggml_context* work_ctx,
                                                    const std::string& prompt)                                                 = 0;
+    // identifies the custom embedding files text may use, for the condition cache keys
+    virtual std::string get_embeddings_key(const std::string& text) {
+        return "";
+    }
 };
 
 // ldm.modules.encoders.modules.FrozenCLIPEmbedder
@@ -53,7 +148,16 @@ struct FrozenCLIPEmbedderWithCustomWords : public Conditioner {
     std::string embd_dir;
     int32_t num_custom_embeddings = 0;
     std::vector<uint8_t> token_embed_custom;
-    std::vector<std::string> readed_embeddings;
+    // lowercase embedding name => file, rebuilt when the content of embd_dir changes
+    std::unordered_map<std::string, std::string> embd_files;
+    int64_t embd_dir_mtime = -1;
+    struct CustomEmbedding {
+        std::string path;
+        int64_t mtime = -1;
+        std::vector<int32_t> tokens;  // its vectors in token_embed_custom, past the vocab
+    };
+    // lowercase embedding name => the loaded embedding, read again when its file changes
+    std::unordered_map<std::string, CustomEmbedding> embds;
 
     FrozenCLIPEmbedderWithCustomWords(ggml_backend_t backend,
                                       ggml_type wtype,
@@ -113,17 +217,95 @@ struct FrozenCLIPEmbedderWithCustomWords : public Conditioner {
         return buffer_size;
     }
 
+    static std::string to_lower(std::string str) {
+        std::transform(str.begin(), str.end(), str.begin(), ::tolower);
+        return str;
+    }
+
+    void update_embedding_index() {
+        if (embd_dir.size() == 0) {
+            return;
+        }
+        int64_t mtime = get_file_mtime(embd_dir);
+        if (mtime == embd_dir_mtime) {
+            return;
+        }
+        embd_dir_mtime = mtime;
+        embd_files.clear();
+
+        // an embedding with several files is read from the first extension of the list
+        const std::vector<std::string> exts = {".pt", ".ckpt", ".safetensors"};
+        std::unordered_map<std::string, size_t> file_ext_index;
+        for (auto& path : get_files_from_dir(embd_dir)) {
+            std::string file_name = to_lower(path.substr(path.find_last_of("/\\") + 1));
+            for (size_t i = 0; i < exts.size(); i++) {
+                if (!ends_with(file_name, exts[i]) || file_name.size() == exts[i].size()) {
+                    continue;
+                }
+                std::string name = file_name.substr(0, file_name.size() - exts[i].size());
+                auto iter        = file_ext_index.find(name);
+                if (iter == file_ext_index.end() || i < iter->second) {
+                    file_ext_index[name] = i;
+                    embd_files[name]     = path;
+                }
+                break;
+            }
+        }
+        LOG_DEBUG("indexed %zu embeddings in '%s'", embd_files.size(), embd_dir.c_str());
+    }
+
+    // path and mtime of every indexed embedding whose name appears in text, a superset of the
+    // embeddings the tokenizer replaces. load_embedding reads a file again once its mtime
+    // changes, so the conditions of a new key are computed with the new vectors.
+    std::string get_embeddings_key(const std::string& text) {
+        update_embedding_index();
+        std::string lower_text = to_lower(text);
+        std::map<std::string, std::string> used;  // sorted, the key doesn't depend on the index order
+        for (auto& kv : embd_files) {
+            if (lower_text.find(kv.first) != std::string::npos) {
+                used[kv.first] = kv.second;
+            }
+        }
+        std::string key;
+        for (auto& kv : used) {
+            key += format("|%s:%" PRId64, kv.second.c_str(), get_file_mtime(kv.second));
+        }
+        return key;
+    }
+
+    // replaces the embedding name at the start of str with the tokens of the embedding
+    bool replace_embedding(std::string& str, std::vector<int32_t>& bpe_tokens) {
+        size_t word_end       = str.find(",");
+        std::string embd_name = word_end == std::string::npos ? str : str.substr(0, word_end);
+        embd_name             = trim(embd_name);
+        auto iter             = embd_files.find(to_lower(embd_name));
+        if (iter == embd_files.end()) {
+            return false;
+        }
+        if (!load_embedding(embd_name, iter->second, bpe_tokens)) {
+            return false;
+        }
+        if (word_end != std::string::npos) {
+            str = str.substr(word_end);
+        } else {
+            str = "";
+        }
+        return true;
+    }
+
     bool load_embedding(std::string embd_name, std::string embd_path, std::vector<int32_t>& bpe_tokens) {
+        int64_t mtime = get_file_mtime(embd_path);
+        auto iter     = embds.find(to_lower(embd_name));
+        if (iter != embds.end() && iter->second.path == embd_path && iter->second.mtime == mtime) {
+            bpe_tokens.insert(bpe_tokens.end(), iter->second.tokens.begin(), iter->second.tokens.end());
+            return true;
+        }
         // the order matters
         ModelLoader model_loader;
         if (!model_loader.init_from_file(embd_path)) {
             LOG_ERROR("embedding '%s' failed", embd_name.c_str());
             return false;
         }
-        if (std::find(readed_embeddings.begin(), readed_embeddings.end(), embd_name) != readed_embeddings.end()) {
-            LOG_DEBUG("embedding already read in: %s", embd_name.c_str());
-            return true;
-        }
         struct ggml_init_params params;
         params.mem_size               = 10 * 1024 * 1024;  // max for custom embeddings 10 MB
         params.mem_buffer             = NULL;
@@ -141,16 +323,37 @@ struct FrozenCLIPEmbedderWithCustomWords : public Conditioner {
             return true;
         };
         model_loader.load_tensors(on_load, NULL);
-        readed_embeddings.push_back(embd_name);
-        token_embed_custom.resize(token_embed_custom.size() + ggml_nbytes(embd));
-        memcpy((void*)(token_embed_custom.data() + num_custom_embeddings * hidden_size * ggml_type_size(wtype)),
-               embd->data,
-               ggml_nbytes(embd));
-        for (int i = 0; i < embd->ne[1]; i++) {
-            bpe_tokens.push_back(text_model->model.vocab_size + num_custom_embeddings);
-            // LOG_DEBUG("new custom token: %i", text_model.vocab_size + num_custom_embeddings);
-            num_custom_embeddings++;
+        if (embd == NULL) {
+            LOG_ERROR("embedding '%s' failed", embd_name.c_str());
+            ggml_free(embd_ctx);
+            return false;
+        }
+        // a changed file keeps the tokens of the embedding when it has as many vectors, otherwise
+        // it takes new ones and the old vectors are left unused
+        CustomEmbedding& custom      = embds[to_lower(embd_name)];
+        std::vector<int32_t>& tokens = custom.tokens;
+        size_t row_size              = hidden_size * ggml_type_size(wtype);
+        if (!tokens.empty()) {
+            LOG_INFO("embedding '%s' changed, reloading it", embd_name.c_str());
+        }
+        if ((int64_t)tokens.size() != embd->ne[1]) {
+            tokens.clear();
+            token_embed_custom.resize(token_embed_custom.size() + ggml_nbytes(embd));
+            for (int i = 0; i < embd->ne[1]; i++) {
+                tokens.push_back(text_model->model.vocab_size + num_custom_embeddings);
+                // LOG_DEBUG("new custom token: %i", text_model.vocab_size + num_custom_embeddings);
+                num_custom_embeddings++;
+            }
         }
+        for (size_t i = 0; i < tokens.size(); i++) {
+            memcpy((void*)(token_embed_custom.data() + (tokens[i] - text_model->model.vocab_size) * row_size),
+                   (const char*)embd->data + i * row_size,
+                   row_size);
+        }
+        custom.path  = embd_path;
+        custom.mtime = mtime;
+        bpe_tokens.insert(bpe_tokens.end(), tokens.begin(), tokens.end());
+        ggml_free(embd_ctx);
         LOG_DEBUG("embedding '%s' applied, custom embeddings: %i", embd_name.c_str(), num_custom_embeddings);
         return true;
     }
@@ -165,28 +368,9 @@ struct FrozenCLIPEmbedderWithCustomWords : public Conditioner {
     }
 
     std::vector<int> convert_token_to_id(std::string text) {
+        update_embedding_index();
         auto on_new_token_cb = [&](std::string& str, std::vector<int32_t>& bpe_tokens) -> bool {
-            size_t word_end       = str.find(",");
-            std::string embd_name = word_end == std::string::npos ? str : str.substr(0, word_end);
-            embd_name             = trim(embd_name);
-            std::string embd_path = get_full_path(embd_dir, embd_name + ".pt");
-            if (embd_path.size() == 0) {
-                embd_path = get_full_path(embd_dir, embd_name + ".ckpt");
-            }
-            if (embd_path.size() == 0) {
-                embd_path = get_full_path(embd_dir, embd_name + ".safetensors");
-            }
-            if (embd_path.size() > 0) {
-                if (load_embedding(embd_name, embd_path, bpe_tokens)) {
-                    if (word_end != std::string::npos) {
-                        str = str.substr(word_end);
-                    } else {
-                        str = "";
-                    }
-                    return true;
-                }
-            }
-            return false;
+            return replace_embedding(str, bpe_tokens);
         };
         std::vector<int> curr_tokens = tokenizer.encode(text, on_new_token_cb);
         return curr_tokens;
@@ -214,28 +398,9 @@ struct FrozenCLIPEmbedderWithCustomWords : public Conditioner {
             LOG_DEBUG("parse '%s' to %s", text.c_str(), ss.str().c_str());
         }
 
+        update_embedding_index();
         auto on_new_token_cb = [&](std::string& str, std::vector<int32_t>& bpe_tokens) -> bool {
-            size_t word_end       = str.find(",");
-            std::string embd_name = word_end == std::string::npos ? str : str.substr(0, word_end);
-            embd_name             = trim(embd_name);
-            std::string embd_path = get_full_path(embd_dir, embd_name + ".pt");
-            if (embd_path.size() == 0) {
-                embd_path = get_full_path(embd_dir, embd_name + ".ckpt");
-            }
-            if (embd_path.size() == 0) {
-                embd_path = get_full_path(embd_dir, embd_name + ".safetensors");
-            }
-            if (embd_path.size() > 0) {
-                if (load_embedding(embd_name, embd_path, bpe_tokens)) {
-                    if (word_end != std::string::npos) {
-                        str = str.substr(word_end);
-                    } else {
-                        str = "";
-                    }
-                    return true;
-                }
-            }
-            return false;
+            return replace_embedding(str, bpe_tokens);
         };
 
         std::vector<int> tokens;
@@ -325,28 +490,9 @@ struct FrozenCLIPEmbedderWithCustomWords : public Conditioner {
             LOG_DEBUG("parse '%s' to %s", text.c_str(), ss.str().c_str());
         }
 
+        update_embedding_index();
         auto on_new_token_cb = [&](std::string& str, std::vector<int32_t>& bpe_tokens) -> bool {
-            size_t word_end       = str.find(",");
-            std::string embd_name = word_end == std::string::npos ? str : str.substr(0, word_end);
-            embd_name             = trim(embd_name);
-            std::string embd_path = get_full_path(embd_dir, embd_name + ".pt");
-            if (embd_path.size() == 0) {
-                embd_path = get_full_path(embd_dir, embd_name + ".ckpt");
-            }
-            if (embd_path.size() == 0) {
-                embd_path = get_full_path(embd_dir, embd_name + ".safetensors");
-            }
-            if (embd_path.size() > 0) {
-                if (load_embedding(embd_name, embd_path, bpe_tokens)) {
-                    if (word_end != std::string::npos) {
-                        str = str.substr(word_end);
-                    } else {
-                        str = "";
-                    }
-                    return true;
-                }
-            }
-            return false;
+            return replace_embedding(str, bpe_tokens);
         };
 
         std::vector<int> tokens;
@@ -369,156 +515,149 @@ struct FrozenCLIPEmbedderWithCustomWords : public Conditioner {
         return {tokens, weights};
     }
 
-    SDCondition get_learned_condition_common(ggml_context* work_ctx,
-                                             int n_threads,
-                                             std::vector<int>& tokens,
-                                             std::vector<float>& weights,
-                                             int clip_skip,
-                                             int width,
-                                             int height,
-                                             int adm_in_channels        = -1,
-                                             bool force_zero_embeddings = false) {
+    std::vector<SDCondition> get_learned_condition_common(ggml_context* work_ctx,
+                                                          int n_threads,
+                                                          std::vector<std::pair<std::vector<int>, std::vector<float>>>& tokens_and_weights,
+                                                          int clip_skip,
+                                                          int width,
+                                                          int height,
+                                                          int adm_in_channels                            = -1,
+                                                          const std::vector<bool>& force_zero_embeddings = {}) {
         set_clip_skip(clip_skip);
-        int64_t t0                               = ggml_time_ms();
-        struct ggml_tensor* hidden_states        = NULL;  // [N, n_token, hidden_size]
-        struct ggml_tensor* chunk_hidden_states  = NULL;  // [n_token, hidden_size] or [n_token, hidden_size + hidden_size2]
-        struct ggml_tensor* chunk_hidden_states1 = NULL;  // [n_token, hidden_size]
-        struct ggml_tensor* chunk_hidden_states2 = NULL;  // [n_token, hidden_size2]
-        struct ggml_tensor* pooled               = NULL;
-        std::vector<float> hidden_states_vec;
-
-        size_t chunk_len   = 77;
-        size_t chunk_count = tokens.size() / chunk_len;
-        for (int chunk_idx = 0; chunk_idx < chunk_count; chunk_idx++) {
-            std::vector<int> chunk_tokens(tokens.begin() + chunk_idx * chunk_len,
-                                          tokens.begin() + (chunk_idx + 1) * chunk_len);
-            std::vector<float> chunk_weights(weights.begin() + chunk_idx * chunk_len,
-                                             weights.begin() + (chunk_idx + 1) * chunk_len);
-
-            auto input_ids                 = vector_to_ggml_tensor_i32(work_ctx, chunk_tokens);
-            struct ggml_tensor* input_ids2 = NULL;
-            size_t max_token_idx           = 0;
-            if (version == VERSION_SDXL) {
+        int64_t t0 = ggml_time_ms();
+
+        // stack the 77 token chunks of every prompt, each text model then runs one batched forward
+        size_t chunk_len = 77;
+        std::vector<int> batch_tokens;
+        std::vector<int> batch_tokens2;
+        std::vector<int> pooled_tokens;
+        std::vector<size_t> max_token_idxs;
+        for (auto& item : tokens_and_weights) {
+            std::vector<int>& tokens = item.first;
+            size_t chunk_count       = tokens.size() / chunk_len;
+            batch_tokens.insert(batch_tokens.end(), tokens.begin(), tokens.begin() + chunk_count * chunk_len);
+            if (version != VERSION_SDXL) {
+                continue;
+            }
+            for (size_t chunk_idx = 0; chunk_idx < chunk_count; chunk_idx++) {
+                std::vector<int> chunk_tokens(tokens.begin() + chunk_idx * chunk_len,
+                                              tokens.begin() + (chunk_idx + 1) * chunk_len);
                 auto it = std::find(chunk_tokens.begin(), chunk_tokens.end(), tokenizer.EOS_TOKEN_ID);
                 if (it != chunk_tokens.end()) {
                     std::fill(std::next(it), chunk_tokens.end(), 0);
                 }
+                batch_tokens2.insert(batch_tokens2.end(), chunk_tokens.begin(), chunk_tokens.end());
 
-                max_token_idx = std::min<size_t>(std::distance(chunk_tokens.begin(), it), chunk_tokens.size() - 1);
+                if (chunk_idx == 0) {
+                    max_token_idxs.push_back(std::min<size_t>(std::distance(chunk_tokens.begin(), it), chunk_tokens.size() - 1));
+                    pooled_tokens.insert(pooled_tokens.end(), chunk_tokens.begin(), chunk_tokens.end());
+                }
+            }
+        }
+        int64_t n_chunks = batch_tokens.size() / chunk_len;
 
-                input_ids2 = vector_to_ggml_tensor_i32(work_ctx, chunk_tokens);
+        struct ggml_tensor* hidden_states = NULL;  // [n_chunks, n_token, hidden_size] or [n_chunks, n_token, hidden_size + hidden_size2]
+        struct ggml_tensor* pooled        = NULL;  // [n_prompts, projection_dim]
 
-                // for (int i = 0; i < chunk_tokens.size(); i++) {
-                //     printf("%d ", chunk_tokens[i]);
-                // }
-                // printf("\n");
-            }
+        auto input_ids = ggml_reshape_2d(work_ctx, vector_to_ggml_tensor_i32(work_ctx, batch_tokens), chunk_len, n_chunks);
+        text_model->compute(n_threads,
+                            input_ids,
+                            num_custom_embeddings,
+                            token_embed_custom.data(),
+                            {},
+                            false,
+                            &hidden_states,
+                            work_ctx);
+        if (version == VERSION_SDXL) {
+            struct ggml_tensor* hidden_states2 = NULL;  // [n_chunks, n_token, hidden_size2]
+
+            auto input_ids2 = ggml_reshape_2d(work_ctx, vector_to_ggml_tensor_i32(work_ctx, batch_tokens2), chunk_len, n_chunks);
+            text_model2->compute(n_threads,
+                                 input_ids2,
+                                 0,
+                                 NULL,
+                                 {},
+                                 false,
+                                 &hidden_states2,
+                                 work_ctx);
+            // concat
+            hidden_states = ggml_tensor_concat(work_ctx, hidden_states, hidden_states2, 0);
+
+            auto pooled_ids = ggml_reshape_2d(work_ctx, vector_to_ggml_tensor_i32(work_ctx, pooled_tokens), chunk_len, max_token_idxs.size());
+            text_model2->compute(n_threads,
+                                 pooled_ids,
+                                 0,
+                                 NULL,
+                                 max_token_idxs,
+                                 true,
+                                 &pooled,
+                                 work_ctx);
+        }
 
-            {
-                text_model->compute(n_threads,
-                                    input_ids,
-                                    num_custom_embeddings,
-                                    token_embed_custom.data(),
-                                    max_token_idx,
-                                    false,
-                                    &chunk_hidden_states1,
-                                    work_ctx);
-                if (version == VERSION_SDXL) {
-                    text_model2->compute(n_threads,
-                                         input_ids2,
-                                         0,
-                                         NULL,
-                                         max_token_idx,
-                                         false,
-                                         &chunk_hidden_states2, work_ctx);
-                    // concat
-                    chunk_hidden_states = ggml_tensor_concat(work_ctx, chunk_hidden_states1, chunk_hidden_states2, 0);
-
-                    if (chunk_idx == 0) {
-                        text_model2->compute(n_threads,
-                                             input_ids2,
-                                             0,
-                                             NULL,
-                                             max_token_idx,
-                                             true,
-                                             &pooled,
-                                             work_ctx);
-                    }
-                } else {
-                    chunk_hidden_states = chunk_hidden_states1;
-                }
+        int64_t t1 = ggml_time_ms();
+        LOG_DEBUG("computing condition graph of %d prompts (%" PRId64 " chunks) completed, taking %" PRId64 " ms",
+                  (int)tokens_and_weights.size(), n_chunks, t1 - t0);
+
+        std::vector<SDCondition> conds;
+        int64_t hidden_size = hidden_states->ne[0];
+        int64_t chunk_begin = 0;
+        for (size_t i = 0; i < tokens_and_weights.size(); i++) {
+            std::vector<float>& weights = tokens_and_weights[i].second;
+            int64_t chunk_count         = weights.size() / chunk_len;
+
+            ggml_tensor* result = ggml_new_tensor_2d(work_ctx, GGML_TYPE_F32, hidden_size, chunk_count * chunk_len);
+            for (int64_t chunk_idx = 0; chunk_idx < chunk_count; chunk_idx++) {
+                int64_t chunk_nelements = chunk_len * hidden_size;
+                apply_token_weights((float*)hidden_states->data + (chunk_begin + chunk_idx) * chunk_nelements,
+                                    (float*)result->data + chunk_idx * chunk_nelements,
+                                    weights.data() + chunk_idx * chunk_len,
+                                    hidden_size,
+                                    chunk_len);
             }
-
-            int64_t t1 = ggml_time_ms();
-            LOG_DEBUG("computing condition graph completed, taking %" PRId64 " ms", t1 - t0);
-            ggml_tensor* result = ggml_dup_tensor(work_ctx, chunk_hidden_states);
-            {
-                float original_mean = ggml_tensor_mean(chunk_hidden_states);
-                for (int i2 = 0; i2 < chunk_hidden_states->ne[2]; i2++) {
-                    for (int i1 = 0; i1 < chunk_hidden_states->ne[1]; i1++) {
-                        for (int i0 = 0; i0 < chunk_hidden_states->ne[0]; i0++) {
-                            float value = ggml_tensor_get_f32(chunk_hidden_states, i0, i1, i2);
-                            value *= chunk_weights[i1];
-                            ggml_tensor_set_f32(result, value, i0, i1, i2);
-                        }
-                    }
-                }
-                float new_mean = ggml_tensor_mean(result);
-                ggml_tensor_scale(result, (original_mean / new_mean));
+            chunk_begin += chunk_count;
+            if (i < force_zero_embeddings.size() && force_zero_embeddings[i]) {
+                ggml_set_f32(result, 0.f);
             }
-            if (force_zero_embeddings) {
-                float* vec = (float*)result->data;
-                for (int i = 0; i < ggml_nelements(result); i++) {
-                    vec[i] = 0;
-                }
+
+            ggml_tensor* vec = NULL;
+            if (version == VERSION_SDXL) {
+                int out_dim = 256;
+                vec         = ggml_new_tensor_1d(work_ctx, GGML_TYPE_F32, adm_in_channels);
+                // [0:1280]
+                size_t offset = 0;
+                memcpy(vec->data, (char*)pooled->data + pooled->nb[1] * i, pooled->nb[1]);
+                offset += pooled->nb[1];
+
+                // original_size_as_tuple
+                float orig_width             = (float)width;
+                float orig_height            = (float)height;
+                std::vector<float> timesteps = {orig_height, orig_width};
+
+                ggml_tensor* embed_view = ggml_view_2d(work_ctx, vec, out_dim, 2, ggml_type_size(GGML_TYPE_F32) * out_dim, offset);
+                offset += ggml_nbytes(embed_view);
+                set_timestep_embedding(timesteps, embed_view, out_dim);
+                // print_ggml_tensor(ggml_reshape_1d(work_ctx, embed_view, out_dim * 2));
+                // crop_coords_top_left
+                float crop_coord_top  = 0.f;
+                float crop_coord_left = 0.f;
+                timesteps             = {crop_coord_top, crop_coord_left};
+                embed_view            = ggml_view_2d(work_ctx, vec, out_dim, 2, ggml_type_size(GGML_TYPE_F32) * out_dim, offset);
+                offset += ggml_nbytes(embed_view);
+                set_timestep_embedding(timesteps, embed_view, out_dim);
+                // print_ggml_tensor(ggml_reshape_1d(work_ctx, embed_view, out_dim * 2));
+                // target_size_as_tuple
+                float target_width  = (float)width;
+                float target_height = (float)height;
+                timesteps           = {target_height, target_width};
+                embed_view          = ggml_view_2d(work_ctx, vec, out_dim, 2, ggml_type_size(GGML_TYPE_F32) * out_dim, offset);
+                offset += ggml_nbytes(embed_view);
+                set_timestep_embedding(timesteps, embed_view, out_dim);
+                // print_ggml_tensor(ggml_reshape_1d(work_ctx, embed_view, out_dim * 2));
+                GGML_ASSERT(offset == ggml_nbytes(vec));
             }
-            hidden_states_vec.insert(hidden_states_vec.end(), (float*)result->data, ((float*)result->data) + ggml_nelements(result));
+            conds.push_back(SDCondition(result, vec, NULL));
         }
-
-        hidden_states = vector_to_ggml_tensor(work_ctx, hidden_states_vec);
-        hidden_states = ggml_reshape_2d(work_ctx,
-                                        hidden_states,
-                                        chunk_hidden_states->ne[0],
-                                        ggml_nelements(hidden_states) / chunk_hidden_states->ne[0]);
-
-        ggml_tensor* vec = NULL;
-        if (version == VERSION_SDXL) {
-            int out_dim = 256;
-            vec         = ggml_new_tensor_1d(work_ctx, GGML_TYPE_F32, adm_in_channels);
-            // [0:1280]
-            size_t offset = 0;
-            memcpy(vec->data, pooled->data, ggml_nbytes(pooled));
-            offset += ggml_nbytes(pooled);
-
-            // original_size_as_tuple
-            float orig_width             = (float)width;
-            float orig_height            = (float)height;
-            std::vector<float> timesteps = {orig_height, orig_width};
-
-            ggml_tensor* embed_view = ggml_view_2d(work_ctx, vec, out_dim, 2, ggml_type_size(GGML_TYPE_F32) * out_dim, offset);
-            offset += ggml_nbytes(embed_view);
-            set_timestep_embedding(timesteps, embed_view, out_dim);
-            // print_ggml_tensor(ggml_reshape_1d(work_ctx, embed_view, out_dim * 2));
-            // crop_coords_top_left
-            float crop_coord_top  = 0.f;
-            float crop_coord_left = 0.f;
-            timesteps             = {crop_coord_top, crop_coord_left};
-            embed_view            = ggml_view_2d(work_ctx, vec, out_dim, 2, ggml_type_size(GGML_TYPE_F32) * out_dim, offset);
-            offset += ggml_nbytes(embed_view);
-            set_timestep_embedding(timesteps, embed_view, out_dim);
-            // print_ggml_tensor(ggml_reshape_1d(work_ctx, embed_view, out_dim * 2));
-            // target_size_as_tuple
-            float target_width  = (float)width;
-            float target_height = (float)height;
-            timesteps           = {target_height, target_width};
-            embed_view          = ggml_view_2d(work_ctx, vec, out_dim, 2, ggml_type_size(GGML_TYPE_F32) * out_dim, offset);
-            offset += ggml_nbytes(embed_view);
-            set_timestep_embedding(timesteps, embed_view, out_dim);
-            // print_ggml_tensor(ggml_reshape_1d(work_ctx, embed_view, out_dim * 2));
-            GGML_ASSERT(offset == ggml_nbytes(vec));
-        }
-        // print_ggml_tensor(result);
-        return SDCondition(hidden_states, vec, NULL);
+        return conds;
     }
 
     std::tuple<SDCondition, std::vector<bool>>
@@ -540,9 +679,9 @@ struct FrozenCLIPEmbedderWithCustomWords : public Conditioner {
                                                                   num_input_imgs,
                                                                   image_tokens[0],
                                                                   true);
-        std::vector<int>& tokens    = std::get<0>(tokens_and_weights);
-        std::vector<float>& weights = std::get<1>(tokens_and_weights);
-        std::vector<bool>& clsm     = std::get<2>(tokens_and_weights);
+        std::vector<std::pair<std::vector<int>, std::vector<float>>> batch_tokens_and_weights;
+        batch_tokens_and_weights.push_back({std::get<0>(tokens_and_weights), std::get<1>(tokens_and_weights)});
+        std::vector<bool>& clsm = std::get<2>(tokens_and_weights);
         // printf("tokens: \n");
         // for(int i = 0; i < tokens.size(); ++i)
         //    printf("%d ", tokens[i]);
@@ -551,8 +690,8 @@ struct FrozenCLIPEmbedderWithCustomWords : public Conditioner {
         // for(int i = 0; i < clsm.size(); ++i)
         //    printf("%d ", clsm[i]?1:0);
         // printf("\n");
-        auto cond = get_learned_condition_common(work_ctx, n_threads, tokens, weights, clip_skip, width, height, adm_in_channels, force_zero_embeddings);
-        return std::make_tuple(cond, clsm);
+        auto conds = get_learned_condition_common(work_ctx, n_threads, batch_tokens_and_weights, clip_skip, width, height, adm_in_channels, {force_zero_embeddings});
+        return std::make_tuple(conds[0], clsm);
     }
 
     std::string remove_trigger_from_prompt(ggml_context* work_ctx,
@@ -575,10 +714,22 @@ struct FrozenCLIPEmbedderWithCustomWords : public Conditioner {
                                       int height,
                                       int adm_in_channels        = -1,
                                       bool force_zero_embeddings = false) {
-        auto tokens_and_weights     = tokenize(text, true);
-        std::vector<int>& tokens    = tokens_and_weights.first;
-        std::vector<float>& weights = tokens_and_weights.second;
-        return get_learned_condition_common(work_ctx, n_threads, tokens, weights, clip_skip, width, height, adm_in_channels, force_zero_embeddings);
+        return get_learned_conditions(work_ctx, n_threads, {text}, clip_skip, width, height, adm_in_channels, {force_zero_embeddings})[0];
+    }
+
+    std::vector<SDCondition> get_learned_conditions(ggml_context* work_ctx,
+                                                    int n_threads,
+                                                    const std::vector<std::string>& texts,
+                                                    int clip_skip,
+                                                    int width,
+                                                    int height,
+                                                    int adm_in_channels                            = -1,
+                                                    const std::vector<bool>& force_zero_embeddings = {}) {
+        std::vector<std::pair<std::vector<int>, std::vector<float>>> tokens_and_weights;
+        for (const auto& text : texts) {
+            tokens_and_weights.push_back(tokenize(text, true));
+        }
+        return get_learned_condition_common(work_ctx, n_threads, tokens_and_weights, clip_skip, width, height, adm_in_channels, force_zero_embeddings);
     }
 };
 
@@ -599,7 +750,7 @@ struct FrozenCLIPVisionEmbedder : public GGMLRunner {
     }
 
     struct ggml_cgraph* build_graph(struct ggml_tensor* pixel_values) {
-        struct ggml_cgraph* gf = ggml_new_graph(compute_ctx);
+        struct ggml_cgraph* gf = ggml_new_graph_custom(compute_ctx, sd_graph_size(GGML_DEFAULT_GRAPH_SIZE), false);
 
         pixel_values = to_backend(pixel_values);
 
@@ -629,11 +780,13 @@ struct SD3CLIPEmbedder : public Conditioner {
     std::shared_ptr<CLIPTextModelRunner> clip_l;
     std::shared_ptr<CLIPTextModelRunner> clip_g;
     std::shared_ptr<T5Runner> t5;
+    bool t5_mask_padding = false;
 
     SD3CLIPEmbedder(ggml_backend_t backend,
                     ggml_type wtype,
-                    int clip_skip = -1)
-        : wtype(wtype), clip_g_tokenizer(0) {
+                    int clip_skip        = -1,
+                    bool t5_mask_padding = false)
+        : wtype(wtype), clip_g_tokenizer(0), t5_mask_padding(t5_mask_padding) {
         if (clip_skip <= 0) {
             clip_skip = 2;
         }
@@ -736,216 +889,121 @@ struct SD3CLIPEmbedder : public Conditioner {
         return {{clip_l_tokens, clip_l_weights}, {clip_g_tokens, clip_g_weights}, {t5_tokens, t5_weights}};
     }
 
-    SDCondition get_learned_condition_common(ggml_context* work_ctx,
-                                             int n_threads,
-                                             std::vector<std::pair<std::vector<int>, std::vector<float>>> token_and_weights,
-                                             int clip_skip,
-                                             bool force_zero_embeddings = false) {
+    std::vector<SDCondition> get_learned_condition_common(ggml_context* work_ctx,
+                                                          int n_threads,
+                                                          std::vector<std::vector<std::pair<std::vector<int>, std::vector<float>>>>& tokens_and_weights,
+                                                          int clip_skip,
+                                                          const std::vector<bool>& force_zero_embeddings = {}) {
         set_clip_skip(clip_skip);
-        auto& clip_l_tokens  = token_and_weights[0].first;
-        auto& clip_l_weights = token_and_weights[0].second;
-        auto& clip_g_tokens  = token_and_weights[1].first;
-        auto& clip_g_weights = token_and_weights[1].second;
-        auto& t5_tokens      = token_and_weights[2].first;
-        auto& t5_weights     = token_and_weights[2].second;
-
-        int64_t t0                                 = ggml_time_ms();
-        struct ggml_tensor* hidden_states          = NULL;  // [N, n_token*2, 4096]
-        struct ggml_tensor* chunk_hidden_states    = NULL;  // [n_token*2, 4096]
-        struct ggml_tensor* chunk_hidden_states_l  = NULL;  // [n_token, hidden_size_l]
-        struct ggml_tensor* chunk_hidden_states_g  = NULL;  // [n_token, hidden_size_g]
-        struct ggml_tensor* chunk_hidden_states_t5 = NULL;  // [n_token, hidden_size_t5]
-        struct ggml_tensor* pooled                 = NULL;
-        struct ggml_tensor* pooled_l               = NULL;  // [768,]
-        struct ggml_tensor* pooled_g               = NULL;  // [1280,]
-        std::vector<float> hidden_states_vec;
-
-        size_t chunk_len   = 77;
-        size_t chunk_count = clip_l_tokens.size() / chunk_len;
-        for (int chunk_idx = 0; chunk_idx < chunk_count; chunk_idx++) {
-            // clip_l
-            {
-                std::vector<int> chunk_tokens(clip_l_tokens.begin() + chunk_idx * chunk_len,
-                                              clip_l_tokens.begin() + (chunk_idx + 1) * chunk_len);
-                std::vector<float> chunk_weights(clip_l_weights.begin() + chunk_idx * chunk_len,
-                                                 clip_l_weights.begin() + (chunk_idx + 1) * chunk_len);
-
-                auto input_ids       = vector_to_ggml_tensor_i32(work_ctx, chunk_tokens);
-                size_t max_token_idx = 0;
-
-                clip_l->compute(n_threads,
-                                input_ids,
-                                0,
-                                NULL,
-                                max_token_idx,
-                                false,
-                                &chunk_hidden_states_l,
-                                work_ctx);
-                {
-                    auto tensor         = chunk_hidden_states_l;
-                    float original_mean = ggml_tensor_mean(tensor);
-                    for (int i2 = 0; i2 < tensor->ne[2]; i2++) {
-                        for (int i1 = 0; i1 < tensor->ne[1]; i1++) {
-                            for (int i0 = 0; i0 < tensor->ne[0]; i0++) {
-                                float value = ggml_tensor_get_f32(tensor, i0, i1, i2);
-                                value *= chunk_weights[i1];
-                                ggml_tensor_set_f32(tensor, value, i0, i1, i2);
-                            }
-                        }
-                    }
-                    float new_mean = ggml_tensor_mean(tensor);
-                    ggml_tensor_scale(tensor, (original_mean / new_mean));
-                }
-
-                if (chunk_idx == 0) {
-                    // auto it = std::find(chunk_tokens.begin(), chunk_tokens.end(), clip_l_tokenizer.EOS_TOKEN_ID);
-                    // max_token_idx = std::min<size_t>(std::distance(chunk_tokens.begin(), it), chunk_tokens.size() - 1);
-                    // clip_l->compute(n_threads,
-                    //                 input_ids,
-                    //                 0,
-                    //                 NULL,
-                    //                 max_token_idx,
-                    //                 true,
-                    //                 &pooled_l,
-                    //                 work_ctx);
-
-                    // clip_l.transformer.text_model.text_projection no in file, ignore
-                    // TODO: use torch.eye(embed_dim) as default clip_l.transformer.text_model.text_projection
-                    pooled_l = ggml_new_tensor_1d(work_ctx, GGML_TYPE_F32, 768);
-                    ggml_set_f32(pooled_l, 0.f);
-                }
-            }
-
-            // clip_g
-            {
-                std::vector<int> chunk_tokens(clip_g_tokens.begin() + chunk_idx * chunk_len,
-                                              clip_g_tokens.begin() + (chunk_idx + 1) * chunk_len);
-                std::vector<float> chunk_weights(clip_g_weights.begin() + chunk_idx * chunk_len,
-                                                 clip_g_weights.begin() + (chunk_idx + 1) * chunk_len);
-
-                auto input_ids       = vector_to_ggml_tensor_i32(work_ctx, chunk_tokens);
-                size_t max_token_idx = 0;
-
-                clip_g->compute(n_threads,
-                                input_ids,
-                                0,
-                                NULL,
-                                max_token_idx,
-                                false,
-                                &chunk_hidden_states_g,
-                                work_ctx);
-
-                {
-                    auto tensor         = chunk_hidden_states_g;
-                    float original_mean = ggml_tensor_mean(tensor);
-                    for (int i2 = 0; i2 < tensor->ne[2]; i2++) {
-                        for (int i1 = 0; i1 < tensor->ne[1]; i1++) {
-                            for (int i0 = 0; i0 < tensor->ne[0]; i0++) {
-                                float value = ggml_tensor_get_f32(tensor, i0, i1, i2);
-                                value *= chunk_weights[i1];
-                                ggml_tensor_set_f32(tensor, value, i0, i1, i2);
-                            }
-                        }
-                    }
-                    float new_mean = ggml_tensor_mean(tensor);
-                    ggml_tensor_scale(tensor, (original_mean / new_mean));
-                }
+        int64_t t0 = ggml_time_ms();
 
-                if (chunk_idx == 0) {
-                    // auto it = std::find(chunk_tokens.begin(), chunk_tokens.end(), clip_g_tokenizer.EOS_TOKEN_ID);
-                    // max_token_idx = std::min<size_t>(std::distance(chunk_tokens.begin(), it), chunk_tokens.size() - 1);
-                    // clip_g->compute(n_threads,
-                    //                 input_ids,
-                    //                 0,
-                    //                 NULL,
-                    //                 max_token_idx,
-                    //                 true,
-                    //                 &pooled_g,
-                    //                 work_ctx);
-                    // clip_l.transformer.text_model.text_projection no in file, ignore pooled_g too
-
-                    // TODO: fix pooled_g
-                    pooled_g = ggml_new_tensor_1d(work_ctx, GGML_TYPE_F32, 1280);
-                    ggml_set_f32(pooled_g, 0.f);
-                }
-            }
+        // stack the 77 token chunks of every prompt, each text encoder then runs one batched forward
+        size_t chunk_len = 77;
+        std::vector<int> clip_l_tokens;
+        std::vector<int> clip_g_tokens;
+        std::vector<int> t5_tokens;
+        for (auto& item : tokens_and_weights) {
+            size_t chunk_count = item[0].first.size() / chunk_len;
+            clip_l_tokens.insert(clip_l_tokens.end(), item[0].first.begin(), item[0].first.begin() + chunk_count * chunk_len);
+            clip_g_tokens.insert(clip_g_tokens.end(), item[1].first.begin(), item[1].first.begin() + chunk_count * chunk_len);
+            t5_tokens.insert(t5_tokens.end(), item[2].first.begin(), item[2].first.begin() + chunk_count * chunk_len);
+        }
+        int64_t n_chunks = clip_l_tokens.size() / chunk_len;
 
-            // t5
-            {
-                std::vector<int> chunk_tokens(t5_tokens.begin() + chunk_idx * chunk_len,
-                                              t5_tokens.begin() + (chunk_idx + 1) * chunk_len);
-                std::vector<float> chunk_weights(t5_weights.begin() + chunk_idx * chunk_len,
-                                                 t5_weights.begin() + (chunk_idx + 1) * chunk_len);
+        struct ggml_tensor* hidden_states_l  = NULL;  // [n_chunks, n_token, hidden_size_l]
+        struct ggml_tensor* hidden_states_g  = NULL;  // [n_chunks, n_token, hidden_size_g]
+        struct ggml_tensor* hidden_states_t5 = NULL;  // [n_chunks, n_token, hidden_size_t5]
 
-                auto input_ids = vector_to_ggml_tensor_i32(work_ctx, chunk_tokens);
+        // clip_l
+        {
+            auto input_ids = ggml_reshape_2d(work_ctx, vector_to_ggml_tensor_i32(work_ctx, clip_l_tokens), chunk_len, n_chunks);
+            clip_l->compute(n_threads,
+                            input_ids,
+                            0,
+                            NULL,
+                            {},
+                            false,
+                            &hidden_states_l,
+                            work_ctx);
+        }
 
-                t5->compute(n_threads,
+        // clip_g
+        {
+            auto input_ids = ggml_reshape_2d(work_ctx, vector_to_ggml_tensor_i32(work_ctx, clip_g_tokens), chunk_len, n_chunks);
+            clip_g->compute(n_threads,
                             input_ids,
-                            &chunk_hidden_states_t5,
+                            0,
+                            NULL,
+                            {},
+                            false,
+                            &hidden_states_g,
                             work_ctx);
-                {
-                    auto tensor         = chunk_hidden_states_t5;
-                    float original_mean = ggml_tensor_mean(tensor);
-                    for (int i2 = 0; i2 < tensor->ne[2]; i2++) {
-                        for (int i1 = 0; i1 < tensor->ne[1]; i1++) {
-                            for (int i0 = 0; i0 < tensor->ne[0]; i0++) {
-                                float value = ggml_tensor_get_f32(tensor, i0, i1, i2);
-                                value *= chunk_weights[i1];
-                                ggml_tensor_set_f32(tensor, value, i0, i1, i2);
-                            }
-                        }
-                    }
-                    float new_mean = ggml_tensor_mean(tensor);
-                    ggml_tensor_scale(tensor, (original_mean / new_mean));
-                }
-            }
+        }
 
-            auto chunk_hidden_states_lg_pad = ggml_new_tensor_3d(work_ctx,
-                                                                 chunk_hidden_states_l->type,
-                                                                 4096,
-                                                                 chunk_hidden_states_l->ne[1],
-                                                                 chunk_hidden_states_l->ne[2]);  // [n_token, 4096]
-
-            for (int i2 = 0; i2 < chunk_hidden_states_lg_pad->ne[2]; i2++) {
-                for (int i1 = 0; i1 < chunk_hidden_states_lg_pad->ne[1]; i1++) {
-                    for (int i0 = 0; i0 < chunk_hidden_states_lg_pad->ne[0]; i0++) {
-                        float value = 0.f;
-                        if (i0 < chunk_hidden_states_l->ne[0]) {
-                            value = ggml_tensor_get_f32(chunk_hidden_states_l, i0, i1, i2);
-                        } else if (i0 < chunk_hidden_states_l->ne[0] + chunk_hidden_states_g->ne[0]) {
-                            value = ggml_tensor_get_f32(chunk_hidden_states_g, i0 - chunk_hidden_states_l->ne[0], i1, i2);
-                        }
-                        ggml_tensor_set_f32(chunk_hidden_states_lg_pad, value, i0, i1, i2);
-                    }
+        // t5
+        std::vector<int64_t> t5_lengths;
+        hidden_states_t5 = t5_encode_chunks(work_ctx, t5, n_threads, t5_tokens, chunk_len, t5_tokenizer.pad_id(), t5_mask_padding, t5_lengths);
+
+        int64_t t1 = ggml_time_ms();
+        LOG_DEBUG("computing condition graph of %d prompts (%" PRId64 " chunks) completed, taking %" PRId64 " ms",
+                  (int)tokens_and_weights.size(), n_chunks, t1 - t0);
+
+        std::vector<SDCondition> conds;
+        int64_t hidden_size_l  = hidden_states_l->ne[0];
+        int64_t hidden_size_g  = hidden_states_g->ne[0];
+        int64_t hidden_size_t5 = hidden_states_t5->ne[0];
+        int64_t n_token_t5     = hidden_states_t5->ne[1];
+        int64_t chunk_begin    = 0;
+        for (size_t i = 0; i < tokens_and_weights.size(); i++) {
+            auto& clip_l_weights = tokens_and_weights[i][0].second;
+            auto& clip_g_weights = tokens_and_weights[i][1].second;
+            auto& t5_weights     = tokens_and_weights[i][2].second;
+            int64_t chunk_count  = clip_l_weights.size() / chunk_len;
+
+            // every chunk is [n_token*2, 4096]: clip_l and clip_g side by side padded to 4096, followed by t5
+            ggml_tensor* hidden_states = ggml_new_tensor_2d(work_ctx, GGML_TYPE_F32, hidden_size_t5, chunk_count * chunk_len * 2);
+            ggml_set_f32(hidden_states, 0.f);
+            std::vector<float> chunk_l(chunk_len * hidden_size_l);
+            std::vector<float> chunk_g(chunk_len * hidden_size_g);
+            for (int64_t chunk_idx = 0; chunk_idx < chunk_count; chunk_idx++) {
+                int64_t batch_idx = chunk_begin + chunk_idx;
+                apply_token_weights((float*)hidden_states_l->data + batch_idx * chunk_len * hidden_size_l,
+                                    chunk_l.data(),
+                                    clip_l_weights.data() + chunk_idx * chunk_len,
+                                    hidden_size_l,
+                                    chunk_len);
+                apply_token_weights((float*)hidden_states_g->data + batch_idx * chunk_len * hidden_size_g,
+                                    chunk_g.data(),
+                                    clip_g_weights.data() + chunk_idx * chunk_len,
+                                    hidden_size_g,
+                                    chunk_len);
+
+                float* dst = (float*)hidden_states->data + chunk_idx * chunk_len * 2 * hidden_size_t5;
+                for (int64_t i1 = 0; i1 < chunk_len; i1++) {
+                    memcpy(dst + i1 * hidden_size_t5, chunk_l.data() + i1 * hidden_size_l, hidden_size_l * sizeof(float));
+                    memcpy(dst + i1 * hidden_size_t5 + hidden_size_l, chunk_g.data() + i1 * hidden_size_g, hidden_size_g * sizeof(float));
                 }
+                // the masked padding tokens of t5 stay zero
+                apply_token_weights((float*)hidden_states_t5->data + batch_idx * n_token_t5 * hidden_size_t5,
+                                    dst + chunk_len * hidden_size_t5,
+                                    t5_weights.data() + chunk_idx * chunk_len,
+                                    hidden_size_t5,
+                                    t5_lengths[batch_idx]);
             }
-
-            chunk_hidden_states = ggml_tensor_concat(work_ctx, chunk_hidden_states_lg_pad, chunk_hidden_states_t5, 1);  // [n_token*2, 4096]
-
-            if (chunk_idx == 0) {
-                pooled = ggml_tensor_concat(work_ctx, pooled_l, pooled_g, 0);  // [768 + 1280]
+            chunk_begin += chunk_count;
+            if (i < force_zero_embeddings.size() && force_zero_embeddings[i]) {
+                ggml_set_f32(hidden_states, 0.f);
             }
 
-            int64_t t1 = ggml_time_ms();
-            LOG_DEBUG("computing condition graph completed, taking %" PRId64 " ms", t1 - t0);
-            if (force_zero_embeddings) {
-                float* vec = (float*)chunk_hidden_states->data;
-                for (int i = 0; i < ggml_nelements(chunk_hidden_states); i++) {
-                    vec[i] = 0;
-                }
-            }
+            // clip_l.transformer.text_model.text_projection and the pooled output of clip_g are not in the file,
+            // both pooled vectors stay zero
+            // TODO: use torch.eye(embed_dim) as default clip_l.transformer.text_model.text_projection
+            struct ggml_tensor* pooled = ggml_new_tensor_1d(work_ctx, GGML_TYPE_F32, 768 + 1280);  // [768 + 1280]
+            ggml_set_f32(pooled, 0.f);
 
-            hidden_states_vec.insert(hidden_states_vec.end(),
-                                     (float*)chunk_hidden_states->data,
-                                     ((float*)chunk_hidden_states->data) + ggml_nelements(chunk_hidden_states));
+            conds.push_back(SDCondition(hidden_states, pooled, NULL));
         }
-
-        hidden_states = vector_to_ggml_tensor(work_ctx, hidden_states_vec);
-        hidden_states = ggml_reshape_2d(work_ctx,
-                                        hidden_states,
-                                        chunk_hidden_states->ne[0],
-                                        ggml_nelements(hidden_states) / chunk_hidden_states->ne[0]);
-        return SDCondition(hidden_states, pooled, NULL);
+        return conds;
     }
 
     SDCondition get_learned_condition(ggml_context* work_ctx,
@@ -956,7 +1014,21 @@ struct SD3CLIPEmbedder : public Conditioner {
                                       int height,
                                       int adm_in_channels        = -1,
                                       bool force_zero_embeddings = false) {
-        auto tokens_and_weights = tokenize(text, 77, true);
+        return get_learned_conditions(work_ctx, n_threads, {text}, clip_skip, width, height, adm_in_channels, {force_zero_embeddings})[0];
+    }
+
+    std::vector<SDCondition> get_learned_conditions(ggml_context* work_ctx,
+                                                    int n_threads,
+                                                    const std::vector<std::string>& texts,
+                                                    int clip_skip,
+                                                    int width,
+                                                    int height,
+                                                    int adm_in_channels                            = -1,
+                                                    const std::vector<bool>& force_zero_embeddings = {}) {
+        std::vector<std::vector<std::pair<std::vector<int>, std::vector<float>>>> tokens_and_weights;
+        for (const auto& text : texts) {
+            tokens_and_weights.push_back(tokenize(text, 77, true));
+        }
         return get_learned_condition_common(work_ctx, n_threads, tokens_and_weights, clip_skip, force_zero_embeddings);
     }
 
@@ -984,11 +1056,13 @@ struct FluxCLIPEmbedder : public Conditioner {
     T5UniGramTokenizer t5_tokenizer;
     std::shared_ptr<CLIPTextModelRunner> clip_l;
     std::shared_ptr<T5Runner> t5;
+    bool t5_mask_padding = false;
 
     FluxCLIPEmbedder(ggml_backend_t backend,
                      ggml_type wtype,
-                     int clip_skip = -1)
-        : wtype(wtype) {
+                     int clip_skip        = -1,
+                     bool t5_mask_padding = false)
+        : wtype(wtype), t5_mask_padding(t5_mask_padding) {
         if (clip_skip <= 0) {
             clip_skip = 2;
         }
@@ -1073,104 +1147,62 @@ struct FluxCLIPEmbedder : public Conditioner {
         return {{clip_l_tokens, clip_l_weights}, {t5_tokens, t5_weights}};
     }
 
-    SDCondition get_learned_condition_common(ggml_context* work_ctx,
-                                             int n_threads,
-                                             std::vector<std::pair<std::vector<int>, std::vector<float>>> token_and_weights,
-                                             int clip_skip,
-                                             bool force_zero_embeddings = false) {
+    std::vector<SDCondition> get_learned_condition_common(ggml_context* work_ctx,
+                                                          int n_threads,
+                                                          std::vector<std::vector<std::pair<std::vector<int>, std::vector<float>>>>& tokens_and_weights,
+                                                          int clip_skip,
+                                                          const std::vector<bool>& force_zero_embeddings = {}) {
         set_clip_skip(clip_skip);
-        auto& clip_l_tokens  = token_and_weights[0].first;
-        auto& clip_l_weights = token_and_weights[0].second;
-        auto& t5_tokens      = token_and_weights[1].first;
-        auto& t5_weights     = token_and_weights[1].second;
-
-        int64_t t0                              = ggml_time_ms();
-        struct ggml_tensor* hidden_states       = NULL;  // [N, n_token, 4096]
-        struct ggml_tensor* chunk_hidden_states = NULL;  // [n_token, 4096]
-        struct ggml_tensor* pooled              = NULL;  // [768,]
-        std::vector<float> hidden_states_vec;
-
-        size_t chunk_len   = 256;
-        size_t chunk_count = t5_tokens.size() / chunk_len;
-        for (int chunk_idx = 0; chunk_idx < chunk_count; chunk_idx++) {
-            // clip_l
-            if (chunk_idx == 0) {
-                size_t chunk_len_l = 77;
-                std::vector<int> chunk_tokens(clip_l_tokens.begin(),
-                                              clip_l_tokens.begin() + chunk_len_l);
-                std::vector<float> chunk_weights(clip_l_weights.begin(),
-                                                 clip_l_weights.begin() + chunk_len_l);
-
-                auto input_ids       = vector_to_ggml_tensor_i32(work_ctx, chunk_tokens);
-                size_t max_token_idx = 0;
-
-                // auto it = std::find(chunk_tokens.begin(), chunk_tokens.end(), clip_l_tokenizer.EOS_TOKEN_ID);
-                // max_token_idx = std::min<size_t>(std::distance(chunk_tokens.begin(), it), chunk_tokens.size() - 1);
-                // clip_l->compute(n_threads,
-                //                 input_ids,
-                //                 0,
-                //                 NULL,
-                //                 max_token_idx,
-                //                 true,
-                //                 &pooled,
-                //                 work_ctx);
-
-                // clip_l.transformer.text_model.text_projection no in file, ignore
-                // TODO: use torch.eye(embed_dim) as default clip_l.transformer.text_model.text_projection
-                pooled = ggml_new_tensor_1d(work_ctx, GGML_TYPE_F32, 768);
-                ggml_set_f32(pooled, 0.f);
-            }
+        int64_t t0 = ggml_time_ms();
 
-            // t5
-            {
-                std::vector<int> chunk_tokens(t5_tokens.begin() + chunk_idx * chunk_len,
-                                              t5_tokens.begin() + (chunk_idx + 1) * chunk_len);
-                std::vector<float> chunk_weights(t5_weights.begin() + chunk_idx * chunk_len,
-                                                 t5_weights.begin() + (chunk_idx + 1) * chunk_len);
-
-                auto input_ids = vector_to_ggml_tensor_i32(work_ctx, chunk_tokens);
-
-                t5->compute(n_threads,
-                            input_ids,
-                            &chunk_hidden_states,
-                            work_ctx);
-                {
-                    auto tensor         = chunk_hidden_states;
-                    float original_mean = ggml_tensor_mean(tensor);
-                    for (int i2 = 0; i2 < tensor->ne[2]; i2++) {
-                        for (int i1 = 0; i1 < tensor->ne[1]; i1++) {
-                            for (int i0 = 0; i0 < tensor->ne[0]; i0++) {
-                                float value = ggml_tensor_get_f32(tensor, i0, i1, i2);
-                                value *= chunk_weights[i1];
-                                ggml_tensor_set_f32(tensor, value, i0, i1, i2);
-                            }
-                        }
-                    }
-                    float new_mean = ggml_tensor_mean(tensor);
-                    ggml_tensor_scale(tensor, (original_mean / new_mean));
-                }
+        // stack the t5 chunks of every prompt into one batched forward
+        size_t chunk_len = 256;
+        std::vector<int> t5_tokens;
+        for (auto& item : tokens_and_weights) {
+            size_t chunk_count = item[1].first.size() / chunk_len;
+            t5_tokens.insert(t5_tokens.end(), item[1].first.begin(), item[1].first.begin() + chunk_count * chunk_len);
+        }
+        int64_t n_chunks = t5_tokens.size() / chunk_len;
+
+        std::vector<int64_t> t5_lengths;
+        struct ggml_tensor* hidden_states_t5 = t5_encode_chunks(work_ctx, t5, n_threads, t5_tokens, chunk_len, t5_tokenizer.pad_id(), t5_mask_padding, t5_lengths);  // [n_chunks, n_token, 4096]
+
+        int64_t t1 = ggml_time_ms();
+        LOG_DEBUG("computing condition graph of %d prompts (%" PRId64 " chunks) completed, taking %" PRId64 " ms",
+                  (int)tokens_and_weights.size(), n_chunks, t1 - t0);
+
+        std::vector<SDCondition> conds;
+        int64_t hidden_size = hidden_states_t5->ne[0];
+        int64_t n_token_t5  = hidden_states_t5->ne[1];
+        int64_t chunk_begin = 0;
+        for (size_t i = 0; i < tokens_and_weights.size(); i++) {
+            auto& t5_weights    = tokens_and_weights[i][1].second;
+            int64_t chunk_count = t5_weights.size() / chunk_len;
+
+            // the masked padding tokens stay zero
+            ggml_tensor* hidden_states = ggml_new_tensor_2d(work_ctx, GGML_TYPE_F32, hidden_size, chunk_count * chunk_len);  // [n_token, 4096]
+            ggml_set_f32(hidden_states, 0.f);
+            for (int64_t chunk_idx = 0; chunk_idx < chunk_count; chunk_idx++) {
+                int64_t batch_idx = chunk_begin + chunk_idx;
+                apply_token_weights((float*)hidden_states_t5->data + batch_idx * n_token_t5 * hidden_size,
+                                    (float*)hidden_states->data + chunk_idx * chunk_len * hidden_size,
+                                    t5_weights.data() + chunk_idx * chunk_len,
+                                    hidden_size,
+                                    t5_lengths[batch_idx]);
             }
-
-            int64_t t1 = ggml_time_ms();
-            LOG_DEBUG("computing condition graph completed, taking %" PRId64 " ms", t1 - t0);
-            if (force_zero_embeddings) {
-                float* vec = (float*)chunk_hidden_states->data;
-                for (int i = 0; i < ggml_nelements(chunk_hidden_states); i++) {
-                    vec[i] = 0;
-                }
+            chunk_begin += chunk_count;
+            if (i < force_zero_embeddings.size() && force_zero_embeddings[i]) {
+                ggml_set_f32(hidden_states, 0.f);
             }
 
-            hidden_states_vec.insert(hidden_states_vec.end(),
-                                     (float*)chunk_hidden_states->data,
-                                     ((float*)chunk_hidden_states->data) + ggml_nelements(chunk_hidden_states));
-        }
+            // clip_l.transformer.text_model.text_projection no in file, ignore
+            // TODO: use torch.eye(embed_dim) as default clip_l.transformer.text_model.text_projection
+            struct ggml_tensor* pooled = ggml_new_tensor_1d(work_ctx, GGML_TYPE_F32, 768);  // [768,]
+            ggml_set_f32(pooled, 0.f);
 
-        hidden_states = vector_to_ggml_tensor(work_ctx, hidden_states_vec);
-        hidden_states = ggml_reshape_2d(work_ctx,
-                                        hidden_states,
-                                        chunk_hidden_states->ne[0],
-                                        ggml_nelements(hidden_states) / chunk_hidden_states->ne[0]);
-        return SDCondition(hidden_states, pooled, NULL);
+            conds.push_back(SDCondition(hidden_states, pooled, NULL));
+        }
+        return conds;
     }
 
     SDCondition get_learned_condition(ggml_context* work_ctx,
@@ -1181,7 +1213,21 @@ struct FluxCLIPEmbedder : public Conditioner {
                                       int height,
                                       int adm_in_channels        = -1,
                                       bool force_zero_embeddings = false) {
-        auto tokens_and_weights = tokenize(text, 256, true);
+        return get_learned_conditions(work_ctx, n_threads, {text}, clip_skip, width, height, adm_in_channels, {force_zero_embeddings})[0];
+    }
+
+    std::vector<SDCondition> get_learned_conditions(ggml_context* work_ctx,
+                                                    int n_threads,
+                                                    const std::vector<std::string>& texts,
+                                                    int clip_skip,
+                                                    int width,
+                                                    int height,
+                                                    int adm_in_channels                            = -1,
+                                                    const std::vector<bool>& force_zero_embeddings = {}) {
+        std::vector<std::vector<std::pair<std::vector<int>, std::vector<float>>>> tokens_and_weights;
+        for (const auto& text : texts) {
+            tokens_and_weights.push_back(tokenize(text, 256, true));
+        }
         return get_learned_condition_common(work_ctx, n_threads, tokens_and_weights, clip_skip, force_zero_embeddings);
     }
 
@@ -1203,4 +1249,210 @@ struct FluxCLIPEmbedder : public Conditioner {
     }
 };
 
+// Process wide cache of learned conditions, keyed by everything the condition depends on. Entries live in
+// an in-memory LRU and, when a directory is set, also in one file per entry that other processes share.
+class ConditionCache {
+protected:
+    struct CachedTensor {
+        int64_t ne[4] = {0, 0, 0, 0};  // all 0 for a NULL tensor
+        std::vector<float> data;
+
+        void set(const ggml_tensor* tensor) {
+            if (tensor == NULL) {
+                return;
+            }
+            GGML_ASSERT(tensor->type == GGML_TYPE_F32 && ggml_is_contiguous(tensor));
+            for (int i = 0; i < 4; i++) {
+                ne[i] = tensor->ne[i];
+            }
+            data.assign((const float*)tensor->data, (const float*)tensor->data + ggml_nelements(tensor));
+        }
+
+        ggml_tensor* to_tensor(ggml_context* work_ctx) const {
+            if (data.empty()) {
+                return NULL;
+            }
+            ggml_tensor* tensor = ggml_new_tensor_4d(work_ctx, GGML_TYPE_F32, ne[0], ne[1], ne[2], ne[3]);
+            memcpy(tensor->data, data.data(), ggml_nbytes(tensor));
+            return tensor;
+        }
+
+        bool write(FILE* fp) const {
+            uint64_t n = data.size();
+            if (fwrite(ne, sizeof(ne), 1, fp) != 1 || fwrite(&n, sizeof(n), 1, fp) != 1) {
+                return false;
+            }
+            return n == 0 || fwrite(data.data(), sizeof(float) * n, 1, fp) == 1;
+        }
+
+        bool read(FILE* fp) {
+            uint64_t n = 0;
+            if (fread(ne, sizeof(ne), 1, fp) != 1 || fread(&n, sizeof(n), 1, fp) != 1) {
+                return false;
+            }
+            if (n != (uint64_t)(ne[0] * ne[1] * ne[2] * ne[3])) {
+                return false;
+            }
+            data.resize(n);
+            return n == 0 || fread(data.data(), sizeof(float) * n, 1, fp) == 1;
+        }
+    };
+
+    struct Entry {
+        std::string key;
+        CachedTensor c_crossattn;
+        CachedTensor c_vector;
+
+        size_t size() const {
+            return key.size() + (c_crossattn.data.size() + c_vector.data.size()) * sizeof(float);
+        }
+    };
+
+    static const uint32_t FILE_MAGIC   = 0x43434453;  // "SDCC"
+    static const uint32_t FILE_VERSION = 1;
+
+    std::mutex mutex;
+    std::list<Entry> entries;  // most recently used first
+    std::map<std::string, std::list<Entry>::iterator> index;
+    size_t max_size  = CONDITION_CACHE_DEFAULT_SIZE;
+    size_t used_size = 0;
+    std::string dir;
+
+    void erase(std::list<Entry>::iterator iter) {
+        used_size -= iter->size();
+        index.erase(iter->key);
+        entries.erase(iter);
+    }
+
+    void insert(const Entry& entry) {
+        auto iter = index.find(entry.key);
+        if (iter != index.end()) {
+            erase(iter->second);
+        }
+        if (entry.size() > max_size) {
+            return;
+        }
+        entries.push_front(entry);
+        index[entry.key] = entries.begin();
+        used_size += entry.size();
+        while (used_size > max_size) {
+            erase(std::prev(entries.end()));
+        }
+    }
+
+    std::string get_file_path(const std::string& key) {
+        // FNV-1a, the full key is stored in the file to rule out collisions
+        uint64_t hash = 14695981039346656037ull;
+        for (unsigned char c : key) {
+            hash ^= c;
+            hash *= 1099511628211ull;
+        }
+        return format("%s/%016" PRIx64 ".cond", dir.c_str(), hash);
+    }
+
+    bool read_file(const std::string& key, Entry& entry) {
+        FILE* fp = fopen(get_file_path(key).c_str(), "rb");
+        if (fp == NULL) {
+            return false;
+        }
+        uint32_t header[3] = {0, 0, 0};  // magic, version, key length
+        bool ok            = fread(header, sizeof(header), 1, fp) == 1;
+        ok                 = ok && header[0] == FILE_MAGIC && header[1] == FILE_VERSION && header[2] == key.size();
+        if (ok) {
+            entry.key.resize(key.size());
+            ok = fread(&entry.key[0], key.size(), 1, fp) == 1 && entry.key == key;
+            ok = ok && entry.c_crossattn.read(fp) && entry.c_vector.read(fp);
+        }
+        fclose(fp);
+        return ok;
+    }
+
+    void write_file(const Entry& entry) {
+        // written next to the final file and renamed, readers in other processes never see a partial entry
+        std::string file_path = get_file_path(entry.key);
+        std::string tmp_path  = format("%s.%" PRId64 ".tmp", file_path.c_str(), ggml_time_us());
+        FILE* fp              = fopen(tmp_path.c_str(), "wb");
+        if (fp == NULL) {
+            LOG_WARN("failed to write condition cache file '%s'", tmp_path.c_str());
+            return;
+        }
+        uint32_t header[3] = {FILE_MAGIC, FILE_VERSION, (uint32_t)entry.key.size()};
+        bool ok            = fwrite(header, sizeof(header), 1, fp) == 1;
+        ok                 = ok && fwrite(entry.key.data(), entry.key.size(), 1, fp) == 1;
+        ok                 = ok && entry.c_crossattn.write(fp) && entry.c_vector.write(fp);
+        ok                 = fclose(fp) == 0 && ok;
+        if (!ok || std::rename(tmp_path.c_str(), file_path.c_str()) != 0) {
+            // another process may have stored the same entry first
+            std::remove(tmp_path.c_str());
+        }
+    }
+
+public:
+    static ConditionCache& instance() {
+        static ConditionCache cache;
+        return cache;
+    }
+
+    // 0 disables the in-memory tier
+    void set_max_size(size_t size) {
+        std::lock_guard<std::mutex> lock(mutex);
+        max_size = size;
+        while (used_size > max_size) {
+            erase(std::prev(entries.end()));
+        }
+    }
+
+    // empty disables the on-disk tier
+    void set_dir(const std::string& path) {
+        std::lock_guard<std::mutex> lock(mutex);
+        dir = path;
+    }
+
+    // prompts tokenize the same with any number of consecutive spaces
+    static std::string normalize_prompt(const std::string& prompt) {
+        std::string result;
+        for (char c : prompt) {
+            if (c != ' ' || result.empty() || result.back() != ' ') {
+                result.push_back(c);
+            }
+        }
+        return result;
+    }
+
+    bool get(const std::string& key, ggml_context* work_ctx, SDCondition& cond) {
+        std::lock_guard<std::mutex> lock(mutex);
+        auto iter = index.find(key);
+        if (iter != index.end()) {
+            entries.splice(entries.begin(), entries, iter->second);
+        } else {
+            Entry entry;
+            if (dir.empty() || !read_file(key, entry)) {
+                return false;
+            }
+            insert(entry);
+            cond = SDCondition(entry.c_crossattn.to_tensor(work_ctx), entry.c_vector.to_tensor(work_ctx), NULL);
+            return true;
+        }
+        const Entry& entry = *iter->second;
+        cond               = SDCondition(entry.c_crossattn.to_tensor(work_ctx), entry.c_vector.to_tensor(work_ctx), NULL);
+        return true;
+    }
+
+    void put(const std::string& key, const SDCondition& cond) {
+        if (cond.c_crossattn == NULL || cond.c_concat != NULL) {
+            return;
+        }
+        Entry entry;
+        entry.key = key;
+        entry.c_crossattn.set(cond.c_crossattn);
+        entry.c_vector.set(cond.c_vector);
+
+        std::lock_guard<std::mutex> lock(mutex);
+        insert(entry);
+        if (!dir.empty()) {
+            write_file(entry);
+        }
+    }
+};
+
 #endif
\ No newline at end of file
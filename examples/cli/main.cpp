@@ -51,11 +51,19 @@ const char* schedule_str[] = {
     "gits",
 };
 
+// same order as preview_t in stable-diffusion.h
+const char* preview_str[] = {
+    "none",
+    "linear",
+    "tae",
+};
+
 const char* modes_str[] = {
     "txt2img",
     "img2img",
     "img2vid",
     "convert",
+    "analyze",
 };
 
 enum SDMode {
@@ -63,6 +71,7 @@ enum SDMode {
     IMG2IMG,
     IMG2VID,
     CONVERT,
+    ANALYZE,
     MODE_COUNT
 };
 
@@ -81,7 +90,12 @@ struct SDParams {
     std::string embeddings_path;
     std::string stacked_id_embeddings_path;
     std::string input_id_images_path;
+    std::string cond_cache_dir;
+    std::string preview_path = "preview.png";
+    std::string preview_taesd_path;
     sd_type_t wtype = SD_TYPE_COUNT;
+    std::string tensor_type_rules;
+    float target_size_mb = 0.f;
     std::string lora_model_dir;
     std::string output_path = "output.png";
     std::string input_path;
@@ -112,10 +126,22 @@ struct SDParams {
     int64_t seed                  = 42;
     bool verbose                  = false;
     bool vae_tiling               = false;
+    bool vae_tiling_exact         = false;
+    int tile_batch_size           = 1;
+    int vae_decode_budget         = -1;  // MB, < 0 keeps the default
+    int tile_budget               = 0;   // MB, 0 keeps the fixed tile sizes
+    int lora_cache_size           = -1;  // MB, < 0 keeps the default
     bool control_net_cpu          = false;
     bool normalize_input          = false;
     bool clip_on_cpu              = false;
     bool vae_on_cpu               = false;
+    bool lora_runtime             = false;
+    bool t5_mask_padding          = false;
+    int decode_threads            = 0;
+    bool vae_f16                  = false;
+    bool vae_validate             = false;
+    preview_t preview             = PREVIEW_NONE;
+    int preview_interval          = 1;
     bool canny_preprocess         = false;
     bool color                    = false;
     int upscale_repeats           = 1;
@@ -127,6 +153,8 @@ void print_params(SDParams params) {
     printf("    mode:              %s\n", modes_str[params.mode]);
     printf("    model_path:        %s\n", params.model_path.c_str());
     printf("    wtype:             %s\n", params.wtype < SD_TYPE_COUNT ? sd_type_name(params.wtype) : "unspecified");
+    printf("    tensor_type_rules: %s\n", params.tensor_type_rules.c_str());
+    printf("    target_size:       %.2fMB\n", params.target_size_mb);
     printf("    clip_l_path:       %s\n", params.clip_l_path.c_str());
     printf("    t5xxl_path:        %s\n", params.t5xxl_path.c_str());
     printf("    diffusion_model_path:   %s\n", params.diffusion_model_path.c_str());
@@ -136,6 +164,7 @@ void print_params(SDParams params) {
     printf("    controlnet_path:   %s\n", params.controlnet_path.c_str());
     printf("    embeddings_path:   %s\n", params.embeddings_path.c_str());
     printf("    stacked_id_embeddings_path:   %s\n", params.stacked_id_embeddings_path.c_str());
+    printf("    cond_cache_dir:    %s\n", params.cond_cache_dir.c_str());
     printf("    input_id_images_path:   %s\n", params.input_id_images_path.c_str());
     printf("    style ratio:       %.2f\n", params.style_ratio);
     printf("    normalize input image :  %s\n", params.normalize_input ? "true" : "false");
@@ -145,6 +174,12 @@ void print_params(SDParams params) {
     printf("    clip on cpu:       %s\n", params.clip_on_cpu ? "true" : "false");
     printf("    controlnet cpu:    %s\n", params.control_net_cpu ? "true" : "false");
     printf("    vae decoder on cpu:%s\n", params.vae_on_cpu ? "true" : "false");
+    printf("    lora runtime:      %s\n", params.lora_runtime ? "true" : "false");
+    printf("    t5 mask padding:   %s\n", params.t5_mask_padding ? "true" : "false");
+    printf("    decode threads:    %d\n", params.decode_threads);
+    printf("    vae f16:           %s%s\n", params.vae_f16 ? "true" : "false", params.vae_validate ? " (validated)" : "");
+    printf("    preview:           %s every %d steps to %s\n", preview_str[params.preview], params.preview_interval, params.preview_path.c_str());
+    printf("    preview_taesd_path: %s\n", params.preview_taesd_path.c_str());
     printf("    strength(control): %.2f\n", params.control_strength);
     printf("    prompt:            %s\n", params.prompt.c_str());
     printf("    negative_prompt:   %s\n", params.negative_prompt.c_str());
@@ -162,6 +197,11 @@ void print_params(SDParams params) {
     printf("    seed:              %ld\n", params.seed);
     printf("    batch_count:       %d\n", params.batch_count);
     printf("    vae_tiling:        %s\n", params.vae_tiling ? "true" : "false");
+    printf("    vae_tiling_exact:  %s\n", params.vae_tiling_exact ? "true" : "false");
+    printf("    tile_batch_size:   %d\n", params.tile_batch_size);
+    printf("    vae decode budget: %d MB\n", params.vae_decode_budget);
+    printf("    tile budget:       %d MB\n", params.tile_budget);
+    printf("    lora cache size:   %d MB\n", params.lora_cache_size);
     printf("    upscale_repeats:   %d\n", params.upscale_repeats);
 }
 
@@ -170,7 +210,7 @@ void print_usage(int argc, const char* argv[]) {
     printf("\n");
     printf("arguments:\n");
     printf("  -h, --help                         show this help message and exit\n");
-    printf("  -M, --mode [MODEL]                 run mode (txt2img or img2img or convert, default: txt2img)\n");
+    printf("  -M, --mode [MODEL]                 run mode (txt2img or img2img or convert or analyze, default: txt2img)\n");
     printf("  -t, --threads N                    number of threads to use during computation (default: -1).\n");
     printf("                                     If threads <= 0, then threads will be set to the number of CPU physical cores\n");
     printf("  -m, --model [MODEL]                path to full model\n");
@@ -183,11 +223,16 @@ void print_usage(int argc, const char* argv[]) {
     printf("  --embd-dir [EMBEDDING_PATH]        path to embeddings.\n");
     printf("  --stacked-id-embd-dir [DIR]        path to PHOTOMAKER stacked id embeddings.\n");
     printf("  --input-id-images-dir [DIR]        path to PHOTOMAKER input id images dir.\n");
+    printf("  --cond-cache-dir [DIR]             store encoded prompts in DIR and reuse them in later runs\n");
     printf("  --normalize-input                  normalize PHOTOMAKER input id images\n");
     printf("  --upscale-model [ESRGAN_PATH]      path to esrgan model. Upscale images after generate, just RealESRGAN_x4plus_anime_6B supported by now.\n");
     printf("  --upscale-repeats                  Run the ESRGAN upscaler this many times (default 1)\n");
     printf("  --type [TYPE]                      weight type (f32, f16, q4_0, q4_1, q5_0, q5_1, q8_0, q2_k, q3_k, q4_k)\n");
     printf("                                     If not specified, the default is the type of the weight file.\n");
+    printf("  --tensor-type-rules [FILE|@preset] per tensor type rules used by convert mode, \"@preset\" keeps\n");
+    printf("                                     the sensitive layers of the model at a higher precision\n");
+    printf("  --target-size SIZE                 model size in MB the tensor types are selected for in analyze mode,\n");
+    printf("                                     the selected types are written as tensor type rules to --output\n");
     printf("  --lora-model-dir [DIR]             lora model directory\n");
     printf("  -i, --init-img [IMAGE]             path to the input image, required by img2img\n");
     printf("  --control-image [IMAGE]            path to image condition, control net\n");
@@ -210,9 +255,35 @@ void print_usage(int argc, const char* argv[]) {
     printf("  --schedule {discrete, karras, exponential, ays, gits} Denoiser sigma schedule (default: discrete)\n");
     printf("  --clip-skip N                      ignore last layers of CLIP network; 1 ignores none, 2 ignores one layer (default: -1)\n");
     printf("                                     <= 0 represents unspecified, will be 1 for SD1.x, 2 for SD2.x\n");
-    printf("  --vae-tiling                       process vae in tiles to reduce memory usage\n");
+    printf("  --vae-tiling                       process vae in tiles to reduce memory usage, encoded tiles are normalized\n");
+    printf("                                     on their own and their colors may drift apart a little\n");
+    printf("  --vae-tiling-exact                 with --vae-tiling, normalize encoded tiles with the statistics of the whole\n");
+    printf("                                     image; slow, over ten times the cost of the encode\n");
+    printf("  --tile-batch N                     process N vae or upscale tiles at once, faster but uses more memory (default: 1)\n");
+    printf("  --tile-budget MB                   memory a vae or upscale tile may use, tiles are then as large as fits and\n");
+    printf("                                     fastest, measured once per run (default: 0, fixed tile sizes)\n");
+    printf("  --vae-decode-budget MB             vae memory a decode may use, larger images are decoded in tiles and the\n");
+    printf("                                     images of a batch together as far as they fit (default: 0, unlimited)\n");
     printf("  --vae-on-cpu                       keep vae in cpu (for low vram)\n");
     printf("  --clip-on-cpu                      keep clip in cpu (for low vram).\n");
+    printf("  --lora-cache-size MB               memory kept for loaded loras when switching between them, on the gpu\n");
+    printf("                                     with gpu builds, 0 disables (default: 0)\n");
+    printf("  --lora-runtime                     run loras next to the model weights instead of merging them,\n");
+    printf("                                     switching loras is cheap and quantized weights stay untouched\n");
+    printf("  --t5-mask-padding                  encode only the real t5 tokens and mask the padding (flux, sd3),\n");
+    printf("                                     much faster for short prompts, output differs slightly from unmasked t5\n");
+    printf("  --preview {none, linear, tae}      preview the image while sampling, linear is nearly free,\n");
+    printf("                                     tae needs --taesd or --preview-taesd (default: none)\n");
+    printf("  --preview-taesd [TAESD_PATH]       path to a taesd that only decodes the tae previews, the images\n");
+    printf("                                     are still decoded with the vae\n");
+    printf("  --preview-interval N               preview every N steps (default: 1)\n");
+    printf("  --preview-path [PATH]              path of the preview image (default: ./preview.png)\n");
+    printf("  --decode-threads N                 decode an image on N of the threads while the next one is sampled,\n");
+    printf("                                     needs the vae on the cpu, see --vae-on-cpu (default: 0, off)\n");
+    printf("  --vae-f16                          decode the sdxl vae with f16 activations, faster and smaller,\n");
+    printf("                                     needs the SDXL VAE FP16 Fix, the original one overflows\n");
+    printf("  --vae-validate                     decode again with f32 activations and log the pixel error of\n");
+    printf("                                     the f16 decode\n");
     printf("  --control-net-cpu                  keep controlnet in cpu (for low vram)\n");
     printf("  --canny                            apply canny preprocessor (edge detection)\n");
     printf("  --color                            Colors the logging tags according to level\n");
@@ -310,6 +381,12 @@ void parse_args(int argc, const char** argv, SDParams& params) {
                 break;
             }
             params.stacked_id_embeddings_path = argv[i];
+        } else if (arg == "--cond-cache-dir") {
+            if (++i >= argc) {
+                invalid_arg = true;
+                break;
+            }
+            params.cond_cache_dir = argv[i];
         } else if (arg == "--input-id-images-dir") {
             if (++i >= argc) {
                 invalid_arg = true;
@@ -347,6 +424,18 @@ void parse_args(int argc, const char** argv, SDParams& params) {
                         type.c_str());
                 exit(1);
             }
+        } else if (arg == "--tensor-type-rules") {
+            if (++i >= argc) {
+                invalid_arg = true;
+                break;
+            }
+            params.tensor_type_rules = argv[i];
+        } else if (arg == "--target-size") {
+            if (++i >= argc) {
+                invalid_arg = true;
+                break;
+            }
+            params.target_size_mb = std::stof(argv[i]);
         } else if (arg == "--lora-model-dir") {
             if (++i >= argc) {
                 invalid_arg = true;
@@ -449,6 +538,26 @@ void parse_args(int argc, const char** argv, SDParams& params) {
             params.clip_skip = std::stoi(argv[i]);
         } else if (arg == "--vae-tiling") {
             params.vae_tiling = true;
+        } else if (arg == "--vae-tiling-exact") {
+            params.vae_tiling_exact = true;
+        } else if (arg == "--tile-batch") {
+            if (++i >= argc) {
+                invalid_arg = true;
+                break;
+            }
+            params.tile_batch_size = std::stoi(argv[i]);
+        } else if (arg == "--vae-decode-budget") {
+            if (++i >= argc) {
+                invalid_arg = true;
+                break;
+            }
+            params.vae_decode_budget = std::stoi(argv[i]);
+        } else if (arg == "--tile-budget") {
+            if (++i >= argc) {
+                invalid_arg = true;
+                break;
+            }
+            params.tile_budget = std::stoi(argv[i]);
         } else if (arg == "--control-net-cpu") {
             params.control_net_cpu = true;
         } else if (arg == "--normalize-input") {
@@ -457,6 +566,26 @@ void parse_args(int argc, const char** argv, SDParams& params) {
             params.clip_on_cpu = true;  // will slow down get_learned_condiotion but necessary for low MEM GPUs
         } else if (arg == "--vae-on-cpu") {
             params.vae_on_cpu = true;  // will slow down latent decoding but necessary for low MEM GPUs
+        } else if (arg == "--lora-cache-size") {
+            if (++i >= argc) {
+                invalid_arg = true;
+                break;
+            }
+            params.lora_cache_size = std::stoi(argv[i]);
+        } else if (arg == "--lora-runtime") {
+            params.lora_runtime = true;
+        } else if (arg == "--t5-mask-padding") {
+            params.t5_mask_padding = true;
+        } else if (arg == "--decode-threads") {
+            if (++i >= argc) {
+                invalid_arg = true;
+                break;
+            }
+            params.decode_threads = std::stoi(argv[i]);
+        } else if (arg == "--vae-f16") {
+            params.vae_f16 = true;
+        } else if (arg == "--vae-validate") {
+            params.vae_validate = true;
         } else if (arg == "--canny") {
             params.canny_preprocess = true;
         } else if (arg == "-b" || arg == "--batch-count") {
@@ -479,6 +608,41 @@ void parse_args(int argc, const char** argv, SDParams& params) {
                 invalid_arg = true;
                 break;
             }
+        } else if (arg == "--preview") {
+            if (++i >= argc) {
+                invalid_arg = true;
+                break;
+            }
+            const char* preview_selected = argv[i];
+            int preview_found            = -1;
+            for (int d = 0; d < N_PREVIEWS; d++) {
+                if (!strcmp(preview_selected, preview_str[d])) {
+                    preview_found = d;
+                }
+            }
+            if (preview_found == -1) {
+                invalid_arg = true;
+                break;
+            }
+            params.preview = (preview_t)preview_found;
+        } else if (arg == "--preview-interval") {
+            if (++i >= argc) {
+                invalid_arg = true;
+                break;
+            }
+            params.preview_interval = std::stoi(argv[i]);
+        } else if (arg == "--preview-path") {
+            if (++i >= argc) {
+                invalid_arg = true;
+                break;
+            }
+            params.preview_path = argv[i];
+        } else if (arg == "--preview-taesd") {
+            if (++i >= argc) {
+                invalid_arg = true;
+                break;
+            }
+            params.preview_taesd_path = argv[i];
         } else if (arg == "--schedule") {
             if (++i >= argc) {
                 invalid_arg = true;
@@ -541,7 +705,7 @@ void parse_args(int argc, const char** argv, SDParams& params) {
         params.n_threads = get_num_physical_cores();
     }
 
-    if (params.mode != CONVERT && params.mode != IMG2VID && params.prompt.length() == 0) {
+    if (params.mode != CONVERT && params.mode != ANALYZE && params.mode != IMG2VID && params.prompt.length() == 0) {
         fprintf(stderr, "error: the following arguments are required: prompt\n");
         print_usage(argc, argv);
         exit(1);
@@ -595,6 +759,16 @@ void parse_args(int argc, const char** argv, SDParams& params) {
             params.output_path = "output.gguf";
         }
     }
+
+    if (params.mode == ANALYZE) {
+        if (params.target_size_mb <= 0.f) {
+            fprintf(stderr, "error: analyze mode requires a target size\n");
+            exit(1);
+        }
+        if (params.output_path == "output.png") {
+            params.output_path = "tensor_type_rules.txt";
+        }
+    }
 }
 
 static std::string sd_basename(const std::string& path) {
@@ -673,12 +847,20 @@ void sd_log_cb(enum sd_log_level_t level, const char* log, void* data) {
     fflush(out_stream);
 }
 
+void sd_preview_cb(int step, int steps, const sd_image_t* images, int n_images, void* data) {
+    SDParams* params = (SDParams*)data;
+    if (n_images > 0) {
+        stbi_write_png(params->preview_path.c_str(), images[0].width, images[0].height, images[0].channel, images[0].data, 0, NULL);
+    }
+}
+
 int main(int argc, const char* argv[]) {
     SDParams params;
 
     parse_args(argc, argv, params);
 
     sd_set_log_callback(sd_log_cb, (void*)&params);
+    sd_set_preview_callback(sd_preview_cb, params.preview, params.preview_interval, (void*)&params);
 
     if (params.verbose) {
         print_params(params);
@@ -686,7 +868,12 @@ int main(int argc, const char* argv[]) {
     }
 
     if (params.mode == CONVERT) {
-        bool success = convert(params.model_path.c_str(), params.vae_path.c_str(), params.output_path.c_str(), params.wtype);
+        bool success = convert(params.model_path.c_str(),
+                               params.vae_path.c_str(),
+                               params.output_path.c_str(),
+                               params.wtype,
+                               params.tensor_type_rules.c_str(),
+                               params.n_threads);
         if (!success) {
             fprintf(stderr,
                     "convert '%s'/'%s' to '%s' failed\n",
@@ -703,6 +890,22 @@ int main(int argc, const char* argv[]) {
         }
     }
 
+    if (params.mode == ANALYZE) {
+        bool success = analyze_quantization(params.model_path.c_str(),
+                                            params.vae_path.c_str(),
+                                            params.output_path.c_str(),
+                                            NULL,
+                                            0,
+                                            (uint64_t)(params.target_size_mb * 1024 * 1024),
+                                            params.n_threads);
+        if (!success) {
+            fprintf(stderr, "analyze '%s' failed\n", params.model_path.c_str());
+            return 1;
+        }
+        printf("tensor type rules saved to '%s'\n", params.output_path.c_str());
+        return 0;
+    }
+
     if (params.mode == IMG2VID) {
         fprintf(stderr, "SVD support is broken, do not use it!!!\n");
         return 1;
@@ -763,6 +966,17 @@ int main(int argc, const char* argv[]) {
         }
     }
 
+    sd_set_condition_cache_dir(params.cond_cache_dir.c_str());
+    sd_set_tile_batch_size(params.tile_batch_size);
+    if (params.lora_cache_size >= 0) {
+        sd_set_lora_cache_size((uint64_t)params.lora_cache_size * 1024 * 1024);
+    }
+    sd_set_tile_memory_budget((uint64_t)std::max(params.tile_budget, 0) * 1024 * 1024);
+    if (params.vae_decode_budget >= 0) {
+        sd_set_vae_decode_budget((uint64_t)params.vae_decode_budget * 1024 * 1024);
+    }
+    sd_set_vae_tiling_exact(params.vae_tiling_exact);
+
     sd_ctx_t* sd_ctx = new_sd_ctx(params.model_path.c_str(),
                                   params.clip_l_path.c_str(),
                                   params.t5xxl_path.c_str(),
@@ -782,7 +996,13 @@ int main(int argc, const char* argv[]) {
                                   params.schedule,
                                   params.clip_on_cpu,
                                   params.control_net_cpu,
-                                  params.vae_on_cpu);
+                                  params.vae_on_cpu,
+                                  params.lora_runtime,
+                                  params.t5_mask_padding,
+                                  params.decode_threads,
+                                  params.vae_f16,
+                                  params.vae_validate,
+                                  params.preview_taesd_path.c_str());
 
     if (sd_ctx == NULL) {
         printf("new_sd_ctx_t failed\n");
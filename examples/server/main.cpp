@@ -99,9 +99,21 @@ struct SDParams {
     int64_t seed                  = 42;
     bool verbose                  = false;
     bool vae_tiling               = false;
+    bool vae_tiling_exact         = false;
+    int tile_batch_size           = 1;
+    int vae_decode_budget         = -1;  // MB, < 0 keeps the default
+    int tile_budget               = 0;   // MB, 0 keeps the fixed tile sizes
     bool normalize_input          = false;
     bool clip_on_cpu              = false;
     bool vae_on_cpu               = false;
+    bool lora_runtime             = false;
+    bool t5_mask_padding          = false;
+    int decode_threads            = 0;
+    bool vae_f16                  = false;
+    bool vae_validate             = false;
+    int lora_cache_size           = -1;  // MB, < 0 keeps the default
+    int cond_cache_size           = -1;  // MB, < 0 keeps the default
+    std::string cond_cache_dir;
     bool color                    = false;
 
     //server things
@@ -126,6 +138,13 @@ void print_params(SDParams params) {
     printf("    output_path:       %s\n", params.output_path.c_str());
     printf("    clip on cpu:       %s\n", params.clip_on_cpu ? "true" : "false");
     printf("    vae decoder on cpu:%s\n", params.vae_on_cpu ? "true" : "false");
+    printf("    lora runtime:      %s\n", params.lora_runtime ? "true" : "false");
+    printf("    t5 mask padding:   %s\n", params.t5_mask_padding ? "true" : "false");
+    printf("    decode threads:    %d\n", params.decode_threads);
+    printf("    vae f16:           %s%s\n", params.vae_f16 ? "true" : "false", params.vae_validate ? " (validated)" : "");
+    printf("    lora cache size:   %d MB\n", params.lora_cache_size);
+    printf("    cond cache size:   %d MB\n", params.cond_cache_size);
+    printf("    cond cache dir:    %s\n", params.cond_cache_dir.c_str());
     printf("    prompt:            %s\n", params.prompt.c_str());
     printf("    negative_prompt:   %s\n", params.negative_prompt.c_str());
     printf("    min_cfg:           %.2f\n", params.min_cfg);
@@ -142,6 +161,10 @@ void print_params(SDParams params) {
     printf("    seed:              %ld\n", params.seed);
     printf("    batch_count:       %d\n", params.batch_count);
     printf("    vae_tiling:        %s\n", params.vae_tiling ? "true" : "false");
+    printf("    vae_tiling_exact:  %s\n", params.vae_tiling_exact ? "true" : "false");
+    printf("    tile_batch_size:   %d\n", params.tile_batch_size);
+    printf("    vae decode budget: %d MB\n", params.vae_decode_budget);
+    printf("    tile budget:       %d MB\n", params.tile_budget);
 }
 
 void print_usage(int argc, const char* argv[]) {
@@ -180,9 +203,30 @@ void print_usage(int argc, const char* argv[]) {
     printf("  --schedule {discrete, karras, ays} Denoiser sigma schedule (default: discrete)\n");
     printf("  --clip-skip N                      ignore last layers of CLIP network; 1 ignores none, 2 ignores one layer (default: -1)\n");
     printf("                                     <= 0 represents unspecified, will be 1 for SD1.x, 2 for SD2.x\n");
-    printf("  --vae-tiling                       process vae in tiles to reduce memory usage\n");
+    printf("  --vae-tiling                       process vae in tiles to reduce memory usage, encoded tiles are normalized\n");
+    printf("                                     on their own and their colors may drift apart a little\n");
+    printf("  --vae-tiling-exact                 with --vae-tiling, normalize encoded tiles with the statistics of the whole\n");
+    printf("                                     image; slow, over ten times the cost of the encode\n");
+    printf("  --tile-batch N                     process N vae tiles at once, faster but uses more memory (default: 1)\n");
+    printf("  --tile-budget MB                   memory a vae tile may use, tiles are then as large as fits and\n");
+    printf("                                     fastest, measured once per run (default: 0, fixed tile sizes)\n");
+    printf("  --vae-decode-budget MB             vae memory a decode may use, larger images are decoded in tiles and the\n");
+    printf("                                     images of a batch together as far as they fit (default: 0, unlimited)\n");
     printf("  --vae-on-cpu                       keep vae in cpu (for low vram)\n");
     printf("  --clip-on-cpu                      keep clip in cpu (for low vram).\n");
+    printf("  --lora-runtime                     run loras next to the model weights instead of merging them,\n");
+    printf("                                     switching loras is cheap and quantized weights stay untouched\n");
+    printf("  --t5-mask-padding                  encode only the real t5 tokens and mask the padding (flux, sd3),\n");
+    printf("                                     much faster for short prompts, output differs slightly from unmasked t5\n");
+    printf("  --decode-threads N                 decode an image on N of the threads while the next one is sampled,\n");
+    printf("                                     needs the vae on the cpu, see --vae-on-cpu (default: 0, off)\n");
+    printf("  --vae-f16                          decode the sdxl vae with f16 activations, faster and smaller,\n");
+    printf("                                     needs the SDXL VAE FP16 Fix, the original one overflows\n");
+    printf("  --vae-validate                     decode again with f32 activations and log the pixel error of\n");
+    printf("                                     the f16 decode\n");
+    printf("  --lora-cache-size MB               memory kept for loaded loras between requests, 0 disables (default: 0)\n");
+    printf("  --cond-cache-size MB               memory kept for encoded prompts between requests, 0 disables (default: 256)\n");
+    printf("  --cond-cache-dir [DIR]             also store encoded prompts in DIR, shared with other processes\n");
     printf("  --color                            Colors the logging tags according to level\n");
     printf("  -v, --verbose                      print extra info\n");
     printf("  --port                             port used for server (default: 8080)\n");
@@ -389,12 +433,64 @@ void parse_args(int argc, const char** argv, SDParams& params) {
             params.clip_skip = std::stoi(argv[i]);
         } else if (arg == "--vae-tiling") {
             params.vae_tiling = true;
+        } else if (arg == "--vae-tiling-exact") {
+            params.vae_tiling_exact = true;
+        } else if (arg == "--tile-batch") {
+            if (++i >= argc) {
+                invalid_arg = true;
+                break;
+            }
+            params.tile_batch_size = std::stoi(argv[i]);
+        } else if (arg == "--vae-decode-budget") {
+            if (++i >= argc) {
+                invalid_arg = true;
+                break;
+            }
+            params.vae_decode_budget = std::stoi(argv[i]);
+        } else if (arg == "--tile-budget") {
+            if (++i >= argc) {
+                invalid_arg = true;
+                break;
+            }
+            params.tile_budget = std::stoi(argv[i]);
         } else if (arg == "--normalize-input") {
             params.normalize_input = true;
         } else if (arg == "--clip-on-cpu") {
             params.clip_on_cpu = true;  // will slow down get_learned_condiotion but necessary for low MEM GPUs
         } else if (arg == "--vae-on-cpu") {
             params.vae_on_cpu = true;  // will slow down latent decoding but necessary for low MEM GPUs
+        } else if (arg == "--lora-runtime") {
+            params.lora_runtime = true;
+        } else if (arg == "--t5-mask-padding") {
+            params.t5_mask_padding = true;
+        } else if (arg == "--decode-threads") {
+            if (++i >= argc) {
+                invalid_arg = true;
+                break;
+            }
+            params.decode_threads = std::stoi(argv[i]);
+        } else if (arg == "--vae-f16") {
+            params.vae_f16 = true;
+        } else if (arg == "--vae-validate") {
+            params.vae_validate = true;
+        } else if (arg == "--lora-cache-size") {
+            if (++i >= argc) {
+                invalid_arg = true;
+                break;
+            }
+            params.lora_cache_size = std::stoi(argv[i]);
+        } else if (arg == "--cond-cache-size") {
+            if (++i >= argc) {
+                invalid_arg = true;
+                break;
+            }
+            params.cond_cache_size = std::stoi(argv[i]);
+        } else if (arg == "--cond-cache-dir") {
+            if (++i >= argc) {
+                invalid_arg = true;
+                break;
+            }
+            params.cond_cache_dir = argv[i];
         } else if (arg == "-b" || arg == "--batch-count") {
             if (++i >= argc) {
                 invalid_arg = true;
@@ -642,6 +738,20 @@ int main(int argc, const char* argv[]) {
 
     bool vae_decode_only          = true;
  
+    if (params.lora_cache_size >= 0) {
+        sd_set_lora_cache_size((uint64_t)params.lora_cache_size * 1024 * 1024);
+    }
+    if (params.cond_cache_size >= 0) {
+        sd_set_condition_cache_size((uint64_t)params.cond_cache_size * 1024 * 1024);
+    }
+    sd_set_condition_cache_dir(params.cond_cache_dir.c_str());
+    sd_set_tile_batch_size(params.tile_batch_size);
+    sd_set_tile_memory_budget((uint64_t)std::max(params.tile_budget, 0) * 1024 * 1024);
+    if (params.vae_decode_budget >= 0) {
+        sd_set_vae_decode_budget((uint64_t)params.vae_decode_budget * 1024 * 1024);
+    }
+    sd_set_vae_tiling_exact(params.vae_tiling_exact);
+
     sd_ctx_t* sd_ctx = new_sd_ctx(params.model_path.c_str(),
                                   params.clip_l_path.c_str(),
                                   params.t5xxl_path.c_str(),
@@ -661,7 +771,13 @@ int main(int argc, const char* argv[]) {
                                   params.schedule,
                                   params.clip_on_cpu,
                                   true,
-                                  params.vae_on_cpu);
+                                  params.vae_on_cpu,
+                                  params.lora_runtime,
+                                  params.t5_mask_padding,
+                                  params.decode_threads,
+                                  params.vae_f16,
+                                  params.vae_validate,
+                                  "");
 
     if (sd_ctx == NULL) {
         printf("new_sd_ctx_t failed\n");
@@ -831,7 +831,7 @@ namespace Flux {
                                         struct ggml_tensor* y,
                                         struct ggml_tensor* guidance) {
             GGML_ASSERT(x->ne[3] == 1);
-            struct ggml_cgraph* gf = ggml_new_graph_custom(compute_ctx, FLUX_GRAPH_SIZE, false);
+            struct ggml_cgraph* gf = ggml_new_graph_custom(compute_ctx, sd_graph_size(FLUX_GRAPH_SIZE), false);
 
             x         = to_backend(x);
             context   = to_backend(context);
@@ -5,18 +5,22 @@
 #include <inttypes.h>
 #include <stdarg.h>
 #include <algorithm>
+#include <climits>
 #include <cstring>
 #include <fstream>
 #include <functional>
 #include <iostream>
 #include <iterator>
+#include <list>
 #include <map>
 #include <memory>
+#include <mutex>
 #include <random>
 #include <regex>
 #include <set>
 #include <sstream>
 #include <string>
+#include <thread>
 #include <unordered_map>
 #include <vector>
 
@@ -335,10 +339,12 @@ __STATIC_INLINE__ void sd_image_f32_to_tensor(const float* image_data,
     }
 }
 
+// copies the tile at (x, y) of input into the batch entry n of output
 __STATIC_INLINE__ void ggml_split_tensor_2d(struct ggml_tensor* input,
                                             struct ggml_tensor* output,
                                             int x,
-                                            int y) {
+                                            int y,
+                                            int n = 0) {
     int64_t width    = output->ne[0];
     int64_t height   = output->ne[1];
     int64_t channels = output->ne[2];
@@ -347,7 +353,7 @@ __STATIC_INLINE__ void ggml_split_tensor_2d(struct ggml_tensor* input,
         for (int ix = 0; ix < width; ix++) {
             for (int k = 0; k < channels; k++) {
                 float value = ggml_tensor_get_f32(input, ix + x, iy + y, k);
-                ggml_tensor_set_f32(output, value, ix, iy, k);
+                ggml_tensor_set_f32(output, value, ix, iy, k, n);
             }
         }
     }
@@ -359,11 +365,13 @@ __STATIC_INLINE__ float ggml_smootherstep_f32(const float x) {
     return x * x * x * (x * (6.0f * x - 15.0f) + 10.0f);
 }
 
+// blends the batch entry n of input into output at (x, y)
 __STATIC_INLINE__ void ggml_merge_tensor_2d(struct ggml_tensor* input,
                                             struct ggml_tensor* output,
                                             int x,
                                             int y,
-                                            int overlap) {
+                                            int overlap,
+                                            int n = 0) {
     int64_t width    = input->ne[0];
     int64_t height   = input->ne[1];
     int64_t channels = input->ne[2];
@@ -375,7 +383,7 @@ __STATIC_INLINE__ void ggml_merge_tensor_2d(struct ggml_tensor* input,
     for (int iy = 0; iy < height; iy++) {
         for (int ix = 0; ix < width; ix++) {
             for (int k = 0; k < channels; k++) {
-                float new_value = ggml_tensor_get_f32(input, ix, iy, k);
+                float new_value = ggml_tensor_get_f32(input, ix, iy, k, n);
                 if (overlap > 0) {  // blend colors in overlapped area
                     float old_value = ggml_tensor_get_f32(output, x + ix, y + iy, k);
 
@@ -496,21 +504,89 @@ __STATIC_INLINE__ void ggml_tensor_scale_output(struct ggml_tensor* src) {
 
 typedef std::function<void(ggml_tensor*, ggml_tensor*, bool)> on_tile_process;
 
-// Tiling
-__STATIC_INLINE__ void sd_tiling(ggml_tensor* input, ggml_tensor* output, const int scale, const int tile_size, const float tile_overlap_factor, on_tile_process on_processing) {
-    int input_width   = (int)input->ne[0];
-    int input_height  = (int)input->ne[1];
-    int output_width  = (int)output->ne[0];
-    int output_height = (int)output->ne[1];
-    GGML_ASSERT(input_width % 2 == 0 && input_height % 2 == 0 && output_width % 2 == 0 && output_height % 2 == 0);  // should be multiple of 2
-
-    int tile_overlap     = (int32_t)(tile_size * tile_overlap_factor);
+// Origins of the tiles sd_tiling splits a width x height input in, in processing order.
+// The last row and column are moved back to end at the border.
+__STATIC_INLINE__ std::vector<std::pair<int, int>> sd_tile_origins(int width, int height, int tile_size, int tile_overlap) {
     int non_tile_overlap = tile_size - tile_overlap;
 
+    std::vector<std::pair<int, int>> tiles;
+    bool last_y = false, last_x = false;
+    for (int y = 0; y < height && !last_y; y += non_tile_overlap) {
+        if (y + tile_size >= height) {
+            y      = height - tile_size;
+            last_y = true;
+        }
+        for (int x = 0; x < width && !last_x; x += non_tile_overlap) {
+            if (x + tile_size >= width) {
+                x      = width - tile_size;
+                last_x = true;
+            }
+            tiles.push_back(std::make_pair(x, y));
+        }
+        last_x = false;
+    }
+    return tiles;
+}
+
+// Part of each tile of sd_tile_origins that it alone owns, so that the owned parts cover the
+// input once: a pixel belongs to the tile whose center is the nearest along each axis.
+// [x0, y0, x1, y1] per tile, in fractions of the tile size.
+__STATIC_INLINE__ std::vector<float> sd_tile_owned_regions(int width, int height, int tile_size, int tile_overlap) {
+    auto tiles = sd_tile_origins(width, height, tile_size, tile_overlap);
+
+    std::vector<int> xs, ys;  // sorted and unique
+    for (auto& tile : tiles) {
+        xs.push_back(tile.first);
+        ys.push_back(tile.second);
+    }
+    std::sort(xs.begin(), xs.end());
+    std::sort(ys.begin(), ys.end());
+    xs.erase(std::unique(xs.begin(), xs.end()), xs.end());
+    ys.erase(std::unique(ys.begin(), ys.end()), ys.end());
+
+    // [begin, end) of the pixels owned along one axis, relative to the origin
+    auto owned = [&](const std::vector<int>& origins, int origin, int size, float& begin, float& end) {
+        size_t i = std::lower_bound(origins.begin(), origins.end(), origin) - origins.begin();
+        int b    = i == 0 ? 0 : (origins[i - 1] + origin + tile_size) / 2;
+        int e    = i + 1 == origins.size() ? size : (origin + origins[i + 1] + tile_size) / 2;
+        begin    = (float)(b - origin) / tile_size;
+        end      = (float)(e - origin) / tile_size;
+    };
+    std::vector<float> regions(tiles.size() * 4);
+    for (size_t i = 0; i < tiles.size(); i++) {
+        owned(xs, tiles[i].first, width, regions[i * 4 + 0], regions[i * 4 + 2]);
+        owned(ys, tiles[i].second, height, regions[i * 4 + 1], regions[i * 4 + 3]);
+    }
+    return regions;
+}
+
+// Tiling
+// scale is the output/input size ratio, 8 when decoding latents and 1/8 when encoding images.
+// tile_overlap is the width in input pixels that neighbouring tiles share.
+// Without an output the tiles are only visited, on_processing gets NULL as output tile.
+// Up to sd_get_tile_batch_size() tiles are stacked along the batch dimension and processed together.
+__STATIC_INLINE__ void sd_tiling(ggml_tensor* input, ggml_tensor* output, const float scale, const int tile_size, const int tile_overlap, on_tile_process on_processing) {
+    int input_width  = (int)input->ne[0];
+    int input_height = (int)input->ne[1];
+    GGML_ASSERT(input_width % 2 == 0 && input_height % 2 == 0);  // should be multiple of 2
+    if (output != NULL) {
+        GGML_ASSERT(output->ne[0] % 2 == 0 && output->ne[1] % 2 == 0);
+    }
+
+    int out_tile_size = (int)(tile_size * scale);
+
+    auto tiles     = sd_tile_origins(input_width, input_height, tile_size, tile_overlap);
+    int num_tiles  = (int)tiles.size();
+    int batch      = std::max(1, std::min(sd_get_tile_batch_size(), num_tiles));
+    int last_batch = num_tiles % batch;
+
+    size_t input_tile_size  = tile_size * tile_size * input->ne[2] * sizeof(float);
+    size_t output_tile_size = output != NULL ? out_tile_size * out_tile_size * output->ne[2] * sizeof(float) : 0;
+
     struct ggml_init_params params = {};
-    params.mem_size += tile_size * tile_size * input->ne[2] * sizeof(float);                       // input chunk
-    params.mem_size += (tile_size * scale) * (tile_size * scale) * output->ne[2] * sizeof(float);  // output chunk
-    params.mem_size += 3 * ggml_tensor_overhead();
+    params.mem_size += (batch + last_batch) * input_tile_size;   // input chunks
+    params.mem_size += (batch + last_batch) * output_tile_size;  // output chunks
+    params.mem_size += 5 * ggml_tensor_overhead();
     params.mem_buffer = NULL;
     params.no_alloc   = false;
 
@@ -523,43 +599,113 @@ __STATIC_INLINE__ void sd_tiling(ggml_tensor* input, ggml_tensor* output, const
         return;
     }
 
-    // tiling
-    ggml_tensor* input_tile  = ggml_new_tensor_4d(tiles_ctx, GGML_TYPE_F32, tile_size, tile_size, input->ne[2], 1);
-    ggml_tensor* output_tile = ggml_new_tensor_4d(tiles_ctx, GGML_TYPE_F32, tile_size * scale, tile_size * scale, output->ne[2], 1);
+    // tiling, the tiles left over by the last full batch get tensors of their own
+    ggml_tensor* input_tile       = ggml_new_tensor_4d(tiles_ctx, GGML_TYPE_F32, tile_size, tile_size, input->ne[2], batch);
+    ggml_tensor* output_tile      = NULL;
+    ggml_tensor* last_input_tile  = NULL;
+    ggml_tensor* last_output_tile = NULL;
+    if (last_batch > 0) {
+        last_input_tile = ggml_new_tensor_4d(tiles_ctx, GGML_TYPE_F32, tile_size, tile_size, input->ne[2], last_batch);
+    }
+    if (output != NULL) {
+        output_tile = ggml_new_tensor_4d(tiles_ctx, GGML_TYPE_F32, out_tile_size, out_tile_size, output->ne[2], batch);
+        if (last_batch > 0) {
+            last_output_tile = ggml_new_tensor_4d(tiles_ctx, GGML_TYPE_F32, out_tile_size, out_tile_size, output->ne[2], last_batch);
+        }
+    }
     on_processing(input_tile, NULL, true);
-    int num_tiles = ceil((float)input_width / non_tile_overlap) * ceil((float)input_height / non_tile_overlap);
-    LOG_INFO("processing %i tiles", num_tiles);
-    pretty_progress(1, num_tiles, 0.0f);
-    int tile_count = 1;
-    bool last_y = false, last_x = false;
-    float last_time = 0.0f;
-    for (int y = 0; y < input_height && !last_y; y += non_tile_overlap) {
-        if (y + tile_size >= input_height) {
-            y      = input_height - tile_size;
-            last_y = true;
+    if (batch > 1) {
+        LOG_INFO("processing %i tiles in batches of %i", num_tiles, batch);
+    } else {
+        LOG_INFO("processing %i tiles", num_tiles);
+    }
+    pretty_progress(0, num_tiles, 0.0f);
+    for (int i = 0; i < num_tiles; i += batch) {
+        int n            = std::min(batch, num_tiles - i);
+        ggml_tensor* in  = n == batch ? input_tile : last_input_tile;
+        ggml_tensor* out = n == batch ? output_tile : last_output_tile;
+
+        int64_t t1 = ggml_time_ms();
+        for (int j = 0; j < n; j++) {
+            ggml_split_tensor_2d(input, in, tiles[i + j].first, tiles[i + j].second, j);
         }
-        for (int x = 0; x < input_width && !last_x; x += non_tile_overlap) {
-            if (x + tile_size >= input_width) {
-                x      = input_width - tile_size;
-                last_x = true;
+        on_processing(in, out, false);
+        if (output != NULL) {
+            for (int j = 0; j < n; j++) {
+                ggml_merge_tensor_2d(out, output, (int)(tiles[i + j].first * scale), (int)(tiles[i + j].second * scale), (int)(tile_overlap * scale), j);
             }
-            int64_t t1 = ggml_time_ms();
-            ggml_split_tensor_2d(input, input_tile, x, y);
-            on_processing(input_tile, output_tile, false);
-            ggml_merge_tensor_2d(output_tile, output, x * scale, y * scale, tile_overlap * scale);
-            int64_t t2 = ggml_time_ms();
-            last_time  = (t2 - t1) / 1000.0f;
-            pretty_progress(tile_count, num_tiles, last_time);
-            tile_count++;
         }
-        last_x = false;
-    }
-    if (tile_count < num_tiles) {
-        pretty_progress(num_tiles, num_tiles, last_time);
+        int64_t t2 = ggml_time_ms();
+        pretty_progress(i + n, num_tiles, (t2 - t1) / 1000.0f / n);
     }
     ggml_free(tiles_ctx);
 }
 
+typedef std::function<size_t(int)> on_tile_probe;
+
+// Tile size of a tiled pass, tuned to sd_get_tile_memory_budget(). probe runs the model on one
+// tile of the given size and returns the compute buffer it took, 0 if it failed. From default_size
+// up to max_size, larger tiles are probed while their compute buffer fits and they get through
+// more input pixels per second. overlap is the width in input pixels shared by neighbouring tiles,
+// it stays the same for larger tiles. The result is kept by key, which names the model, the
+// backend and the thread count.
+__STATIC_INLINE__ int sd_tune_tile_size(const std::string& key, int default_size, int max_size, int overlap, on_tile_probe probe) {
+    uint64_t budget = sd_get_tile_memory_budget();
+    if (budget == 0 || max_size <= default_size) {
+        return default_size;
+    }
+
+    static std::mutex mutex;
+    static std::map<std::string, int> tuned;
+    std::string tuned_key = format("%s|%" PRIu64 "|%d|%d", key.c_str(), budget, sd_get_tile_batch_size(), max_size);
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        auto it = tuned.find(tuned_key);
+        if (it != tuned.end()) {
+            return it->second;
+        }
+    }
+    budget /= sd_get_tile_batch_size();  // the tiles of a batch share the compute buffer
+
+    static const float factors[] = {1.f, 1.5f, 2.f, 3.f, 4.f, 6.f, 8.f};
+    int best                     = default_size;
+    double best_speed            = 0.0;
+    size_t last_buffer_size      = 0;
+    for (float factor : factors) {
+        int size = std::min((int)(default_size * factor), max_size) & ~1;
+        if (best_speed > 0.0) {
+            if (size <= best) {
+                break;
+            }
+            // the compute buffer grows with the tile area
+            double expected_size = (double)last_buffer_size * size * size / ((double)best * best);
+            if (expected_size > budget) {
+                break;
+            }
+        }
+        int64_t t0         = ggml_time_us();
+        size_t buffer_size = probe(size);
+        int64_t t1         = ggml_time_us();
+        if (buffer_size == 0 || buffer_size > budget) {
+            break;
+        }
+        int stride   = std::max(size - overlap, 1);
+        double speed = (double)stride * stride / std::max<int64_t>(t1 - t0, 1);  // new input pixels per us
+        LOG_DEBUG("%s: %dx%d tile, %.2f MB, %.2fs", key.c_str(), size, size, buffer_size / 1024.0 / 1024.0, (t1 - t0) / 1e6);
+        if (speed <= best_speed) {
+            break;
+        }
+        best             = size;
+        best_speed       = speed;
+        last_buffer_size = buffer_size;
+    }
+    LOG_INFO("%s: using %dx%d tiles", key.c_str(), best, best);
+
+    std::lock_guard<std::mutex> lock(mutex);
+    tuned[tuned_key] = best;
+    return best;
+}
+
 __STATIC_INLINE__ struct ggml_tensor* ggml_group_norm_32(struct ggml_context* ctx,
                                                          struct ggml_tensor* a) {
     const float eps = 1e-6f;  // default eps parameter
@@ -600,6 +746,43 @@ __STATIC_INLINE__ struct ggml_tensor* ggml_nn_conv_2d(struct ggml_context* ctx,
     return x;
 }
 
+// Quantized kernels can not keep the [OC，IC, KH, KW] shape since KW is rarely a multiple of the
+// block size, they are stored as [OC, IC * KH * KW] rows and multiplied with the im2col result.
+// w: [OC, IC * KH * KW]
+// x: [N, IC, IH, IW]
+// b: [OC,]
+// result: [N, OC, OH, OW]
+__STATIC_INLINE__ struct ggml_tensor* ggml_nn_conv_2d_quantized(struct ggml_context* ctx,
+                                                                struct ggml_tensor* x,
+                                                                struct ggml_tensor* w,
+                                                                struct ggml_tensor* b,
+                                                                int kw,
+                                                                int kh,
+                                                                int s0 = 1,
+                                                                int s1 = 1,
+                                                                int p0 = 0,
+                                                                int p1 = 0,
+                                                                int d0 = 1,
+                                                                int d1 = 1) {
+    GGML_ASSERT(w->ne[0] == kw * kh * x->ne[2]);
+    // im2col only looks at the shape of the kernel
+    struct ggml_tensor* kernel_shape = ggml_new_tensor_4d(ctx, GGML_TYPE_F16, kw, kh, x->ne[2], 1);
+    struct ggml_tensor* cols         = ggml_im2col(ctx, kernel_shape, x, s0, s1, p0, p1, d0, d1, true, GGML_TYPE_F32);  // [N, OH, OW, IC * KH * KW]
+    int64_t OW                       = cols->ne[1];
+    int64_t OH                       = cols->ne[2];
+    int64_t N                        = cols->ne[3];
+
+    cols = ggml_reshape_2d(ctx, cols, cols->ne[0], OW * OH * N);  // [N * OH * OW, IC * KH * KW]
+    x    = ggml_mul_mat(ctx, w, cols);                            // [N * OH * OW, OC]
+    x    = ggml_reshape_4d(ctx, x, w->ne[1], OW, OH, N);          // [N, OH, OW, OC]
+    x    = ggml_cont(ctx, ggml_permute(ctx, x, 2, 0, 1, 3));      // [N, OC, OH, OW]
+    if (b != NULL) {
+        b = ggml_reshape_4d(ctx, b, 1, 1, b->ne[0], 1);
+        x = ggml_add(ctx, x, b);
+    }
+    return x;
+}
+
 // w: [OC，IC, KD, 1 * 1]
 // x: [N, IC, IH, IW]
 // b: [OC,]
@@ -693,6 +876,27 @@ __STATIC_INLINE__ struct ggml_tensor* ggml_nn_attention(struct ggml_context* ctx
     return kqv;
 }
 
+// Online softmax attention: ggml_flash_attn_ext walks the keys of one query at a time, so the
+// [n_token, n_k] scores are never stored and memory grows with n_token + n_k. The CPU backend
+// supports it for any d_head, the GPU backends only for a few head sizes.
+// q: [N, n_token, d_head]
+// k: [N, n_k, d_head]
+// v: [N, n_k, d_head]
+// return: [N, n_token, d_head]
+__STATIC_INLINE__ struct ggml_tensor* ggml_nn_attention_online_softmax(struct ggml_context* ctx,
+                                                                       struct ggml_tensor* q,
+                                                                       struct ggml_tensor* k,
+                                                                       struct ggml_tensor* v) {
+    float scale = 1.0f / sqrt((float)q->ne[0]);
+
+    k = ggml_cast(ctx, k, GGML_TYPE_F16);
+    v = ggml_cast(ctx, v, GGML_TYPE_F16);
+
+    auto kqv = ggml_flash_attn_ext(ctx, q, k, v, NULL, scale, 0, 0);  // [n_token, N, d_head]
+    kqv      = ggml_cont(ctx, ggml_permute(ctx, kqv, 0, 2, 1, 3));    // [N, n_token, d_head]
+    return ggml_reshape_3d(ctx, kqv, kqv->ne[0], kqv->ne[1], kqv->ne[2]);
+}
+
 // q: [N, L_q, C] or [N*n_head, L_q, d_head]
 // k: [N, L_k, C] or [N*n_head, L_k, d_head]
 // v: [N, L_k, C] or [N, L_k, n_head, d_head]
@@ -924,6 +1128,83 @@ __STATIC_INLINE__ size_t ggml_tensor_num(ggml_context* ctx) {
     return num;
 }
 
+// nodes of one lora pair executed at runtime, a conv pair is the largest: two ggml_conv_2d of 7
+// nodes, the reshapes of the pair and the scale
+#define RUNTIME_LORA_GRAPH_NODES 18
+
+// A LoRA pair executed next to the weight it belongs to (x·down·up) instead of being merged
+// into it, so the base weights are never modified.
+struct RuntimeLora {
+    const void* owner        = NULL;
+    struct ggml_tensor* up   = NULL;  // [OC, rank] or [OC, rank, 1, 1]
+    struct ggml_tensor* down = NULL;  // [rank, IC] or [rank, IC, KH, KW]
+    float scale              = 1.0f;
+    // scale of each batch item, empty means every item uses `scale`.
+    // Lets one batched forward serve items that use different LoRAs.
+    std::vector<float> item_scales;
+};
+
+// Runtime LoRAs of all models, keyed by the weight tensor. Graphs look them up while being built.
+class RuntimeLoraRegistry {
+protected:
+    std::mutex mutex;
+    std::map<const struct ggml_tensor*, std::vector<RuntimeLora>> loras;
+
+public:
+    static RuntimeLoraRegistry& instance() {
+        static RuntimeLoraRegistry registry;
+        return registry;
+    }
+
+    void add(const struct ggml_tensor* weight, const RuntimeLora& lora) {
+        std::lock_guard<std::mutex> lock(mutex);
+        loras[weight].push_back(lora);
+    }
+
+    void remove(const void* owner) {
+        std::lock_guard<std::mutex> lock(mutex);
+        for (auto iter = loras.begin(); iter != loras.end();) {
+            auto& list = iter->second;
+            list.erase(std::remove_if(list.begin(), list.end(), [&](const RuntimeLora& lora) { return lora.owner == owner; }),
+                       list.end());
+            if (list.empty()) {
+                iter = loras.erase(iter);
+            } else {
+                iter++;
+            }
+        }
+    }
+
+    // Upper bound of the nodes the bound loras add to a graph: every pair runs once, or once per
+    // run of items sharing a scale, plus the view and the ggml_acc of each run.
+    size_t graph_nodes() {
+        std::lock_guard<std::mutex> lock(mutex);
+        size_t n_nodes = 0;
+        for (auto& kv : loras) {
+            for (auto& lora : kv.second) {
+                size_t n_runs = std::max<size_t>(lora.item_scales.size(), 1);
+                n_nodes += n_runs * (RUNTIME_LORA_GRAPH_NODES + 2) + 1;
+            }
+        }
+        return n_nodes;
+    }
+
+    std::vector<RuntimeLora> get(const struct ggml_tensor* weight) {
+        std::lock_guard<std::mutex> lock(mutex);
+        auto iter = loras.find(weight);
+        if (iter == loras.end()) {
+            return {};
+        }
+        return iter->second;
+    }
+};
+
+// Size of a graph of up to base_size nodes with room for the runtime loras bound at the time,
+// which may go through every layer.
+__STATIC_INLINE__ size_t sd_graph_size(size_t base_size) {
+    return base_size + RuntimeLoraRegistry::instance().graph_nodes();
+}
+
 /* SDXL with LoRA requires more space */
 #define MAX_PARAMS_TENSOR_NUM 15360
 #define MAX_GRAPH_SIZE 15360
@@ -937,6 +1218,7 @@ protected:
 
     struct ggml_context* compute_ctx    = NULL;
     struct ggml_gallocr* compute_allocr = NULL;
+    size_t compute_buffer_size          = 0;  // of the last graph, kept once the buffer is freed
 
     std::map<struct ggml_tensor*, const void*> backend_tensor_data_map;
 
@@ -962,7 +1244,8 @@ protected:
 
     void alloc_compute_ctx() {
         struct ggml_init_params params;
-        params.mem_size   = static_cast<size_t>(ggml_tensor_overhead() * MAX_GRAPH_SIZE + ggml_graph_overhead());
+        size_t graph_size = sd_graph_size(MAX_GRAPH_SIZE);
+        params.mem_size   = static_cast<size_t>(ggml_tensor_overhead() * graph_size + ggml_graph_overhead_custom(graph_size, false));
         params.mem_buffer = NULL;
         params.no_alloc   = true;
 
@@ -994,7 +1277,7 @@ protected:
         }
 
         // compute the required memory
-        size_t compute_buffer_size = ggml_gallocr_get_buffer_size(compute_allocr, 0);
+        compute_buffer_size = ggml_gallocr_get_buffer_size(compute_allocr, 0);
         LOG_DEBUG("%s compute buffer size: %.2f MB(%s)",
                   get_desc().c_str(),
                   compute_buffer_size / 1024.0 / 1024.0,
@@ -1065,6 +1348,14 @@ public:
         return 0;
     }
 
+    size_t get_compute_buffer_size() {
+        return compute_buffer_size;
+    }
+
+    ggml_backend_t get_backend() {
+        return backend;
+    }
+
     void free_compute_buffer() {
         if (compute_allocr != NULL) {
             ggml_gallocr_free(compute_allocr);
@@ -1134,6 +1425,177 @@ public:
     }
 };
 
+__STATIC_INLINE__ struct ggml_tensor* ggml_nn_flatten_2d(struct ggml_context* ctx, struct ggml_tensor* x) {
+    int64_t rows = x->ne[ggml_n_dims(x) - 1];
+    return ggml_reshape_2d(ctx, x, ggml_nelements(x) / rows, rows);
+}
+
+// x: [N, *, IC]
+// result: [N, *, OC]
+__STATIC_INLINE__ struct ggml_tensor* ggml_nn_lora_linear(struct ggml_context* ctx,
+                                                          struct ggml_tensor* x,
+                                                          const RuntimeLora& lora) {
+    x = ggml_mul_mat(ctx, ggml_nn_flatten_2d(ctx, lora.down), x);  // [N, *, rank]
+    x = ggml_mul_mat(ctx, ggml_nn_flatten_2d(ctx, lora.up), x);    // [N, *, OC]
+    return ggml_scale(ctx, x, lora.scale);
+}
+
+// x: [N, IC, IH, IW]
+// result: [N, OC, OH, OW]
+__STATIC_INLINE__ struct ggml_tensor* ggml_nn_lora_conv_2d(struct ggml_context* ctx,
+                                                           struct ggml_tensor* x,
+                                                           const RuntimeLora& lora,
+                                                           int s0 = 1,
+                                                           int s1 = 1,
+                                                           int p0 = 0,
+                                                           int p1 = 0,
+                                                           int d0 = 1,
+                                                           int d1 = 1) {
+    struct ggml_tensor* down = lora.down;
+    struct ggml_tensor* up   = lora.up;
+    if (ggml_n_dims(down) <= 2) {
+        down = ggml_reshape_4d(ctx, down, 1, 1, down->ne[0], down->ne[1]);
+    }
+    if (ggml_n_dims(up) <= 2) {
+        up = ggml_reshape_4d(ctx, up, 1, 1, up->ne[0], up->ne[1]);
+    }
+    x = ggml_nn_conv_2d(ctx, x, down, NULL, s0, s1, p0, p1, d0, d1);  // [N, rank, OH, OW]
+    x = ggml_nn_conv_2d(ctx, x, up, NULL);                             // [N, OC, OH, OW]
+    return ggml_scale(ctx, x, lora.scale);
+}
+
+// x: [N, ...], batch is the outermost dimension
+// result: the items [i0, i0 + n) of x
+__STATIC_INLINE__ struct ggml_tensor* ggml_view_batch_items(struct ggml_context* ctx,
+                                                            struct ggml_tensor* x,
+                                                            int64_t n_items,
+                                                            int64_t i0,
+                                                            int64_t n) {
+    if (x->ne[3] == n_items) {
+        return ggml_view_4d(ctx, x, x->ne[0], x->ne[1], x->ne[2], n, x->nb[1], x->nb[2], x->nb[3], i0 * x->nb[3]);
+    }
+    // the batch has been folded into the rows, e.g. [N, n_token, C] viewed as [N*n_token, C]
+    GGML_ASSERT(ggml_is_contiguous(x));
+    int64_t rows = ggml_nrows(x) / n_items;
+    GGML_ASSERT(rows * n_items == ggml_nrows(x));
+    return ggml_view_2d(ctx, x, x->ne[0], rows * n, x->nb[1], i0 * rows * x->nb[1]);
+}
+
+// Adds the output of a runtime lora to out. With per item scales, the items are grouped into runs
+// sharing the same scale and only the runs that use the lora go through it, the way batched
+// multi-LoRA servers gather the rows of each adapter.
+__STATIC_INLINE__ struct ggml_tensor* ggml_nn_add_runtime_lora(struct ggml_context* ctx,
+                                                               struct ggml_tensor* out,
+                                                               struct ggml_tensor* x,
+                                                               const RuntimeLora& lora,
+                                                               std::function<struct ggml_tensor*(struct ggml_context*, struct ggml_tensor*, const RuntimeLora&)> lora_forward) {
+    if (lora.item_scales.empty()) {
+        return ggml_add(ctx, out, lora_forward(ctx, x, lora));
+    }
+    int64_t n_items = lora.item_scales.size();
+    if (!ggml_is_contiguous(x)) {
+        x = ggml_cont(ctx, x);
+    }
+    GGML_ASSERT(ggml_is_contiguous(out));
+    size_t item_nbytes = ggml_nbytes(out) / n_items;
+    for (int64_t i0 = 0; i0 < n_items;) {
+        int64_t i1 = i0 + 1;
+        while (i1 < n_items && lora.item_scales[i1] == lora.item_scales[i0]) {
+            i1++;
+        }
+        if (lora.item_scales[i0] != 0.f) {
+            RuntimeLora item_lora = lora;
+            item_lora.scale       = lora.item_scales[i0];
+            struct ggml_tensor* delta = lora_forward(ctx, ggml_view_batch_items(ctx, x, n_items, i0, i1 - i0), item_lora);
+            out                       = ggml_acc(ctx, out, delta, out->nb[1], out->nb[2], out->nb[3], i0 * item_nbytes);
+        }
+        i0 = i1;
+    }
+    return out;
+}
+
+// Per-group statistics shared by the GroupNorm layers of a model, so that an image processed in
+// tiles is normalized with the statistics of the whole image instead of those of every tile.
+// They are gathered one layer at a time: a layer is recorded over all tiles with the layers
+// before it already normalized with the statistics of the image, as they are once applied.
+// RECORD: the layers before `layer` normalize with their slice of `input`, layer `layer` appends its
+// [mean, mean of squares] per group and batch item to `recorded`, taken over the part of the tile
+// set in `regions` only.
+// APPLY: each GroupNorm normalizes with its slice of `input`, [-mean, 1/std] per group.
+struct GroupNormStats {
+    enum Mode {
+        NONE,
+        RECORD,
+        APPLY,
+    };
+
+    Mode mode = NONE;
+    float eps = 1e-6f;  // RECORD: eps of the recorded layer, set by it
+
+    int layer      = 0;  // RECORD: the layer whose statistics are recorded
+    int num_layers = 0;  // GroupNorm layers built so far in the current graph
+    // RECORD: [x0, y0, x1, y1] per batch item, the part of the tile that it owns, in fractions of its size
+    std::vector<float> regions;
+
+    std::vector<struct ggml_tensor*> recorded;
+    struct ggml_tensor* input = NULL;
+    size_t offset             = 0;  // floats of input taken by the layers built so far
+
+    std::vector<double> sums;   // statistics of the recorded layer, weighted by the pixels the tiles own
+    double weight = 0.0;        // sum of the weights
+    std::vector<float> values;  // data of input, the statistics of the layers recorded so far
+
+    void begin_graph() {
+        recorded.clear();
+        input      = NULL;
+        offset     = 0;
+        num_layers = 0;
+    }
+
+    void reset() {
+        mode  = NONE;
+        layer = 0;
+        begin_graph();
+        regions.clear();
+        sums.clear();
+        weight = 0.0;
+        values.clear();
+    }
+
+    // starts recording layer `layer`, the layers before it have been finalized
+    void record(int layer) {
+        mode        = RECORD;
+        this->layer = layer;
+        sums.clear();
+        weight = 0.0;
+    }
+
+    // data: statistics of one tile, w: the part of the image it owns
+    void accumulate(const float* data, size_t n, double w) {
+        if (sums.size() != n) {
+            sums.assign(n, 0.0);
+            weight = 0.0;
+        }
+        for (size_t i = 0; i < n; i++) {
+            sums[i] += data[i] * w;
+        }
+        weight += w;
+    }
+
+    // append the statistics of the recorded layer to the input of the layers that follow
+    void finalize() {
+        if (weight <= 0.0) {
+            return;
+        }
+        for (size_t i = 0; i + 1 < sums.size(); i += 2) {
+            double mean = sums[i] / weight;
+            double var  = std::max(sums[i + 1] / weight - mean * mean, 0.0);
+            values.push_back((float)-mean);
+            values.push_back((float)(1.0 / std::sqrt(var + eps)));
+        }
+    }
+};
+
 class GGMLBlock {
 protected:
     typedef std::unordered_map<std::string, struct ggml_tensor*> ParameterMap;
@@ -1196,6 +1658,20 @@ public:
             tensors[prefix + pair.first] = pair.second;
         }
     }
+
+    virtual void set_group_norm_stats(std::shared_ptr<GroupNormStats> stats) {
+        for (auto& pair : blocks) {
+            pair.second->set_group_norm_stats(stats);
+        }
+    }
+
+    // Type f16 conv kernels unfold their input to, f32 avoids overflowing on large activations
+    // at the cost of a cast of the kernel and twice the im2col memory.
+    virtual void set_conv_activation_type(ggml_type type) {
+        for (auto& pair : blocks) {
+            pair.second->set_conv_activation_type(type);
+        }
+    }
 };
 
 class UnaryBlock : public GGMLBlock {
@@ -1236,7 +1712,11 @@ public:
         if (bias) {
             b = params["bias"];
         }
-        return ggml_nn_linear(ctx, x, w, b);
+        struct ggml_tensor* out = ggml_nn_linear(ctx, x, w, b);
+        for (auto& lora : RuntimeLoraRegistry::instance().get(w)) {
+            out = ggml_nn_add_runtime_lora(ctx, out, x, lora, ggml_nn_lora_linear);
+        }
+        return out;
     }
 };
 
@@ -1283,9 +1763,15 @@ protected:
     std::pair<int, int> padding;
     std::pair<int, int> dilation;
     bool bias;
+    ggml_type activation_type = GGML_TYPE_F16;
 
     void init_params(struct ggml_context* ctx, ggml_type wtype) {
-        params["weight"] = ggml_new_tensor_4d(ctx, GGML_TYPE_F16, kernel_size.second, kernel_size.first, in_channels, out_channels);
+        int64_t kernel_elements = kernel_size.second * kernel_size.first * in_channels;
+        if (ggml_is_quantized(wtype) && kernel_elements % ggml_blck_size(wtype) == 0) {
+            params["weight"] = ggml_new_tensor_2d(ctx, wtype, kernel_elements, out_channels);
+        } else {
+            params["weight"] = ggml_new_tensor_4d(ctx, GGML_TYPE_F16, kernel_size.second, kernel_size.first, in_channels, out_channels);
+        }
         if (bias) {
             params["bias"] = ggml_new_tensor_1d(ctx, GGML_TYPE_F32, out_channels);
         }
@@ -1307,13 +1793,34 @@ public:
           dilation(dilation),
           bias(bias) {}
 
+    void set_conv_activation_type(ggml_type type) {
+        activation_type = type;
+    }
+
     struct ggml_tensor* forward(struct ggml_context* ctx, struct ggml_tensor* x) {
         struct ggml_tensor* w = params["weight"];
         struct ggml_tensor* b = NULL;
         if (bias) {
             b = params["bias"];
         }
-        return ggml_nn_conv_2d(ctx, x, w, b, stride.second, stride.first, padding.second, padding.first, dilation.second, dilation.first);
+        struct ggml_tensor* out = NULL;
+        if (ggml_is_quantized(w->type)) {
+            // im2col is f32 already, the activations are quantized per block by the mul_mat
+            out = ggml_nn_conv_2d_quantized(ctx, x, w, b, kernel_size.second, kernel_size.first,
+                                            stride.second, stride.first, padding.second, padding.first, dilation.second, dilation.first);
+        } else {
+            struct ggml_tensor* kernel = w;
+            if (activation_type == GGML_TYPE_F32 && w->type != GGML_TYPE_F32) {
+                kernel = ggml_cast(ctx, w, GGML_TYPE_F32);
+            }
+            out = ggml_nn_conv_2d(ctx, x, kernel, b, stride.second, stride.first, padding.second, padding.first, dilation.second, dilation.first);
+        }
+        for (auto& lora : RuntimeLoraRegistry::instance().get(w)) {
+            out = ggml_nn_add_runtime_lora(ctx, out, x, lora, [&](struct ggml_context* ctx, struct ggml_tensor* x, const RuntimeLora& lora) {
+                return ggml_nn_lora_conv_2d(ctx, x, lora, stride.second, stride.first, padding.second, padding.first, dilation.second, dilation.first);
+            });
+        }
+        return out;
     }
 };
 
@@ -1408,6 +1915,7 @@ protected:
     int64_t num_channels;
     float eps;
     bool affine;
+    std::shared_ptr<GroupNormStats> stats;
 
     void init_params(struct ggml_context* ctx, ggml_type wtype) {
         if (affine) {
@@ -1426,6 +1934,37 @@ public:
           eps(eps),
           affine(affine) {}
 
+    void set_group_norm_stats(std::shared_ptr<GroupNormStats> stats) {
+        this->stats = stats;
+    }
+
+    // appends the statistics of the part of every tile of x that it owns to stats->recorded
+    void record(struct ggml_context* ctx, struct ggml_tensor* x) {
+        // x: [N, C, H, W]
+        GGML_ASSERT(stats->regions.size() == 4 * (size_t)x->ne[3]);
+        struct ggml_tensor* ms = NULL;
+        for (int64_t n = 0; n < x->ne[3]; n++) {
+            const float* region = &stats->regions[n * 4];
+            int64_t x0          = std::min((int64_t)(region[0] * x->ne[0] + 0.5f), x->ne[0] - 1);
+            int64_t y0          = std::min((int64_t)(region[1] * x->ne[1] + 0.5f), x->ne[1] - 1);
+            int64_t x1          = std::max((int64_t)(region[2] * x->ne[0] + 0.5f), x0 + 1);
+            int64_t y1          = std::max((int64_t)(region[3] * x->ne[1] + 0.5f), y0 + 1);
+
+            // the owned part of tile n, [1, C, h, w]
+            auto owned = ggml_view_4d(ctx, x, x1 - x0, y1 - y0, x->ne[2], 1, x->nb[1], x->nb[2], x->nb[3],
+                                      n * x->nb[3] + y0 * x->nb[1] + x0 * x->nb[0]);
+            owned      = ggml_cont(ctx, owned);
+
+            auto h    = ggml_reshape_3d(ctx, owned, ggml_nelements(owned) / num_groups, num_groups, 1);  // [1, G, h*w*C/G]
+            auto mean = ggml_mean(ctx, h);                                                                // [1, G, 1]
+            auto sq   = ggml_mean(ctx, ggml_sqr(ctx, h));                                                 // [1, G, 1]
+            auto item = ggml_concat(ctx, mean, sq, 0);                                                    // [1, G, 2]
+            ms        = ms == NULL ? item : ggml_concat(ctx, ms, item, 2);                                // [n+1, G, 2]
+        }
+        stats->recorded.push_back(ms);
+        stats->eps = eps;
+    }
+
     struct ggml_tensor* forward(struct ggml_context* ctx, struct ggml_tensor* x) {
         struct ggml_tensor* w = NULL;
         struct ggml_tensor* b = NULL;
@@ -1433,7 +1972,41 @@ public:
             w = params["weight"];
             b = params["bias"];
         }
-        return ggml_nn_group_norm(ctx, x, w, b, num_groups);
+        if (stats == NULL || stats->mode == GroupNormStats::NONE || ggml_n_dims(x) < 3) {
+            return ggml_nn_group_norm(ctx, x, w, b, num_groups);
+        }
+
+        int index = stats->num_layers++;
+        if (stats->mode == GroupNormStats::RECORD && index >= stats->layer) {
+            if (index == stats->layer) {
+                record(ctx, x);
+            }
+            // the layers after the recorded one are not part of the graph
+            return ggml_nn_group_norm(ctx, x, w, b, num_groups);
+        }
+
+        // x: [N, C, H, W]
+        if (!ggml_is_contiguous(x)) {
+            x = ggml_cont(ctx, x);
+        }
+        auto h = ggml_reshape_3d(ctx, x, x->ne[0] * x->ne[1] * (x->ne[2] / num_groups), num_groups, x->ne[3]);  // [N, G, H*W*C/G]
+
+        GGML_ASSERT(stats->input != NULL && stats->offset + 2 * num_groups <= (size_t)ggml_nelements(stats->input));
+        size_t offset = stats->offset * sizeof(float);
+        auto neg_mean = ggml_view_3d(ctx, stats->input, 1, num_groups, 1, 2 * sizeof(float), 2 * num_groups * sizeof(float), offset);
+        auto inv_std  = ggml_view_3d(ctx, stats->input, 1, num_groups, 1, 2 * sizeof(float), 2 * num_groups * sizeof(float), offset + sizeof(float));
+        stats->offset += 2 * num_groups;
+
+        h = ggml_add(ctx, h, neg_mean);
+        h = ggml_mul(ctx, h, inv_std);
+        h = ggml_reshape_4d(ctx, h, x->ne[0], x->ne[1], x->ne[2], x->ne[3]);
+        if (w != NULL && b != NULL) {
+            w = ggml_reshape_4d(ctx, w, 1, 1, w->ne[0], 1);
+            b = ggml_reshape_4d(ctx, b, 1, 1, b->ne[0], 1);
+            h = ggml_mul(ctx, h, w);
+            h = ggml_add(ctx, h, b);
+        }
+        return h;
     }
 };
 
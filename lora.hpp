@@ -4,9 +4,16 @@
 #include "ggml_extend.hpp"
 
 #define LORA_GRAPH_SIZE 10240
-
+// upper bound of the intermediate tensors of one merge graph
+#define LORA_APPLY_CHUNK_SIZE (size_t)(256 * 1024 * 1024)
+// each merged weight takes about a dozen graph nodes
+#define LORA_APPLY_CHUNK_MAX_TENSORS (LORA_GRAPH_SIZE / 16)
+// off unless asked for, the cached loras live on the backend, which is VRAM on gpu builds
+#define LORA_CACHE_DEFAULT_SIZE (size_t)0
+
+// Loras are shared through LoraCache, so the multiplier is an argument of apply and bind_runtime
+// rather than state of the model.
 struct LoraModel : public GGMLRunner {
-    float multiplier = 1.0f;
     std::map<std::string, struct ggml_tensor*> lora_tensors;
     std::string file_path;
     ModelLoader model_loader;
@@ -77,68 +84,112 @@ struct LoraModel : public GGMLRunner {
         return out;
     }
 
-    struct ggml_cgraph* build_lora_graph(std::map<std::string, struct ggml_tensor*> model_tensors) {
-        struct ggml_cgraph* gf = ggml_new_graph_custom(compute_ctx, LORA_GRAPH_SIZE, false);
-
-        zero_index = ggml_new_tensor_1d(compute_ctx, GGML_TYPE_I32, 1);
-        set_backend_tensor_data(zero_index, zero_index_vec.data());
-        ggml_build_forward_expand(gf, zero_index);
+    // looks up the lora pair of a model weight, the returned scale is the one of the pair (alpha / rank),
+    // without the multiplier
+    bool get_lora_pair(const std::string& weight_name,
+                       ggml_tensor** lora_up,
+                       ggml_tensor** lora_down,
+                       float* scale,
+                       std::set<std::string>* used_lora_tensors = NULL) {
+        std::string k_tensor = weight_name;
+        size_t k_pos         = k_tensor.find(".weight");
+        if (k_pos == std::string::npos) {
+            return false;
+        }
+        k_tensor = k_tensor.substr(0, k_pos);
+        replace_all_chars(k_tensor, '.', '_');
+        // LOG_DEBUG("k_tensor %s", k_tensor.c_str());
+        std::string lora_up_name = "lora." + k_tensor + ".lora_up.weight";
+        if (lora_tensors.find(lora_up_name) == lora_tensors.end()) {
+            if (k_tensor == "model_diffusion_model_output_blocks_2_2_conv") {
+                // fix for some sdxl lora, like lcm-lora-xl
+                k_tensor     = "model_diffusion_model_output_blocks_2_1_conv";
+                lora_up_name = "lora." + k_tensor + ".lora_up.weight";
+            }
+        }
 
-        std::set<std::string> applied_lora_tensors;
-        for (auto it : model_tensors) {
-            std::string k_tensor       = it.first;
-            struct ggml_tensor* weight = model_tensors[it.first];
+        std::string lora_down_name = "lora." + k_tensor + ".lora_down.weight";
+        std::string alpha_name     = "lora." + k_tensor + ".alpha";
+        std::string scale_name     = "lora." + k_tensor + ".scale";
 
-            size_t k_pos = k_tensor.find(".weight");
-            if (k_pos == std::string::npos) {
-                continue;
-            }
-            k_tensor = k_tensor.substr(0, k_pos);
-            replace_all_chars(k_tensor, '.', '_');
-            // LOG_DEBUG("k_tensor %s", k_tensor.c_str());
-            std::string lora_up_name = "lora." + k_tensor + ".lora_up.weight";
-            if (lora_tensors.find(lora_up_name) == lora_tensors.end()) {
-                if (k_tensor == "model_diffusion_model_output_blocks_2_2_conv") {
-                    // fix for some sdxl lora, like lcm-lora-xl
-                    k_tensor     = "model_diffusion_model_output_blocks_2_1_conv";
-                    lora_up_name = "lora." + k_tensor + ".lora_up.weight";
-                }
-            }
+        if (lora_tensors.find(lora_up_name) == lora_tensors.end() ||
+            lora_tensors.find(lora_down_name) == lora_tensors.end()) {
+            return false;
+        }
+        *lora_up   = lora_tensors[lora_up_name];
+        *lora_down = lora_tensors[lora_down_name];
+
+        if (used_lora_tensors != NULL) {
+            used_lora_tensors->insert(lora_up_name);
+            used_lora_tensors->insert(lora_down_name);
+            used_lora_tensors->insert(alpha_name);
+            used_lora_tensors->insert(scale_name);
+        }
 
-            std::string lora_down_name = "lora." + k_tensor + ".lora_down.weight";
-            std::string alpha_name     = "lora." + k_tensor + ".alpha";
-            std::string scale_name     = "lora." + k_tensor + ".scale";
+        // calc_cale
+        int64_t dim       = (*lora_down)->ne[ggml_n_dims(*lora_down) - 1];
+        float scale_value = 1.0f;
+        if (lora_tensors.find(scale_name) != lora_tensors.end()) {
+            scale_value = ggml_backend_tensor_get_f32(lora_tensors[scale_name]);
+        } else if (lora_tensors.find(alpha_name) != lora_tensors.end()) {
+            float alpha = ggml_backend_tensor_get_f32(lora_tensors[alpha_name]);
+            scale_value = alpha / dim;
+        }
+        *scale = scale_value;
+        return true;
+    }
 
+    // names of the model weights this lora changes
+    std::set<std::string> get_affected_tensors(const std::map<std::string, struct ggml_tensor*>& model_tensors) {
+        std::set<std::string> names;
+        for (auto& kv : model_tensors) {
             ggml_tensor* lora_up   = NULL;
             ggml_tensor* lora_down = NULL;
-
-            if (lora_tensors.find(lora_up_name) != lora_tensors.end()) {
-                lora_up = lora_tensors[lora_up_name];
+            float scale_value      = 1.0f;
+            if (get_lora_pair(kv.first, &lora_up, &lora_down, &scale_value)) {
+                names.insert(kv.first);
             }
+        }
+        return names;
+    }
 
-            if (lora_tensors.find(lora_down_name) != lora_tensors.end()) {
-                lora_down = lora_tensors[lora_down_name];
-            }
+    void log_unused_lora_tensors(const std::set<std::string>& applied_lora_tensors) {
+        size_t total_lora_tensors_count   = 0;
+        size_t applied_lora_tensors_count = 0;
 
-            if (lora_up == NULL || lora_down == NULL) {
-                continue;
+        for (auto& kv : lora_tensors) {
+            total_lora_tensors_count++;
+            if (applied_lora_tensors.find(kv.first) == applied_lora_tensors.end()) {
+                LOG_WARN("unused lora tensor %s", kv.first.c_str());
+            } else {
+                applied_lora_tensors_count++;
             }
+        }
+        if (applied_lora_tensors_count != total_lora_tensors_count) {
+            LOG_WARN("Only (%lu / %lu) LoRA tensors have been applied",
+                     applied_lora_tensors_count, total_lora_tensors_count);
+        } else {
+            LOG_DEBUG("(%lu / %lu) LoRA tensors applied successfully",
+                      applied_lora_tensors_count, total_lora_tensors_count);
+        }
+    }
 
-            applied_lora_tensors.insert(lora_up_name);
-            applied_lora_tensors.insert(lora_down_name);
-            applied_lora_tensors.insert(alpha_name);
-            applied_lora_tensors.insert(scale_name);
+    struct ggml_cgraph* build_lora_graph(const std::map<std::string, struct ggml_tensor*>& model_tensors, float multiplier) {
+        struct ggml_cgraph* gf = ggml_new_graph_custom(compute_ctx, LORA_GRAPH_SIZE, false);
 
-            // calc_cale
-            int64_t dim       = lora_down->ne[ggml_n_dims(lora_down) - 1];
-            float scale_value = 1.0f;
-            if (lora_tensors.find(scale_name) != lora_tensors.end()) {
-                scale_value = ggml_backend_tensor_get_f32(lora_tensors[scale_name]);
-            } else if (lora_tensors.find(alpha_name) != lora_tensors.end()) {
-                float alpha = ggml_backend_tensor_get_f32(lora_tensors[alpha_name]);
-                scale_value = alpha / dim;
+        zero_index = ggml_new_tensor_1d(compute_ctx, GGML_TYPE_I32, 1);
+        set_backend_tensor_data(zero_index, zero_index_vec.data());
+        ggml_build_forward_expand(gf, zero_index);
+
+        for (auto& kv : model_tensors) {
+            struct ggml_tensor* weight = kv.second;
+
+            ggml_tensor* lora_up   = NULL;
+            ggml_tensor* lora_down = NULL;
+            float scale_value      = 1.0f;
+            if (!get_lora_pair(kv.first, &lora_up, &lora_down, &scale_value)) {
+                continue;
             }
-            scale_value *= multiplier;
 
             // flat lora tensors to multiply it
             int64_t lora_up_rows   = lora_up->ne[ggml_n_dims(lora_up) - 1];
@@ -152,7 +203,7 @@ struct LoraModel : public GGMLRunner {
             updown                     = ggml_cont(compute_ctx, ggml_transpose(compute_ctx, updown));
             updown                     = ggml_reshape(compute_ctx, updown, weight);
             GGML_ASSERT(ggml_nelements(updown) == ggml_nelements(weight));
-            updown = ggml_scale_inplace(compute_ctx, updown, scale_value);
+            updown = ggml_scale_inplace(compute_ctx, updown, scale_value * multiplier);
             ggml_tensor* final_weight;
             if (weight->type != GGML_TYPE_F32 && weight->type != GGML_TYPE_F16) {
                 // final_weight = ggml_new_tensor(compute_ctx, GGML_TYPE_F32, ggml_n_dims(weight), weight->ne);
@@ -167,36 +218,180 @@ struct LoraModel : public GGMLRunner {
             ggml_build_forward_expand(gf, final_weight);
         }
 
-        size_t total_lora_tensors_count   = 0;
-        size_t applied_lora_tensors_count = 0;
+        return gf;
+    }
 
-        for (auto& kv : lora_tensors) {
-            total_lora_tensors_count++;
-            if (applied_lora_tensors.find(kv.first) == applied_lora_tensors.end()) {
-                LOG_WARN("unused lora tensor %s", kv.first.c_str());
-            } else {
-                applied_lora_tensors_count++;
+    // Merges the lora into model_tensors. The weights are merged in chunks whose intermediate F32
+    // tensors fit in LORA_APPLY_CHUNK_SIZE, so the compute buffer doesn't grow with the lora.
+    // log_unused: warn about the lora tensors matching none of model_tensors, pass false when
+    // model_tensors is only a part of the model
+    void apply(const std::map<std::string, struct ggml_tensor*>& model_tensors, float multiplier, int n_threads, bool log_unused = true) {
+        std::vector<std::map<std::string, struct ggml_tensor*>> chunks(1);
+        size_t chunk_size = 0;
+        size_t n_weights  = 0;
+        std::set<std::string> applied_lora_tensors;
+        for (auto& kv : model_tensors) {
+            ggml_tensor* lora_up   = NULL;
+            ggml_tensor* lora_down = NULL;
+            float scale_value      = 1.0f;
+            if (!get_lora_pair(kv.first, &lora_up, &lora_down, &scale_value, &applied_lora_tensors)) {
+                continue;
+            }
+            // updown, its transposed copy and the F32 copy of a quantized weight
+            size_t size = ggml_nelements(kv.second) * sizeof(float) * 3;
+            if (chunks.back().size() > 0 &&
+                (chunk_size + size > LORA_APPLY_CHUNK_SIZE || chunks.back().size() >= LORA_APPLY_CHUNK_MAX_TENSORS)) {
+                chunks.emplace_back();
+                chunk_size = 0;
             }
+            chunks.back()[kv.first] = kv.second;
+            chunk_size += size;
+            n_weights++;
         }
-        /* Don't worry if this message shows up twice in the logs per LoRA,
-         * this function is called once to calculate the required buffer size
-         * and then again to actually generate a graph to be used */
-        if (applied_lora_tensors_count != total_lora_tensors_count) {
-            LOG_WARN("Only (%lu / %lu) LoRA tensors have been applied",
-                     applied_lora_tensors_count, total_lora_tensors_count);
-        } else {
-            LOG_DEBUG("(%lu / %lu) LoRA tensors applied successfully",
-                      applied_lora_tensors_count, total_lora_tensors_count);
+        if (log_unused) {
+            log_unused_lora_tensors(applied_lora_tensors);
+        }
+        if (chunks.back().empty()) {
+            return;
         }
 
-        return gf;
+        for (auto& chunk : chunks) {
+            auto get_graph = [&]() -> struct ggml_cgraph* {
+                return build_lora_graph(chunk, multiplier);
+            };
+            // the compute buffer is kept between chunks, it only grows to the largest one
+            GGMLRunner::compute(get_graph, n_threads, false);
+        }
+        free_compute_buffer();
+        LOG_DEBUG("lora merged into %zu weights in %zu chunks", n_weights, chunks.size());
     }
 
-    void apply(std::map<std::string, struct ggml_tensor*> model_tensors, int n_threads) {
-        auto get_graph = [&]() -> struct ggml_cgraph* {
-            return build_lora_graph(model_tensors);
-        };
-        GGMLRunner::compute(get_graph, n_threads, true);
+    // Registers the lora pairs to be executed next to the weights they belong to, instead of merging
+    // them, on behalf of owner. The lora must stay loaded until the owner removes its bindings with
+    // RuntimeLoraRegistry::remove(owner). Only weights living on the backend of this lora can be bound.
+    // item_multipliers gives the multiplier of every batch item (0 for the items not using this lora),
+    // when empty multiplier applies to the whole batch.
+    int bind_runtime(const void* owner,
+                     const std::map<std::string, struct ggml_tensor*>& model_tensors,
+                     float multiplier,
+                     const std::vector<float>& item_multipliers = std::vector<float>()) {
+        ggml_backend_buffer_type_t buft = ggml_backend_get_default_buffer_type(backend);
+        std::set<std::string> applied_lora_tensors;
+        int n_bound = 0;
+        for (auto& kv : model_tensors) {
+            ggml_tensor* weight = kv.second;
+            if (weight->buffer == NULL || ggml_backend_buffer_get_type(weight->buffer) != buft) {
+                continue;
+            }
+            RuntimeLora lora;
+            lora.owner        = owner;
+            float scale_value = 1.0f;
+            if (!get_lora_pair(kv.first, &lora.up, &lora.down, &scale_value, &applied_lora_tensors)) {
+                continue;
+            }
+            lora.scale = scale_value * multiplier;
+            for (float item_multiplier : item_multipliers) {
+                lora.item_scales.push_back(scale_value * item_multiplier);
+            }
+            RuntimeLoraRegistry::instance().add(weight, lora);
+            n_bound++;
+        }
+        return n_bound;
+    }
+};
+
+// Process wide LRU of loaded loras, so that going back to a lora doesn't read it from disk again.
+// Entries are keyed by file path (and backend/weight type) and dropped once the file has been
+// modified. Evicted loras stay alive as long as someone still holds them.
+class LoraCache {
+protected:
+    struct Entry {
+        std::string key;
+        int64_t mtime;
+        size_t size;
+        std::shared_ptr<LoraModel> lora;
+    };
+
+    std::mutex mutex;
+    std::list<Entry> entries;  // most recently used first
+    std::map<std::string, std::list<Entry>::iterator> index;
+    size_t max_size  = LORA_CACHE_DEFAULT_SIZE;
+    size_t used_size = 0;
+
+    void erase(std::list<Entry>::iterator iter) {
+        used_size -= iter->size;
+        index.erase(iter->key);
+        entries.erase(iter);
+    }
+
+    void evict() {
+        while (used_size > max_size && !entries.empty()) {
+            LOG_DEBUG("evicting lora '%s' from cache", entries.back().lora->file_path.c_str());
+            erase(std::prev(entries.end()));
+        }
+    }
+
+public:
+    static LoraCache& instance() {
+        static LoraCache cache;
+        return cache;
+    }
+
+    // 0 disables the cache
+    void set_max_size(size_t size) {
+        std::lock_guard<std::mutex> lock(mutex);
+        max_size = size;
+        evict();
+    }
+
+    // the loras must be dropped before their backend is freed
+    void remove_backend(ggml_backend_t backend) {
+        std::lock_guard<std::mutex> lock(mutex);
+        for (auto iter = entries.begin(); iter != entries.end();) {
+            auto next = std::next(iter);
+            if (iter->lora->get_backend() == backend) {
+                erase(iter);
+            }
+            iter = next;
+        }
+    }
+
+    // returns the loaded lora, NULL if it can't be loaded
+    std::shared_ptr<LoraModel> get(ggml_backend_t backend, ggml_type wtype, const std::string& file_path) {
+        int64_t mtime   = get_file_mtime(file_path);
+        std::string key = format("%s|%p|%d", file_path.c_str(), (void*)backend, (int)wtype);
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            auto iter = index.find(key);
+            if (iter != index.end()) {
+                if (iter->second->mtime == mtime) {
+                    entries.splice(entries.begin(), entries, iter->second);
+                    LOG_DEBUG("lora '%s' found in cache", file_path.c_str());
+                    return iter->second->lora;
+                }
+                erase(iter->second);
+            }
+        }
+
+        auto lora = std::make_shared<LoraModel>(backend, wtype, file_path);
+        if (!lora->load_from_file()) {
+            return NULL;
+        }
+        size_t size = lora->get_params_buffer_size();
+
+        std::lock_guard<std::mutex> lock(mutex);
+        auto iter = index.find(key);
+        if (iter != index.end()) {
+            // loaded concurrently
+            erase(iter->second);
+        }
+        if (size <= max_size) {
+            entries.push_front({key, mtime, size, lora});
+            index[key] = entries.begin();
+            used_size += size;
+            evict();
+        }
+        return lora;
     }
 };
 
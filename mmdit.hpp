@@ -672,7 +672,7 @@ struct MMDiTRunner : public GGMLRunner {
                                     struct ggml_tensor* timesteps,
                                     struct ggml_tensor* context,
                                     struct ggml_tensor* y) {
-        struct ggml_cgraph* gf = ggml_new_graph_custom(compute_ctx, MMDIT_GRAPH_SIZE, false);
+        struct ggml_cgraph* gf = ggml_new_graph_custom(compute_ctx, sd_graph_size(MMDIT_GRAPH_SIZE), false);
 
         x         = to_backend(x);
         context   = to_backend(context);
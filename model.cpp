@@ -1,11 +1,29 @@
 #include <stdarg.h>
+#include <algorithm>
 #include <fstream>
+#include <functional>
 #include <regex>
 #include <set>
 #include <string>
+#include <thread>
 #include <unordered_map>
 #include <vector>
 
+#if defined(__x86_64__) || defined(__i386__) || defined(_M_X64) || defined(_M_IX86)
+#include <immintrin.h>
+#elif defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+// the x86 kernels are built for their instruction set whatever the flags of the library,
+// the cpu running them picks one at runtime
+#define SD_X86_RUNTIME_DISPATCH
+#define SD_TARGET(isa) __attribute__((target(isa)))
+#else
+#define SD_TARGET(isa)
+#endif
+
 #include "model.h"
 #include "stable-diffusion.h"
 #include "util.h"
@@ -603,71 +621,252 @@ uint16_t f8_e4m3_to_f16(uint8_t f8) {
     return ggml_fp32_to_fp16(*reinterpret_cast<const float*>(&result));
 }
 
-void bf16_to_f32_vec(uint16_t* src, float* dst, int64_t n) {
-    // support inplace op
-    for (int64_t i = n - 1; i >= 0; i--) {
+// bf16 => f32 kernels, they convert the leading elements of a row and return how many
+typedef int64_t (*bf16_to_f32_kernel_t)(const uint16_t* src, float* dst, int64_t n);
+
+#if defined(SD_X86_RUNTIME_DISPATCH) || defined(__AVX512F__)
+SD_TARGET("avx512f")
+static int64_t bf16_to_f32_row_avx512(const uint16_t* src, float* dst, int64_t n) {
+    int64_t i = 0;
+    for (; i + 16 <= n; i += 16) {
+        __m256i x = _mm256_loadu_si256((const __m256i*)(src + i));
+        _mm512_storeu_si512((void*)(dst + i), _mm512_slli_epi32(_mm512_cvtepu16_epi32(x), 16));
+    }
+    for (; i + 8 <= n; i += 8) {
+        __m128i x = _mm_loadu_si128((const __m128i*)(src + i));
+        _mm256_storeu_si256((__m256i*)(dst + i), _mm256_slli_epi32(_mm256_cvtepu16_epi32(x), 16));
+    }
+    return i;
+}
+#endif
+
+#if defined(SD_X86_RUNTIME_DISPATCH) || defined(__AVX2__)
+SD_TARGET("avx2")
+static int64_t bf16_to_f32_row_avx2(const uint16_t* src, float* dst, int64_t n) {
+    int64_t i = 0;
+    for (; i + 8 <= n; i += 8) {
+        __m128i x = _mm_loadu_si128((const __m128i*)(src + i));
+        _mm256_storeu_si256((__m256i*)(dst + i), _mm256_slli_epi32(_mm256_cvtepu16_epi32(x), 16));
+    }
+    return i;
+}
+#endif
+
+#if defined(__ARM_NEON)
+static int64_t bf16_to_f32_row_neon(const uint16_t* src, float* dst, int64_t n) {
+    int64_t i = 0;
+    for (; i + 8 <= n; i += 8) {
+        uint16x8_t x = vld1q_u16(src + i);
+        vst1q_u32((uint32_t*)(dst + i), vshll_n_u16(vget_low_u16(x), 16));
+        vst1q_u32((uint32_t*)(dst + i + 4), vshll_n_u16(vget_high_u16(x), 16));
+    }
+    return i;
+}
+#endif
+
+// widest kernel the cpu runs, NULL leaves the rows to the scalar loop
+static bf16_to_f32_kernel_t get_bf16_to_f32_kernel() {
+#if defined(SD_X86_RUNTIME_DISPATCH)
+    static const bf16_to_f32_kernel_t kernel = []() -> bf16_to_f32_kernel_t {
+        __builtin_cpu_init();
+        if (__builtin_cpu_supports("avx512f")) {
+            return bf16_to_f32_row_avx512;
+        }
+        if (__builtin_cpu_supports("avx2")) {
+            return bf16_to_f32_row_avx2;
+        }
+        return NULL;
+    }();
+    return kernel;
+#elif defined(__AVX512F__)
+    return bf16_to_f32_row_avx512;
+#elif defined(__AVX2__)
+    return bf16_to_f32_row_avx2;
+#elif defined(__ARM_NEON)
+    return bf16_to_f32_row_neon;
+#else
+    return NULL;
+#endif
+}
+
+void bf16_to_f32_row(const uint16_t* src, float* dst, int64_t n) {
+    static const bf16_to_f32_kernel_t kernel = get_bf16_to_f32_kernel();
+
+    int64_t i = kernel != NULL ? kernel(src, dst, n) : 0;
+    for (; i < n; i++) {
         dst[i] = bf16_to_f32(src[i]);
     }
 }
 
-void f8_e4m3_to_f16_vec(uint8_t* src, uint16_t* dst, int64_t n) {
-    // support inplace op
-    for (int64_t i = n - 1; i >= 0; i--) {
-        dst[i] = f8_e4m3_to_f16(src[i]);
+// f8_e4m3 has only 256 values, a lookup table is cheaper than any bit twiddling
+const uint16_t* get_f8_e4m3_to_f16_table() {
+    static struct f8_e4m3_table {
+        uint16_t data[256];
+        f8_e4m3_table() {
+            for (int i = 0; i < 256; i++) {
+                data[i] = f8_e4m3_to_f16((uint8_t)i);
+            }
+        }
+    } table;
+    return table.data;
+}
+
+void f8_e4m3_to_f16_row(const uint8_t* src, uint16_t* dst, int64_t n) {
+    const uint16_t* table = get_f8_e4m3_to_f16_table();
+    for (int64_t i = 0; i < n; i++) {
+        dst[i] = table[src[i]];
     }
 }
 
+#define CONVERT_MIN_ELEMENTS_PER_THREAD (256 * 1024)
+
+void parallel_convert_range(int64_t begin,
+                            int64_t end,
+                            int n_threads,
+                            const std::function<void(int64_t, int64_t)>& convert_range,
+                            int64_t min_per_thread = CONVERT_MIN_ELEMENTS_PER_THREAD) {
+    int64_t max_threads = (end - begin) / std::max(min_per_thread, (int64_t)1);
+    if (n_threads > max_threads) {
+        n_threads = (int)max_threads;
+    }
+    if (n_threads <= 1) {
+        convert_range(begin, end);
+        return;
+    }
+    int64_t chunk_size = (end - begin + n_threads - 1) / n_threads;
+    std::vector<std::thread> workers;
+    for (int i = 1; i < n_threads; i++) {
+        int64_t chunk_begin = begin + i * chunk_size;
+        int64_t chunk_end   = std::min(end, chunk_begin + chunk_size);
+        if (chunk_begin >= chunk_end) {
+            break;
+        }
+        workers.emplace_back(convert_range, chunk_begin, chunk_end);
+    }
+    convert_range(begin, std::min(end, begin + chunk_size));
+    for (auto& worker : workers) {
+        worker.join();
+    }
+}
+
+// Widening conversion that supports inplace op (dst elements are twice as wide as src elements).
+// Elements in [ceil(m/2), m) only write above the bytes still holding unread source data, so each
+// upper half is converted with a plain forward pass, split across threads, before moving down.
+template <typename src_t, typename dst_t>
+void convert_widening_inplace(src_t* src,
+                              dst_t* dst,
+                              int64_t n,
+                              int n_threads,
+                              void (*convert_row)(const src_t*, dst_t*, int64_t)) {
+    static_assert(sizeof(dst_t) == 2 * sizeof(src_t), "expected a widening conversion");
+    int64_t m = n;
+    while (m > 64) {
+        int64_t half = (m + 1) / 2;
+        parallel_convert_range(half, m, n_threads, [&](int64_t begin, int64_t end) {
+            convert_row(src + begin, dst + begin, end - begin);
+        });
+        m = half;
+    }
+    for (int64_t i = m - 1; i >= 0; i--) {
+        convert_row(src + i, dst + i, 1);
+    }
+}
+
+void bf16_to_f32_vec(uint16_t* src, float* dst, int64_t n, int n_threads = 1) {
+    // support inplace op
+    convert_widening_inplace(src, dst, n, n_threads, bf16_to_f32_row);
+}
+
+void f8_e4m3_to_f16_vec(uint8_t* src, uint16_t* dst, int64_t n, int n_threads = 1) {
+    // support inplace op
+    convert_widening_inplace(src, dst, n, n_threads, f8_e4m3_to_f16_row);
+}
+
+// Rows are independent, so conversions are split into row ranges and spread across threads.
 void convert_tensor(void* src,
                     ggml_type src_type,
                     void* dst,
                     ggml_type dst_type,
                     int nrows,
-                    int n_per_row) {
-    int n = nrows * n_per_row;
+                    int n_per_row,
+                    int n_threads = 1) {
+    int64_t n = (int64_t)nrows * n_per_row;
     if (src_type == dst_type) {
         size_t nbytes = n * ggml_type_size(src_type) / ggml_blck_size(src_type);
         memcpy(((char*)dst), ((char*)src), nbytes);
-    } else if (src_type == GGML_TYPE_F32) {
-        if (dst_type == GGML_TYPE_F16) {
-            ggml_fp32_to_fp16_row((float*)src, (ggml_fp16_t*)dst, n);
-        } else {
-            std::vector<float> imatrix(n_per_row, 1.0f);  // dummy importance matrix
-            const float* im = imatrix.data();
-            ggml_quantize_chunk(dst_type, (float*)src, dst, 0, nrows, n_per_row, im);
-        }
-    } else if (dst_type == GGML_TYPE_F32) {
-        if (src_type == GGML_TYPE_F16) {
-            ggml_fp16_to_fp32_row((ggml_fp16_t*)src, (float*)dst, n);
-        } else {
-            auto qtype = ggml_internal_get_type_traits(src_type);
-            if (qtype.to_float == NULL) {
-                throw std::runtime_error(format("type %s unsupported for integer quantization: no dequantization available",
-                                                ggml_type_name(src_type)));
+        return;
+    }
+
+    int64_t min_rows_per_thread = std::max((int64_t)1, (int64_t)CONVERT_MIN_ELEMENTS_PER_THREAD / n_per_row);
+    std::vector<float> imatrix(n_per_row, 1.0f);  // dummy importance matrix
+    const float* im = imatrix.data();
+
+    auto from_f32 = [&](const float* src_f32) {
+        parallel_convert_range(0, nrows, n_threads, [&](int64_t row_begin, int64_t row_end) {
+            if (dst_type == GGML_TYPE_F16) {
+                ggml_fp32_to_fp16_row(src_f32 + row_begin * n_per_row,
+                                      (ggml_fp16_t*)dst + row_begin * n_per_row,
+                                      (row_end - row_begin) * n_per_row);
+            } else {
+                ggml_quantize_chunk(dst_type, src_f32, dst, row_begin * n_per_row, row_end - row_begin, n_per_row, im);
             }
-            qtype.to_float(src, (float*)dst, n);
-        }
-    } else {
-        // src_type == GGML_TYPE_F16 => dst_type is quantized
-        // src_type is quantized => dst_type == GGML_TYPE_F16 or dst_type is quantized
+        }, min_rows_per_thread);
+    };
+
+    auto to_f32 = [&](float* dst_f32) {
         auto qtype = ggml_internal_get_type_traits(src_type);
-        if (qtype.to_float == NULL) {
+        if (src_type != GGML_TYPE_F16 && qtype.to_float == NULL) {
             throw std::runtime_error(format("type %s unsupported for integer quantization: no dequantization available",
                                             ggml_type_name(src_type)));
         }
-        std::vector<char> buf;
-        buf.resize(sizeof(float) * n);
-        char* src_data_f32 = buf.data();
-        qtype.to_float(src, (float*)src_data_f32, n);
-        if (dst_type == GGML_TYPE_F16) {
-            ggml_fp32_to_fp16_row((float*)src_data_f32, (ggml_fp16_t*)dst, n);
-        } else {
-            std::vector<float> imatrix(n_per_row, 1.0f);  // dummy importance matrix
-            const float* im = imatrix.data();
-            ggml_quantize_chunk(dst_type, (float*)src_data_f32, dst, 0, nrows, n_per_row, im);
-        }
+        size_t src_row_size = ggml_row_size(src_type, n_per_row);
+        parallel_convert_range(0, nrows, n_threads, [&](int64_t row_begin, int64_t row_end) {
+            const void* src_rows = (const char*)src + row_begin * src_row_size;
+            if (src_type == GGML_TYPE_F16) {
+                ggml_fp16_to_fp32_row((const ggml_fp16_t*)src_rows,
+                                      dst_f32 + row_begin * n_per_row,
+                                      (row_end - row_begin) * n_per_row);
+            } else {
+                qtype.to_float(src_rows, dst_f32 + row_begin * n_per_row, (row_end - row_begin) * n_per_row);
+            }
+        }, min_rows_per_thread);
+    };
+
+    if (src_type == GGML_TYPE_F32) {
+        from_f32((const float*)src);
+    } else if (dst_type == GGML_TYPE_F32) {
+        to_f32((float*)dst);
+    } else {
+        // src_type == GGML_TYPE_F16 => dst_type is quantized
+        // src_type is quantized => dst_type == GGML_TYPE_F16 or dst_type is quantized
+        std::vector<float> src_data_f32(n);
+        to_f32(src_data_f32.data());
+        from_f32(src_data_f32.data());
     }
 }
 
+// 4-D conv kernels whose width is not a multiple of the block size are quantized as
+// [OC, IC * KH * KW] rows, see Conv2d
+int64_t get_quantized_row_length(const TensorStorage& tensor_storage, ggml_type type) {
+    if (ggml_is_quantized(type) && tensor_storage.n_dims == 4 && tensor_storage.ne[0] % ggml_blck_size(type) != 0) {
+        return tensor_storage.ne[0] * tensor_storage.ne[1] * tensor_storage.ne[2];
+    }
+    return tensor_storage.ne[0];
+}
+
+// a conv kernel and its flattened [OC, IC * KH * KW] form share the same memory layout
+bool is_same_kernel_shape(const ggml_tensor* tensor, const TensorStorage& tensor_storage) {
+    const int64_t* a = tensor->ne;
+    const int64_t* b = tensor_storage.ne;
+    if (a[2] == 1 && a[3] == 1 && a[0] == b[0] * b[1] * b[2] && a[1] == b[3]) {
+        return true;
+    }
+    if (b[2] == 1 && b[3] == 1 && b[0] == a[0] * a[1] * a[2] && b[1] == a[3]) {
+        return true;
+    }
+    return false;
+}
+
 /*================================================= ModelLoader ==================================================*/
 
 // ported from https://github.com/openai/CLIP/blob/main/clip/simple_tokenizer.py#L16
@@ -1510,7 +1709,11 @@ std::vector<TensorStorage> remove_duplicates(const std::vector<TensorStorage>& v
     return res;
 }
 
-bool ModelLoader::load_tensors(on_new_tensor_cb_t on_new_tensor_cb, ggml_backend_t backend) {
+bool ModelLoader::load_tensors(on_new_tensor_cb_t on_new_tensor_cb, ggml_backend_t backend, int n_threads) {
+    if (n_threads <= 0) {
+        n_threads = get_num_physical_cores();
+    }
+
     std::vector<TensorStorage> processed_tensor_storages;
     for (auto& tensor_storage : tensor_storages) {
         // LOG_DEBUG("%s", name.c_str());
@@ -1598,6 +1801,8 @@ bool ModelLoader::load_tensors(on_new_tensor_cb_t on_new_tensor_cb, ggml_backend
             }
 
             size_t nbytes_to_read = tensor_storage.nbytes_to_read();
+            // quantized conv kernels may be stored flattened on either side, rows have to fit the quantized one
+            int64_t n_per_row = ggml_is_quantized(dst_tensor->type) ? dst_tensor->ne[0] : tensor_storage.ne[0];
 
             if (dst_tensor->buffer == NULL || ggml_backend_buffer_is_host(dst_tensor->buffer)) {
                 // for the CPU and Metal backend, we can copy directly into the tensor
@@ -1607,10 +1812,10 @@ bool ModelLoader::load_tensors(on_new_tensor_cb_t on_new_tensor_cb, ggml_backend
 
                     if (tensor_storage.is_bf16) {
                         // inplace op
-                        bf16_to_f32_vec((uint16_t*)dst_tensor->data, (float*)dst_tensor->data, tensor_storage.nelements());
+                        bf16_to_f32_vec((uint16_t*)dst_tensor->data, (float*)dst_tensor->data, tensor_storage.nelements(), n_threads);
                     } else if (tensor_storage.is_f8_e4m3) {
                         // inplace op
-                        f8_e4m3_to_f16_vec((uint8_t*)dst_tensor->data, (uint16_t*)dst_tensor->data, tensor_storage.nelements());
+                        f8_e4m3_to_f16_vec((uint8_t*)dst_tensor->data, (uint16_t*)dst_tensor->data, tensor_storage.nelements(), n_threads);
                     }
                 } else {
                     read_buffer.resize(tensor_storage.nbytes());
@@ -1618,14 +1823,15 @@ bool ModelLoader::load_tensors(on_new_tensor_cb_t on_new_tensor_cb, ggml_backend
 
                     if (tensor_storage.is_bf16) {
                         // inplace op
-                        bf16_to_f32_vec((uint16_t*)read_buffer.data(), (float*)read_buffer.data(), tensor_storage.nelements());
+                        bf16_to_f32_vec((uint16_t*)read_buffer.data(), (float*)read_buffer.data(), tensor_storage.nelements(), n_threads);
                     } else if (tensor_storage.is_f8_e4m3) {
                         // inplace op
-                        f8_e4m3_to_f16_vec((uint8_t*)read_buffer.data(), (uint16_t*)read_buffer.data(), tensor_storage.nelements());
+                        f8_e4m3_to_f16_vec((uint8_t*)read_buffer.data(), (uint16_t*)read_buffer.data(), tensor_storage.nelements(), n_threads);
                     }
 
                     convert_tensor((void*)read_buffer.data(), tensor_storage.type, dst_tensor->data,
-                                   dst_tensor->type, (int)tensor_storage.nelements() / (int)tensor_storage.ne[0], (int)tensor_storage.ne[0]);
+                                   dst_tensor->type, (int)(tensor_storage.nelements() / n_per_row), (int)n_per_row,
+                                   n_threads);
                 }
             } else {
                 read_buffer.resize(tensor_storage.nbytes());
@@ -1633,10 +1839,10 @@ bool ModelLoader::load_tensors(on_new_tensor_cb_t on_new_tensor_cb, ggml_backend
 
                 if (tensor_storage.is_bf16) {
                     // inplace op
-                    bf16_to_f32_vec((uint16_t*)read_buffer.data(), (float*)read_buffer.data(), tensor_storage.nelements());
+                    bf16_to_f32_vec((uint16_t*)read_buffer.data(), (float*)read_buffer.data(), tensor_storage.nelements(), n_threads);
                 } else if (tensor_storage.is_f8_e4m3) {
                     // inplace op
-                    f8_e4m3_to_f16_vec((uint8_t*)read_buffer.data(), (uint16_t*)read_buffer.data(), tensor_storage.nelements());
+                    f8_e4m3_to_f16_vec((uint8_t*)read_buffer.data(), (uint16_t*)read_buffer.data(), tensor_storage.nelements(), n_threads);
                 }
 
                 if (tensor_storage.type == dst_tensor->type) {
@@ -1647,7 +1853,8 @@ bool ModelLoader::load_tensors(on_new_tensor_cb_t on_new_tensor_cb, ggml_backend
                     convert_buffer.resize(ggml_nbytes(dst_tensor));
                     convert_tensor((void*)read_buffer.data(), tensor_storage.type,
                                    (void*)convert_buffer.data(), dst_tensor->type,
-                                   (int)tensor_storage.nelements() / (int)tensor_storage.ne[0], (int)tensor_storage.ne[0]);
+                                   (int)(tensor_storage.nelements() / n_per_row), (int)n_per_row,
+                                   n_threads);
                     ggml_backend_tensor_set(dst_tensor, convert_buffer.data(), 0, ggml_nbytes(dst_tensor));
                 }
             }
@@ -1666,7 +1873,8 @@ bool ModelLoader::load_tensors(on_new_tensor_cb_t on_new_tensor_cb, ggml_backend
 
 bool ModelLoader::load_tensors(std::map<std::string, struct ggml_tensor*>& tensors,
                                ggml_backend_t backend,
-                               std::set<std::string> ignore_tensors) {
+                               std::set<std::string> ignore_tensors,
+                               int n_threads) {
     std::set<std::string> tensor_names_in_file;
     auto on_new_tensor_cb = [&](const TensorStorage& tensor_storage, ggml_tensor** dst_tensor) -> bool {
         const std::string& name = tensor_storage.name;
@@ -1686,11 +1894,11 @@ bool ModelLoader::load_tensors(std::map<std::string, struct ggml_tensor*>& tenso
             return true;
         }
 
-        if (
-            real->ne[0] != tensor_storage.ne[0] ||
-            real->ne[1] != tensor_storage.ne[1] ||
-            real->ne[2] != tensor_storage.ne[2] ||
-            real->ne[3] != tensor_storage.ne[3]) {
+        if ((real->ne[0] != tensor_storage.ne[0] ||
+             real->ne[1] != tensor_storage.ne[1] ||
+             real->ne[2] != tensor_storage.ne[2] ||
+             real->ne[3] != tensor_storage.ne[3]) &&
+            !is_same_kernel_shape(real, tensor_storage)) {
             LOG_ERROR(
                 "tensor '%s' has wrong shape in model file: "
                 "got [%d, %d, %d, %d], expected [%d, %d, %d, %d]",
@@ -1705,7 +1913,7 @@ bool ModelLoader::load_tensors(std::map<std::string, struct ggml_tensor*>& tenso
         return true;
     };
 
-    bool success = load_tensors(on_new_tensor_cb, backend);
+    bool success = load_tensors(on_new_tensor_cb, backend, n_threads);
     if (!success) {
         LOG_ERROR("load tensors from file failed");
         return false;
@@ -1740,7 +1948,7 @@ bool ModelLoader::load_tensors(std::map<std::string, struct ggml_tensor*>& tenso
 bool ModelLoader::tensor_should_be_converted(const TensorStorage& tensor_storage, ggml_type type) {
     const std::string& name = tensor_storage.name;
     if (type != GGML_TYPE_COUNT) {
-        if (ggml_is_quantized(type) && tensor_storage.ne[0] % ggml_blck_size(type) != 0) {
+        if (ggml_is_quantized(type) && get_quantized_row_length(tensor_storage, type) % ggml_blck_size(type) != 0) {
             // Pass, do not convert
         } else if (ends_with(name, ".bias")) {
             // Pass, do not convert
@@ -1768,56 +1976,522 @@ bool ModelLoader::tensor_should_be_converted(const TensorStorage& tensor_storage
     return false;
 }
 
-bool ModelLoader::save_to_gguf_file(const std::string& file_path, ggml_type type) {
-    auto backend    = ggml_backend_cpu_init();
+ggml_type ModelLoader::get_tensor_type(const TensorStorage& tensor_storage, ggml_type type, const TensorTypeRules& rules) {
+    const std::string& name = tensor_storage.name;
+    bool matched            = false;
+    ggml_type rule_type     = GGML_TYPE_COUNT;
+    auto iter               = rules.names.find(name);
+    if (iter != rules.names.end()) {
+        matched   = true;
+        rule_type = iter->second;
+    } else {
+        for (auto& rule : rules.patterns) {
+            if (std::regex_search(name, rule.regex)) {
+                matched   = true;
+                rule_type = rule.type;
+                break;
+            }
+        }
+    }
+    if (matched) {
+        if (rule_type == GGML_TYPE_COUNT) {
+            return tensor_storage.type;
+        }
+        // a rule overrides the tensors the default conversion leaves alone, as long as their
+        // rows can be quantized to it
+        if (ggml_is_quantized(rule_type) && get_quantized_row_length(tensor_storage, rule_type) % ggml_blck_size(rule_type) != 0) {
+            LOG_DEBUG("'%s' can't be converted to %s, keep %s", name.c_str(), ggml_type_name(rule_type), ggml_type_name(tensor_storage.type));
+            return tensor_storage.type;
+        }
+        return rule_type;
+    }
+    if (tensor_should_be_converted(tensor_storage, type)) {
+        return type;
+    }
+    return tensor_storage.type;
+}
+
+static float get_type_bits_per_weight(ggml_type type) {
+    return ggml_type_size(type) * 8.f / ggml_blck_size(type);
+}
+
+static bool parse_tensor_type(const std::string& str, ggml_type& type) {
+    std::string lower = str;
+    std::transform(lower.begin(), lower.end(), lower.begin(), ::tolower);
+    if (lower == "keep") {
+        type = GGML_TYPE_COUNT;
+        return true;
+    }
+    for (int i = 0; i < GGML_TYPE_COUNT; i++) {
+        const char* type_name = ggml_type_name((ggml_type)i);
+        if (type_name == NULL || ggml_type_size((ggml_type)i) == 0) {
+            continue;
+        }
+        std::string name = type_name;
+        std::transform(name.begin(), name.end(), name.begin(), ::tolower);
+        if (name == lower) {
+            type = (ggml_type)i;
+            return true;
+        }
+    }
+    return false;
+}
+
+TensorTypeRules get_tensor_type_rules_preset(SDVersion version, ggml_type type) {
+    // the VAE is small, its convolution and attention projection weights stay at f16, the
+    // biases and the norm weights match no rule and get the default conversion
+    std::string text = "^first_stage_model\\.(.*\\.)?(\\w*conv\\w*|nin_shortcut|q|k|v|proj_out)\\.weight$ = f16\n";
+    if (version == VERSION_SD1 || version == VERSION_SD2 || version == VERSION_SDXL) {
+        text +=
+            "^model\\.diffusion_model\\.input_blocks\\.0\\.0\\.weight$ = f16\n"
+            "^model\\.diffusion_model\\.out\\.2\\.weight$ = f16\n"
+            "\\.attn[12]\\.to_out\\.0\\.weight$ = q8_0\n";
+    } else if (version == VERSION_SD3_2B) {
+        text += "\\.attn\\.proj\\.weight$ = q8_0\n";
+    } else if (version == VERSION_FLUX_DEV || version == VERSION_FLUX_SCHNELL) {
+        text += "\\.(img|txt)_attn\\.proj\\.weight$ = q8_0\n";
+    }
+
+    TensorTypeRules rules;
+    TensorTypeRules preset;
+    if (type == GGML_TYPE_COUNT || !parse_tensor_type_rules(text, version, type, preset)) {
+        return rules;
+    }
+    for (auto& rule : preset.patterns) {
+        if (get_type_bits_per_weight(rule.type) > get_type_bits_per_weight(type)) {
+            rules.patterns.push_back(rule);
+        }
+    }
+    return rules;
+}
+
+bool parse_tensor_type_rules(const std::string& text, SDVersion version, ggml_type type, TensorTypeRules& rules) {
+    std::istringstream ss(text);
+    std::string line;
+    int line_number = 0;
+    while (std::getline(ss, line)) {
+        line_number++;
+        size_t comment_pos = line.find('#');
+        if (comment_pos != std::string::npos) {
+            line = line.substr(0, comment_pos);
+        }
+        line = trim(line);
+        if (line.empty()) {
+            continue;
+        }
+        if (line == TENSOR_TYPE_RULES_PRESET) {
+            rules.append(get_tensor_type_rules_preset(version, type));
+            continue;
+        }
+
+        size_t eq_pos = line.rfind('=');
+        if (eq_pos == std::string::npos) {
+            LOG_ERROR("invalid tensor type rule at line %d: '%s'", line_number, line.c_str());
+            return false;
+        }
+        TensorTypeRule rule;
+        rule.pattern          = trim(line.substr(0, eq_pos));
+        std::string type_name = trim(line.substr(eq_pos + 1));
+        if (!parse_tensor_type(type_name, rule.type)) {
+            LOG_ERROR("unknown type '%s' at line %d", type_name.c_str(), line_number);
+            return false;
+        }
+        if (rule.pattern.size() >= 2 && rule.pattern.front() == '"' && rule.pattern.back() == '"') {
+            std::string name = rule.pattern.substr(1, rule.pattern.size() - 2);
+            rules.names.insert(std::make_pair(name, rule.type));
+            continue;
+        }
+        try {
+            rule.regex = std::regex(rule.pattern);
+        } catch (const std::regex_error& e) {
+            LOG_ERROR("invalid pattern '%s' at line %d: %s", rule.pattern.c_str(), line_number, e.what());
+            return false;
+        }
+        rules.patterns.push_back(rule);
+    }
+    return true;
+}
+
+bool load_tensor_type_rules(const std::string& file_path, SDVersion version, ggml_type type, TensorTypeRules& rules) {
+    std::ifstream file(file_path);
+    if (!file.is_open()) {
+        LOG_ERROR("failed to open '%s'", file_path.c_str());
+        return false;
+    }
+    std::stringstream ss;
+    ss << file.rdbuf();
+    return parse_tensor_type_rules(ss.str(), version, type, rules);
+}
+
+bool ModelLoader::save_to_gguf_file(const std::string& file_path,
+                                    ggml_type type,
+                                    const TensorTypeRules& rules,
+                                    int n_threads) {
+    if (n_threads <= 0) {
+        n_threads = get_num_physical_cores();
+    }
+
+    // metadata only, tensor data never lives in this context
     size_t mem_size = 1 * 1024 * 1024;  // for padding
-    mem_size += tensor_storages.size() * ggml_tensor_overhead();
-    mem_size += get_params_mem_size(backend, type);
-    LOG_INFO("model tensors mem size: %.2fMB", mem_size / 1024.f / 1024.f);
-    ggml_context* ggml_ctx = ggml_init({mem_size, NULL, false});
+    mem_size += tensor_storages.size() * 3 * ggml_tensor_overhead();  // in_proj tensors are split into q/k/v
+    ggml_context* ggml_ctx = ggml_init({mem_size, NULL, true});
 
     gguf_context* gguf_ctx = gguf_init_empty();
 
-    auto on_new_tensor_cb = [&](const TensorStorage& tensor_storage, ggml_tensor** dst_tensor) -> bool {
+    std::map<ggml_type, size_t> data_size;
+
+    // first pass: collect the tensor infos without reading any data, so the header can be written up front
+    auto on_new_tensor_meta_cb = [&](const TensorStorage& tensor_storage, ggml_tensor** dst_tensor) -> bool {
         const std::string& name = tensor_storage.name;
 
-        ggml_type tensor_type = tensor_storage.type;
-        if (tensor_should_be_converted(tensor_storage, type)) {
-            tensor_type = type;
-        }
+        ggml_type tensor_type = get_tensor_type(tensor_storage, type, rules);
 
-        ggml_tensor* tensor = ggml_new_tensor(ggml_ctx, tensor_type, tensor_storage.n_dims, tensor_storage.ne);
+        ggml_tensor* tensor = NULL;
+        int64_t row_length  = get_quantized_row_length(tensor_storage, tensor_type);
+        if (row_length != tensor_storage.ne[0]) {
+            tensor = ggml_new_tensor_2d(ggml_ctx, tensor_type, row_length, tensor_storage.nelements() / row_length);
+        } else {
+            tensor = ggml_new_tensor(ggml_ctx, tensor_type, tensor_storage.n_dims, tensor_storage.ne);
+        }
         if (tensor == NULL) {
             LOG_ERROR("ggml_new_tensor failed");
             return false;
         }
         ggml_set_name(tensor, name.c_str());
 
-        // LOG_DEBUG("%s %d %s %d[%d %d %d %d] %d[%d %d %d %d]", name.c_str(),
-        // ggml_nbytes(tensor), ggml_type_name(tensor_type),
-        // tensor_storage.n_dims,
-        // tensor_storage.ne[0], tensor_storage.ne[1], tensor_storage.ne[2], tensor_storage.ne[3],
-        // tensor->n_dims, tensor->ne[0], tensor->ne[1], tensor->ne[2], tensor->ne[3]);
-
-        *dst_tensor = tensor;
-
         gguf_add_tensor(gguf_ctx, tensor);
+        data_size[tensor_type] += ggml_nbytes(tensor);
 
         return true;
     };
 
-    bool success = load_tensors(on_new_tensor_cb, backend);
-    ggml_backend_free(backend);
-    LOG_INFO("load tensors done");
+    bool success = load_tensors(on_new_tensor_meta_cb, NULL, n_threads);
+    for (auto& pair : data_size) {
+        LOG_INFO("%s: %.2fMB", ggml_type_name(pair.first), pair.second / 1024.f / 1024.f);
+    }
+    if (!success) {
+        ggml_free(ggml_ctx);
+        gguf_free(gguf_ctx);
+        return false;
+    }
+
     LOG_INFO("trying to save tensors to %s", file_path.c_str());
+    std::ofstream file(file_path, std::ios::binary);
+    if (!file.is_open()) {
+        LOG_ERROR("failed to open '%s'", file_path.c_str());
+        ggml_free(ggml_ctx);
+        gguf_free(gguf_ctx);
+        return false;
+    }
+
+    // the meta data is already padded to the alignment, so the data section starts right after it
+    std::vector<uint8_t> meta(gguf_get_meta_size(gguf_ctx));
+    gguf_get_meta_data(gguf_ctx, meta.data());
+    file.write((const char*)meta.data(), meta.size());
+
+    // second pass: load/convert one tensor at a time while the previous one is being written,
+    // so at most two converted tensors are held in memory
+    const size_t alignment = gguf_get_alignment(gguf_ctx);
+    const int n_tensors    = gguf_get_n_tensors(gguf_ctx);
+    std::vector<uint8_t> load_buffer;
+    std::vector<uint8_t> write_buffer;
+    std::thread writer;
+    bool write_failed    = false;
+    int tensor_index     = 0;
+    ggml_tensor* pending = NULL;
+    int64_t t0           = ggml_time_ms();
+
+    auto write_tensor_data = [&](size_t nbytes) {
+        static const char zeros[256] = {0};
+        file.write((const char*)write_buffer.data(), nbytes);
+        size_t pad = GGML_PAD(nbytes, alignment) - nbytes;
+        while (pad > 0) {
+            size_t n = std::min(pad, sizeof(zeros));
+            file.write(zeros, n);
+            pad -= n;
+        }
+        if (!file) {
+            write_failed = true;
+        }
+    };
+
+    auto flush_pending = [&]() {
+        if (writer.joinable()) {
+            writer.join();
+        }
+        if (pending == NULL) {
+            return;
+        }
+        std::swap(load_buffer, write_buffer);
+        writer  = std::thread(write_tensor_data, ggml_nbytes(pending));
+        pending = NULL;
+    };
+
+    auto on_new_tensor_cb = [&](const TensorStorage& tensor_storage, ggml_tensor** dst_tensor) -> bool {
+        // load_tensors is sequential, the previous tensor is fully converted once the next one is requested
+        flush_pending();
+        if (write_failed) {
+            LOG_ERROR("write tensor data failed: '%s'", file_path.c_str());
+            return false;
+        }
+
+        const std::string& name = tensor_storage.name;
+        ggml_tensor* tensor     = ggml_get_tensor(ggml_ctx, name.c_str());
+        if (tensor == NULL || gguf_find_tensor(gguf_ctx, name.c_str()) != tensor_index) {
+            LOG_ERROR("tensor '%s' is out of order", name.c_str());
+            return false;
+        }
+
+        load_buffer.resize(ggml_nbytes(tensor));
+        tensor->data = load_buffer.data();
+        *dst_tensor  = tensor;
+        pending      = tensor;
+
+        tensor_index++;
+        pretty_progress(tensor_index, n_tensors, (ggml_time_ms() - t0) / 1000.f / tensor_index);
+        return true;
+    };
+
+    success = load_tensors(on_new_tensor_cb, NULL, n_threads);
     if (success) {
-        gguf_write_to_file(gguf_ctx, file_path.c_str(), false);
+        flush_pending();
+    }
+    if (writer.joinable()) {
+        writer.join();
+    }
+    if (write_failed) {
+        LOG_ERROR("write tensor data failed: '%s'", file_path.c_str());
+        success = false;
+    }
+    if (success) {
+        LOG_INFO("save %d tensors done, taking %.2fs", n_tensors, (ggml_time_ms() - t0) / 1000.f);
     }
     ggml_free(ggml_ctx);
     gguf_free(gguf_ctx);
     return success;
 }
 
+bool ModelLoader::measure_quantization_errors(const std::vector<ggml_type>& types,
+                                              std::vector<TensorQuantizationErrors>& tensors,
+                                              int64_t& fixed_size,
+                                              int n_threads) {
+    if (n_threads <= 0) {
+        n_threads = get_num_physical_cores();
+    }
+
+    size_t mem_size = 1 * 1024 * 1024;
+    mem_size += tensor_storages.size() * 3 * ggml_tensor_overhead();  // in_proj tensors are split into q/k/v
+    ggml_context* ggml_ctx = ggml_init({mem_size, NULL, true});
+
+    fixed_size = 0;
+    std::vector<float> src_data;
+    std::vector<float> dst_data;
+    std::vector<uint8_t> quant_data;
+    const TensorStorage* pending = NULL;
+    TensorStorage pending_storage;
+
+    std::vector<TensorStorage> processed_tensor_storages;
+    for (auto& tensor_storage : tensor_storages) {
+        if (is_unused_tensor(tensor_storage.name)) {
+            continue;
+        }
+        preprocess_tensor(tensor_storage, processed_tensor_storages);
+    }
+    int n_tensors = (int)remove_duplicates(processed_tensor_storages).size();
+    int n_loaded  = 0;
+    int64_t t0    = ggml_time_ms();
+
+    auto measure_pending = [&]() {
+        if (pending == NULL) {
+            return;
+        }
+        const TensorStorage& tensor_storage = *pending;
+
+        TensorQuantizationErrors tensor_errors;
+        tensor_errors.name      = tensor_storage.name;
+        tensor_errors.nelements = tensor_storage.nelements();
+
+        double src_sq = 0;
+        for (float v : src_data) {
+            src_sq += (double)v * v;
+        }
+
+        for (ggml_type type : types) {
+            if (!tensor_should_be_converted(tensor_storage, type)) {
+                continue;
+            }
+            int64_t n_per_row = get_quantized_row_length(tensor_storage, type);
+            int64_t nrows     = tensor_storage.nelements() / n_per_row;
+
+            QuantizationError error;
+            error.type   = type;
+            error.nbytes = (int64_t)ggml_row_size(type, n_per_row) * nrows;
+
+            double sse = 0, dot = 0, dst_sq = 0;
+            if (type != GGML_TYPE_F32) {
+                quant_data.resize(error.nbytes);
+                dst_data.resize(src_data.size());
+                convert_tensor(src_data.data(), GGML_TYPE_F32, quant_data.data(), type, (int)nrows, (int)n_per_row, n_threads);
+                convert_tensor(quant_data.data(), type, dst_data.data(), GGML_TYPE_F32, (int)nrows, (int)n_per_row, n_threads);
+                for (size_t i = 0; i < src_data.size(); i++) {
+                    double x = src_data[i];
+                    double y = dst_data[i];
+                    sse += (x - y) * (x - y);
+                    dot += x * y;
+                    dst_sq += y * y;
+                }
+            } else {
+                dot    = src_sq;
+                dst_sq = src_sq;
+            }
+            error.rmse    = sqrt(sse / tensor_errors.nelements);
+            error.cos_sim = (src_sq > 0 && dst_sq > 0) ? dot / sqrt(src_sq * dst_sq) : 1.0;
+            error.nmse    = src_sq > 0 ? sse / src_sq : 0.0;
+            LOG_DEBUG("%s %s: rmse %.6g, cos %.6f, nmse %.6g",
+                      tensor_errors.name.c_str(), ggml_type_name(type), error.rmse, error.cos_sim, error.nmse);
+            tensor_errors.errors.push_back(error);
+        }
+        tensors.push_back(tensor_errors);
+        pending = NULL;
+    };
+
+    auto on_new_tensor_cb = [&](const TensorStorage& tensor_storage, ggml_tensor** dst_tensor) -> bool {
+        // load_tensors is sequential, the previous tensor is fully loaded once the next one is requested
+        measure_pending();
+
+        n_loaded++;
+        pretty_progress(n_loaded, n_tensors, (ggml_time_ms() - t0) / 1000.f / n_loaded);
+
+        bool measurable = false;
+        for (ggml_type type : types) {
+            if (tensor_should_be_converted(tensor_storage, type)) {
+                measurable = true;
+                break;
+            }
+        }
+        if (!measurable) {
+            fixed_size += tensor_storage.nbytes();
+            return true;
+        }
+
+        ggml_tensor* tensor = ggml_new_tensor(ggml_ctx, GGML_TYPE_F32, tensor_storage.n_dims, tensor_storage.ne);
+        if (tensor == NULL) {
+            LOG_ERROR("ggml_new_tensor failed");
+            return false;
+        }
+        src_data.resize(tensor_storage.nelements());
+        tensor->data    = src_data.data();
+        pending_storage = tensor_storage;
+        pending         = &pending_storage;
+        *dst_tensor     = tensor;
+        return true;
+    };
+
+    bool success = load_tensors(on_new_tensor_cb, NULL, n_threads);
+    if (success) {
+        measure_pending();
+    }
+    ggml_free(ggml_ctx);
+    return success;
+}
+
+std::map<std::string, ggml_type> select_tensor_types(const std::vector<TensorQuantizationErrors>& tensors, int64_t target_size) {
+    // drop the candidates that are both larger and less accurate than another one,
+    // what is left is sorted by size with the error decreasing
+    std::vector<std::vector<QuantizationError>> candidates;
+    for (auto& tensor : tensors) {
+        std::vector<QuantizationError> errors = tensor.errors;
+        std::sort(errors.begin(), errors.end(), [](const QuantizationError& a, const QuantizationError& b) {
+            return a.nbytes < b.nbytes || (a.nbytes == b.nbytes && a.nmse < b.nmse);
+        });
+        std::vector<QuantizationError> pareto;
+        for (auto& error : errors) {
+            if (pareto.empty() || error.nmse < pareto.back().nmse) {
+                pareto.push_back(error);
+            }
+        }
+        candidates.push_back(pareto);
+    }
+
+    // start from the smallest type everywhere and keep taking the upgrade that removes
+    // the most error per byte until nothing fits into the budget anymore
+    std::vector<size_t> current(tensors.size(), 0);
+    int64_t total_size = 0;
+    for (auto& pareto : candidates) {
+        total_size += pareto[0].nbytes;
+    }
+    if (total_size > target_size) {
+        LOG_WARN("target size %.2fMB is too small, at least %.2fMB are required",
+                 target_size / 1024.f / 1024.f, total_size / 1024.f / 1024.f);
+    }
+    while (true) {
+        double best_gain  = 0;
+        size_t best_index = 0;
+        size_t best_type  = 0;
+        for (size_t i = 0; i < candidates.size(); i++) {
+            const QuantizationError& cur = candidates[i][current[i]];
+            double nelements             = (double)tensors[i].nelements;
+            for (size_t j = current[i] + 1; j < candidates[i].size(); j++) {
+                const QuantizationError& next = candidates[i][j];
+                int64_t extra_size            = next.nbytes - cur.nbytes;
+                if (total_size + extra_size > target_size) {
+                    break;
+                }
+                double gain = (cur.nmse - next.nmse) * nelements / std::max(extra_size, (int64_t)1);
+                if (gain > best_gain) {
+                    best_gain  = gain;
+                    best_index = i;
+                    best_type  = j;
+                }
+            }
+        }
+        if (best_gain <= 0) {
+            break;
+        }
+        total_size += candidates[best_index][best_type].nbytes - candidates[best_index][current[best_index]].nbytes;
+        current[best_index] = best_type;
+    }
+
+    std::map<std::string, ggml_type> tensor_types;
+    double total_error = 0;
+    for (size_t i = 0; i < tensors.size(); i++) {
+        const QuantizationError& selected = candidates[i][current[i]];
+        tensor_types[tensors[i].name]     = selected.type;
+        total_error += selected.nmse * tensors[i].nelements;
+    }
+    LOG_INFO("selected tensor types: %.2fMB, weighted error %.6g", total_size / 1024.f / 1024.f, total_error);
+    return tensor_types;
+}
+
+bool save_tensor_type_rules(const std::string& file_path,
+                            const std::vector<TensorQuantizationErrors>& tensors,
+                            const std::map<std::string, ggml_type>& tensor_types) {
+    std::ofstream file(file_path);
+    if (!file.is_open()) {
+        LOG_ERROR("failed to open '%s'", file_path.c_str());
+        return false;
+    }
+    file << "# generated by the quantization error analyzer\n";
+    for (auto& tensor : tensors) {
+        auto iter = tensor_types.find(tensor.name);
+        if (iter == tensor_types.end()) {
+            continue;
+        }
+        for (auto& error : tensor.errors) {
+            if (error.type == iter->second) {
+                file << '"' << tensor.name << "\" = " << ggml_type_name(error.type)
+                     << "  # rmse " << error.rmse << ", cos " << error.cos_sim << "\n";
+                break;
+            }
+        }
+    }
+    if (!file) {
+        LOG_ERROR("write '%s' failed", file_path.c_str());
+        return false;
+    }
+    return true;
+}
+
 int64_t ModelLoader::get_params_mem_size(ggml_backend_t backend, ggml_type type) {
     size_t alignment = 128;
     if (backend != NULL) {
@@ -1842,7 +2516,12 @@ int64_t ModelLoader::get_params_mem_size(ggml_backend_t backend, ggml_type type)
     return mem_size;
 }
 
-bool convert(const char* input_path, const char* vae_path, const char* output_path, sd_type_t output_type) {
+bool convert(const char* input_path,
+             const char* vae_path,
+             const char* output_path,
+             sd_type_t output_type,
+             const char* tensor_type_rules,
+             int n_threads) {
     ModelLoader model_loader;
 
     if (!model_loader.init_from_file(input_path)) {
@@ -1856,6 +2535,63 @@ bool convert(const char* input_path, const char* vae_path, const char* output_pa
             return false;
         }
     }
-    bool success = model_loader.save_to_gguf_file(output_path, (ggml_type)output_type);
+
+    TensorTypeRules rules;
+    if (tensor_type_rules != NULL && strlen(tensor_type_rules) > 0) {
+        SDVersion version = model_loader.get_sd_version();
+        if (strcmp(tensor_type_rules, TENSOR_TYPE_RULES_PRESET) == 0) {
+            rules = get_tensor_type_rules_preset(version, (ggml_type)output_type);
+        } else if (!load_tensor_type_rules(tensor_type_rules, version, (ggml_type)output_type, rules)) {
+            LOG_ERROR("load tensor type rules failed: '%s'", tensor_type_rules);
+            return false;
+        }
+        LOG_INFO("using %d tensor type rules", (int)rules.size());
+    }
+
+    bool success = model_loader.save_to_gguf_file(output_path, (ggml_type)output_type, rules, n_threads);
     return success;
 }
+
+bool analyze_quantization(const char* input_path,
+                          const char* vae_path,
+                          const char* output_path,
+                          const sd_type_t* types,
+                          int n_types,
+                          uint64_t target_size,
+                          int n_threads) {
+    ModelLoader model_loader;
+
+    if (!model_loader.init_from_file(input_path)) {
+        LOG_ERROR("init model loader from file failed: '%s'", input_path);
+        return false;
+    }
+
+    if (vae_path != NULL && strlen(vae_path) > 0) {
+        if (!model_loader.init_from_file(vae_path, "vae.")) {
+            LOG_ERROR("init model loader from file failed: '%s'", vae_path);
+            return false;
+        }
+    }
+
+    std::vector<ggml_type> candidate_types;
+    if (types != NULL && n_types > 0) {
+        for (int i = 0; i < n_types; i++) {
+            candidate_types.push_back((ggml_type)types[i]);
+        }
+    } else {
+        candidate_types = {GGML_TYPE_F16, GGML_TYPE_Q8_0, GGML_TYPE_Q6_K, GGML_TYPE_Q5_K, GGML_TYPE_Q5_0,
+                           GGML_TYPE_Q4_K, GGML_TYPE_Q4_0, GGML_TYPE_Q3_K, GGML_TYPE_Q2_K};
+    }
+
+    std::vector<TensorQuantizationErrors> tensors;
+    int64_t fixed_size = 0;
+    if (!model_loader.measure_quantization_errors(candidate_types, tensors, fixed_size, n_threads)) {
+        LOG_ERROR("measure quantization errors failed");
+        return false;
+    }
+    LOG_INFO("%d tensors measured, %.2fMB can not be quantized", (int)tensors.size(), fixed_size / 1024.f / 1024.f);
+
+    int64_t budget                                = (int64_t)target_size - fixed_size;
+    std::map<std::string, ggml_type> tensor_types = select_tensor_types(tensors, budget);
+    return save_tensor_type_rules(output_path, tensors, tensor_types);
+}
@@ -4,10 +4,12 @@
 #include <functional>
 #include <map>
 #include <memory>
+#include <regex>
 #include <set>
 #include <sstream>
 #include <string>
 #include <tuple>
+#include <unordered_map>
 #include <vector>
 
 #include "ggml-backend.h"
@@ -128,6 +130,63 @@ struct TensorStorage {
 
 typedef std::function<bool(const TensorStorage&, ggml_tensor**)> on_new_tensor_cb_t;
 
+// the built-in rules, as the rules argument of convert or as a line of a rules file; the '@'
+// keeps it apart from a file named "preset"
+#define TENSOR_TYPE_RULES_PRESET "@preset"
+
+// Per tensor type override used when saving gguf files. A rule naming the tensor wins, otherwise
+// the first rule whose pattern matches the tensor name. GGML_TYPE_COUNT keeps the type of the
+// source file.
+struct TensorTypeRule {
+    std::string pattern;
+    std::regex regex;
+    ggml_type type = GGML_TYPE_COUNT;
+};
+
+struct TensorTypeRules {
+    std::unordered_map<std::string, ggml_type> names;  // exact tensor names, the first rule of a name is kept
+    std::vector<TensorTypeRule> patterns;
+
+    size_t size() const {
+        return names.size() + patterns.size();
+    }
+
+    void append(const TensorTypeRules& rules) {
+        names.insert(rules.names.begin(), rules.names.end());
+        patterns.insert(patterns.end(), rules.patterns.begin(), rules.patterns.end());
+    }
+};
+
+// One rule per line: "<regex> = <type|keep>", or "\"<tensor name>\" = <type|keep>" for a single
+// tensor, '#' starts a comment.
+// A line containing only TENSOR_TYPE_RULES_PRESET inserts the built-in rules for the given version and
+// target type. A rule applies to the tensors the default conversion leaves alone as well, such as biases.
+bool parse_tensor_type_rules(const std::string& text, SDVersion version, ggml_type type, TensorTypeRules& rules);
+bool load_tensor_type_rules(const std::string& file_path, SDVersion version, ggml_type type, TensorTypeRules& rules);
+// Keeps quantization sensitive layers at a higher precision, only rules wider than `type` are returned.
+TensorTypeRules get_tensor_type_rules_preset(SDVersion version, ggml_type type);
+
+struct QuantizationError {
+    ggml_type type;
+    int64_t nbytes;
+    double rmse;
+    double cos_sim;
+    double nmse;  // squared error relative to the squared norm of the source weights
+};
+
+struct TensorQuantizationErrors {
+    std::string name;
+    int64_t nelements;
+    std::vector<QuantizationError> errors;  // one entry per candidate type the tensor can be stored as
+};
+
+// Picks one type per tensor so that the total size stays within target_size while the
+// sum of nelements * nmse is kept as low as possible.
+std::map<std::string, ggml_type> select_tensor_types(const std::vector<TensorQuantizationErrors>& tensors, int64_t target_size);
+bool save_tensor_type_rules(const std::string& file_path,
+                            const std::vector<TensorQuantizationErrors>& tensors,
+                            const std::map<std::string, ggml_type>& tensor_types);
+
 class ModelLoader {
 protected:
     std::vector<std::string> file_paths_;
@@ -152,12 +211,24 @@ public:
     ggml_type get_conditioner_wtype();
     ggml_type get_diffusion_model_wtype();
     ggml_type get_vae_wtype();
-    bool load_tensors(on_new_tensor_cb_t on_new_tensor_cb, ggml_backend_t backend);
+    // n_threads <= 0 means the number of physical cores
+    bool load_tensors(on_new_tensor_cb_t on_new_tensor_cb, ggml_backend_t backend, int n_threads = 0);
     bool load_tensors(std::map<std::string, struct ggml_tensor*>& tensors,
                       ggml_backend_t backend,
-                      std::set<std::string> ignore_tensors = {});
-    bool save_to_gguf_file(const std::string& file_path, ggml_type type);
+                      std::set<std::string> ignore_tensors = {},
+                      int n_threads                        = 0);
+    bool save_to_gguf_file(const std::string& file_path,
+                           ggml_type type,
+                           const TensorTypeRules& rules = {},
+                           int n_threads                = 0);
     bool tensor_should_be_converted(const TensorStorage& tensor_storage, ggml_type type);
+    ggml_type get_tensor_type(const TensorStorage& tensor_storage, ggml_type type, const TensorTypeRules& rules);
+    // round trips every tensor through each of the candidate types, tensors that can not be stored as
+    // any of them are not measured and their size in the source type is added to fixed_size
+    bool measure_quantization_errors(const std::vector<ggml_type>& types,
+                                     std::vector<TensorQuantizationErrors>& tensors,
+                                     int64_t& fixed_size,
+                                     int n_threads = 0);
     int64_t get_params_mem_size(ggml_backend_t backend, ggml_type type = GGML_TYPE_COUNT);
     ~ModelLoader() = default;
 
@@ -204,7 +204,7 @@ public:
 
         ggml_context* ctx0 = compute_ctx;
 
-        struct ggml_cgraph* gf = ggml_new_graph(compute_ctx);
+        struct ggml_cgraph* gf = ggml_new_graph_custom(compute_ctx, sd_graph_size(GGML_DEFAULT_GRAPH_SIZE), false);
 
         int64_t hidden_size = prompt_embeds->ne[0];
         int64_t seq_length  = prompt_embeds->ne[1];
@@ -46,6 +46,59 @@ const char* sampling_methods_str[] = {
     "LCM",
 };
 
+// latent channel => rgb in [-1, 1], fitted on decoded images, for the linear previews
+const float sd_latent_rgb_factors[4][3] = {
+    {0.3512f, 0.2297f, 0.3227f},
+    {0.3250f, 0.4974f, 0.2350f},
+    {-0.2829f, 0.1762f, 0.2721f},
+    {-0.2120f, -0.2616f, -0.7177f}};
+
+const float sdxl_latent_rgb_factors[4][3] = {
+    {0.3651f, 0.4232f, 0.4341f},
+    {-0.2533f, -0.0042f, 0.1068f},
+    {0.1076f, 0.1111f, -0.0362f},
+    {-0.3165f, -0.2492f, -0.2188f}};
+
+const float sdxl_latent_rgb_bias[3] = {0.1084f, -0.0175f, -0.0011f};
+
+const float sd3_latent_rgb_factors[16][3] = {
+    {-0.0645f, 0.0177f, 0.1052f},
+    {0.0028f, 0.0312f, 0.0650f},
+    {0.1848f, 0.0762f, 0.0360f},
+    {0.0944f, 0.0360f, 0.0889f},
+    {0.0897f, 0.0506f, -0.0364f},
+    {-0.0020f, 0.1203f, 0.0284f},
+    {0.0855f, 0.0118f, 0.0283f},
+    {-0.0539f, 0.0658f, 0.1047f},
+    {-0.0057f, 0.0116f, 0.0700f},
+    {-0.0412f, 0.0281f, -0.0039f},
+    {0.1106f, 0.1171f, 0.1220f},
+    {-0.0248f, 0.0682f, -0.0481f},
+    {0.0815f, 0.0846f, 0.1207f},
+    {-0.0120f, -0.0055f, -0.0867f},
+    {-0.0749f, -0.0634f, -0.0456f},
+    {-0.1418f, -0.1457f, -0.1259f}};
+
+const float flux_latent_rgb_factors[16][3] = {
+    {-0.0404f, 0.0159f, 0.0609f},
+    {0.0043f, 0.0298f, 0.0850f},
+    {0.0328f, -0.0749f, -0.0503f},
+    {-0.0245f, 0.0085f, 0.0549f},
+    {0.0966f, 0.0894f, 0.0530f},
+    {0.0035f, 0.0399f, 0.0123f},
+    {0.0583f, 0.1184f, 0.1262f},
+    {-0.0191f, -0.0206f, -0.0306f},
+    {-0.0324f, 0.0055f, 0.1001f},
+    {0.0955f, 0.0659f, -0.0545f},
+    {-0.0504f, 0.0231f, -0.0013f},
+    {0.0500f, -0.0008f, -0.0088f},
+    {0.0982f, 0.0941f, 0.0976f},
+    {-0.1233f, -0.0280f, -0.0897f},
+    {-0.0005f, -0.0530f, -0.0020f},
+    {-0.1273f, -0.1146f, -0.0480f}};
+
+const float flux_latent_rgb_bias[3] = {-0.0329f, -0.0718f, -0.0851f};
+
 /*================================================== Helper Functions ================================================*/
 
 void calculate_alphas_cumprod(float* alphas_cumprod,
@@ -65,6 +118,11 @@ void calculate_alphas_cumprod(float* alphas_cumprod,
 
 /*=============================================== StableDiffusionGGML ================================================*/
 
+// vae compute memory a decode may use, see sd_set_vae_decode_budget
+static uint64_t sd_vae_decode_budget = 0;
+// tiled encodes normalize with the statistics of the whole image, see sd_set_vae_tiling_exact
+static bool sd_vae_tiling_exact = false;
+
 class StableDiffusionGGML {
 public:
     ggml_backend_t backend             = NULL;  // general backend
@@ -95,14 +153,42 @@ public:
 
     std::string taesd_path;
     bool use_tiny_autoencoder = false;
+    // taesd decoding the PREVIEW_TAE previews, tae_first_stage or one of its own next to the vae
+    std::string preview_taesd_path;
+    std::shared_ptr<TinyAutoEncoder> preview_tae;
     bool vae_tiling           = false;
     bool stacked_id           = false;
 
     std::map<std::string, struct ggml_tensor*> tensors;
+    // kept after loading, it knows where every weight lives in the model files
+    ModelLoader model_loader;
 
     std::string lora_model_dir;
     // lora_name => multiplier
     std::unordered_map<std::string, float> curr_lora_state;
+    // lora_name => weights the merged lora changed
+    std::map<std::string, std::set<std::string>> merged_lora_tensors;
+    // run the loras next to the weights instead of merging them into the weights
+    bool lora_runtime = false;
+    // lora_name => one lora model per backend holding model weights
+    std::map<std::string, std::vector<std::shared_ptr<LoraModel>>> runtime_loras;
+    // arguments of the last apply_runtime_loras, the bindings stay while they don't change
+    std::unordered_map<std::string, float> runtime_lora_state;
+    std::vector<std::unordered_map<std::string, float>> runtime_item_lora_states;
+    // encode only the real t5 tokens and mask the padding
+    bool t5_mask_padding = false;
+    // threads decoding a latent while the next one is sampled, 0 decodes after sampling
+    int decode_threads = 0;
+    // decode the sdxl vae with f16 activations, only safe with the fp16 fix vae
+    bool vae_f16 = false;
+    // decode again with f32 activations and report the pixel error of the f16 decode
+    bool vae_validate = false;
+    // compute buffer of an untiled decode of n latent pixels, about
+    // decode_buffer_linear * n + decode_buffer_quadratic * n * n, probed once
+    double decode_buffer_linear    = 0;
+    double decode_buffer_quadratic = 0;
+    // identifies the text encoders in the condition cache keys
+    std::string cond_model_id;
 
     std::shared_ptr<Denoiser> denoiser = std::make_shared<CompVisDenoiser>();
 
@@ -125,6 +211,10 @@ public:
     }
 
     ~StableDiffusionGGML() {
+        RuntimeLoraRegistry::instance().remove(this);
+        runtime_loras.clear();
+        LoraCache::instance().remove_backend(backend);
+        LoraCache::instance().remove_backend(clip_backend);
         if (clip_backend != backend) {
             ggml_backend_free(clip_backend);
         }
@@ -187,8 +277,6 @@ public:
         LOG_INFO("Flash Attention enabled");
 #endif
 #endif
-        ModelLoader model_loader;
-
         vae_tiling = vae_tiling_;
 
         if (model_path.size() > 0) {
@@ -259,10 +347,6 @@ public:
             vae_wtype             = wtype;
         }
 
-        if (version == VERSION_SDXL) {
-            vae_wtype = GGML_TYPE_F32;
-        }
-
         LOG_INFO("Weight type:                 %s", ggml_type_name(model_wtype));
         LOG_INFO("Conditioner weight type:     %s", ggml_type_name(conditioner_wtype));
         LOG_INFO("Diffusion model weight type: %s", ggml_type_name(diffusion_model_wtype));
@@ -272,11 +356,10 @@ public:
 
         if (version == VERSION_SDXL) {
             scale_factor = 0.13025f;
-            if (vae_path.size() == 0 && taesd_path.size() == 0) {
-                LOG_WARN(
-                    "!!!It looks like you are using SDXL model. "
-                    "If you find that the generated images are completely black, "
-                    "try specifying SDXL VAE FP16 Fix with the --vae parameter. "
+            if (!vae_f16 && taesd_path.size() == 0) {
+                LOG_INFO(
+                    "the SDXL vae runs with f32 activations, the f16 ones overflow. "
+                    "With the SDXL VAE FP16 Fix (--vae) add --vae-f16 to decode faster and with less memory. "
                     "You can find it here: https://huggingface.co/madebyollin/sdxl-vae-fp16-fix/blob/main/sdxl_vae.safetensors");
             }
         } else if (version == VERSION_SD3_2B) {
@@ -296,6 +379,7 @@ public:
             diffusion_model->get_param_tensors(tensors);
 
             first_stage_model = std::make_shared<AutoEncoderKL>(backend, vae_wtype, vae_decode_only, true, version);
+            first_stage_model->scale_factor = scale_factor;
             LOG_DEBUG("vae_decode_only %d", vae_decode_only);
             first_stage_model->alloc_params_buffer();
             first_stage_model->get_param_tensors(tensors, "first_stage_model");
@@ -314,10 +398,10 @@ public:
                 clip_backend = ggml_backend_cpu_init();
             }
             if (version == VERSION_SD3_2B) {
-                cond_stage_model = std::make_shared<SD3CLIPEmbedder>(clip_backend, conditioner_wtype);
+                cond_stage_model = std::make_shared<SD3CLIPEmbedder>(clip_backend, conditioner_wtype, -1, t5_mask_padding);
                 diffusion_model  = std::make_shared<MMDiTModel>(backend, diffusion_model_wtype, version);
             } else if (version == VERSION_FLUX_DEV || version == VERSION_FLUX_SCHNELL) {
-                cond_stage_model = std::make_shared<FluxCLIPEmbedder>(clip_backend, conditioner_wtype);
+                cond_stage_model = std::make_shared<FluxCLIPEmbedder>(clip_backend, conditioner_wtype, -1, t5_mask_padding);
                 diffusion_model  = std::make_shared<FluxModel>(backend, diffusion_model_wtype, version);
             } else {
                 cond_stage_model = std::make_shared<FrozenCLIPEmbedderWithCustomWords>(clip_backend, conditioner_wtype, embeddings_path, version);
@@ -326,21 +410,47 @@ public:
             cond_stage_model->alloc_params_buffer();
             cond_stage_model->get_param_tensors(tensors);
 
+            cond_model_id = format("%s:%" PRId64 "|%s:%" PRId64 "|%s:%" PRId64 "|%s|%d|%s|%d",
+                                   model_path.c_str(), get_file_mtime(model_path),
+                                   clip_l_path.c_str(), get_file_mtime(clip_l_path),
+                                   t5xxl_path.c_str(), get_file_mtime(t5xxl_path),
+                                   ggml_type_name(conditioner_wtype),
+                                   (int)version,
+                                   ggml_backend_name(clip_backend),
+                                   (int)t5_mask_padding);
+
             diffusion_model->alloc_params_buffer();
             diffusion_model->get_param_tensors(tensors);
 
+            if (!use_tiny_autoencoder && vae_on_cpu && !ggml_backend_is_cpu(backend)) {
+                LOG_INFO("VAE Autoencoder: Using CPU backend");
+                vae_backend = ggml_backend_cpu_init();
+            } else if (decode_threads > 0 && ggml_backend_is_cpu(backend)) {
+                // a cpu backend of its own, so that decoding can run next to sampling
+                vae_backend = ggml_backend_cpu_init();
+            } else {
+                vae_backend = backend;
+            }
+            if (decode_threads > 0 && vae_backend == backend) {
+                LOG_WARN("decoding next to sampling needs the vae on the cpu, try --vae-on-cpu");
+            }
             if (!use_tiny_autoencoder) {
-                if (vae_on_cpu && !ggml_backend_is_cpu(backend)) {
-                    LOG_INFO("VAE Autoencoder: Using CPU backend");
-                    vae_backend = ggml_backend_cpu_init();
-                } else {
-                    vae_backend = backend;
-                }
                 first_stage_model = std::make_shared<AutoEncoderKL>(vae_backend, vae_wtype, vae_decode_only, false, version);
+                first_stage_model->scale_factor = scale_factor;
+                if (version == VERSION_SDXL) {
+                    first_stage_model->encoder_activation_type = GGML_TYPE_F32;
+                    first_stage_model->decoder_activation_type = vae_f16 ? GGML_TYPE_F16 : GGML_TYPE_F32;
+                }
                 first_stage_model->alloc_params_buffer();
                 first_stage_model->get_param_tensors(tensors, "first_stage_model");
             } else {
-                tae_first_stage = std::make_shared<TinyAutoEncoder>(backend, vae_wtype, vae_decode_only);
+                tae_first_stage = std::make_shared<TinyAutoEncoder>(vae_backend, vae_wtype, vae_decode_only);
+            }
+            if (use_tiny_autoencoder) {
+                preview_tae = tae_first_stage;
+            } else if (preview_taesd_path.size() > 0) {
+                // only decodes the previews, next to the diffusion model
+                preview_tae = std::make_shared<TinyAutoEncoder>(backend, vae_wtype, true);
             }
             // first_stage_model->get_param_tensors(tensors, "first_stage_model.");
 
@@ -415,7 +525,7 @@ public:
         if (version == VERSION_SVD) {
             ignore_tensors.insert("conditioner.embedders.3");
         }
-        bool success = model_loader.load_tensors(tensors, backend, ignore_tensors);
+        bool success = model_loader.load_tensors(tensors, backend, ignore_tensors, n_threads);
         if (!success) {
             LOG_ERROR("load tensors from model loader failed");
             ggml_free(ctx);
@@ -440,6 +550,13 @@ public:
                 }
                 vae_params_mem_size = tae_first_stage->get_params_buffer_size();
             }
+            size_t preview_params_mem_size = 0;
+            if (preview_tae && preview_tae != tae_first_stage) {
+                if (!preview_tae->load_from_file(preview_taesd_path)) {
+                    return false;
+                }
+                preview_params_mem_size = preview_tae->get_params_buffer_size();
+            }
             size_t control_net_params_mem_size = 0;
             if (control_net) {
                 if (!control_net->load_from_file(control_net_path)) {
@@ -461,9 +578,9 @@ public:
             }
 
             if (ggml_backend_is_cpu(backend)) {
-                total_params_ram_size += unet_params_mem_size;
+                total_params_ram_size += unet_params_mem_size + preview_params_mem_size;
             } else {
-                total_params_vram_size += unet_params_mem_size;
+                total_params_vram_size += unet_params_mem_size + preview_params_mem_size;
             }
 
             if (ggml_backend_is_cpu(vae_backend)) {
@@ -604,63 +721,262 @@ public:
         return result < -1;
     }
 
-    void apply_lora(const std::string& lora_name, float multiplier) {
-        int64_t t0                 = ggml_time_ms();
+    std::string get_lora_file_path(const std::string& lora_name) {
         std::string st_file_path   = path_join(lora_model_dir, lora_name + ".safetensors");
         std::string ckpt_file_path = path_join(lora_model_dir, lora_name + ".ckpt");
-        std::string file_path;
         if (file_exists(st_file_path)) {
-            file_path = st_file_path;
+            return st_file_path;
         } else if (file_exists(ckpt_file_path)) {
-            file_path = ckpt_file_path;
-        } else {
-            LOG_WARN("can not find %s or %s for lora %s", st_file_path.c_str(), ckpt_file_path.c_str(), lora_name.c_str());
+            return ckpt_file_path;
+        }
+        LOG_WARN("can not find %s or %s for lora %s", st_file_path.c_str(), ckpt_file_path.c_str(), lora_name.c_str());
+        return "";
+    }
+
+    // reloads weights from the model files, reading only those weights
+    bool restore_tensors(const std::set<std::string>& names) {
+        int64_t t0            = ggml_time_ms();
+        auto on_new_tensor_cb = [&](const TensorStorage& tensor_storage, ggml_tensor** dst_tensor) -> bool {
+            if (names.find(tensor_storage.name) == names.end()) {
+                return true;
+            }
+            struct ggml_tensor* tensor = tensors[tensor_storage.name];
+            if (tensor->buffer != NULL) {
+                *dst_tensor = tensor;
+            }
+            return true;
+        };
+        if (!model_loader.load_tensors(on_new_tensor_cb, backend, n_threads)) {
+            LOG_ERROR("restore weights from model files failed");
+            return false;
+        }
+
+        if (stacked_id && pmid_lora->applied) {
+            // the photomaker lora is merged once, put it back into the restored weights. With
+            // free_params_immediately its tensors are gone, they are read from its file again.
+            std::shared_ptr<LoraModel> lora = pmid_lora;
+            if (lora->get_params_buffer_size() == 0) {
+                lora = std::make_shared<LoraModel>(backend, model_wtype, pmid_lora->file_path, "");
+                if (!lora->load_from_file(true)) {
+                    LOG_ERROR("reload photomaker lora from %s failed", pmid_lora->file_path.c_str());
+                    return false;
+                }
+            }
+            std::map<std::string, struct ggml_tensor*> restored;
+            for (auto& name : names) {
+                restored[name] = tensors[name];
+            }
+            lora->apply(restored, 1.0f, n_threads, false);
+        }
+
+        int64_t t1 = ggml_time_ms();
+        LOG_INFO("restored %zu weights, taking %.2fs", names.size(), (t1 - t0) * 1.0f / 1000);
+        return true;
+    }
+
+    // merges the lora into the weights, only into the weights in only_tensors if given
+    void apply_lora(const std::string& lora_name, float multiplier, const std::set<std::string>* only_tensors = NULL) {
+        int64_t t0            = ggml_time_ms();
+        std::string file_path = get_lora_file_path(lora_name);
+        if (file_path.empty()) {
             return;
         }
-        LoraModel lora(backend, model_wtype, file_path);
-        if (!lora.load_from_file()) {
+        auto lora = LoraCache::instance().get(backend, model_wtype, file_path);
+        if (lora == NULL) {
             LOG_WARN("load lora tensors from %s failed", file_path.c_str());
             return;
         }
 
-        lora.multiplier = multiplier;
-        lora.apply(tensors, n_threads);
-        lora.free_params_buffer();
+        std::map<std::string, struct ggml_tensor*> lora_tensors;
+        for (auto& name : lora->get_affected_tensors(tensors)) {
+            if (only_tensors == NULL || only_tensors->find(name) != only_tensors->end()) {
+                lora_tensors[name] = tensors[name];
+            }
+        }
+        if (only_tensors == NULL) {
+            auto& merged = merged_lora_tensors[lora_name];
+            for (auto& kv : lora_tensors) {
+                merged.insert(kv.first);
+            }
+        }
+        if (lora_tensors.empty()) {
+            return;
+        }
+
+        lora->apply(lora_tensors, multiplier, n_threads, only_tensors == NULL);
 
         int64_t t1 = ggml_time_ms();
 
         LOG_INFO("lora '%s' applied, taking %.2fs", lora_name.c_str(), (t1 - t0) * 1.0f / 1000);
     }
 
-    void apply_loras(const std::unordered_map<std::string, float>& lora_state) {
-        if (lora_state.size() > 0 && model_wtype != GGML_TYPE_F16 && model_wtype != GGML_TYPE_F32) {
-            LOG_WARN("In quantized models when applying LoRA, the images have poor quality.");
+    // With item_lora_states, every batch item of the following forwards uses its own loras and
+    // multipliers, lora_state then has to hold all the loras used by the batch.
+    void apply_runtime_loras(const std::unordered_map<std::string, float>& lora_state,
+                             const std::vector<std::unordered_map<std::string, float>>& item_lora_states = {}) {
+        if (!runtime_loras.empty() && lora_state == runtime_lora_state && item_lora_states == runtime_item_lora_states) {
+            return;
         }
-        std::unordered_map<std::string, float> lora_state_diff;
+        runtime_lora_state       = lora_state;
+        runtime_item_lora_states = item_lora_states;
+
+        // every lora is bound again below, with its new multiplier
+        RuntimeLoraRegistry::instance().remove(this);
+        for (auto iter = runtime_loras.begin(); iter != runtime_loras.end();) {
+            if (lora_state.find(iter->first) == lora_state.end()) {
+                iter = runtime_loras.erase(iter);
+            } else {
+                iter++;
+            }
+        }
+
+        // the lora tensors have to live on the backend of the weights they are executed with
+        std::vector<ggml_backend_t> lora_backends = {backend};
+        if (clip_backend != NULL && clip_backend != backend) {
+            lora_backends.push_back(clip_backend);
+        }
+
         for (auto& kv : lora_state) {
             const std::string& lora_name = kv.first;
-            float multiplier             = kv.second;
-
-            if (curr_lora_state.find(lora_name) != curr_lora_state.end()) {
-                float curr_multiplier = curr_lora_state[lora_name];
-                float multiplier_diff = multiplier - curr_multiplier;
-                if (multiplier_diff != 0.f) {
-                    lora_state_diff[lora_name] = multiplier_diff;
+            auto& loras                  = runtime_loras[lora_name];
+            if (loras.empty()) {
+                std::string file_path = get_lora_file_path(lora_name);
+                if (file_path.empty()) {
+                    runtime_loras.erase(lora_name);
+                    continue;
                 }
-            } else {
-                lora_state_diff[lora_name] = multiplier;
+                for (auto lora_backend : lora_backends) {
+                    auto lora = LoraCache::instance().get(lora_backend, model_wtype, file_path);
+                    if (lora == NULL) {
+                        LOG_WARN("load lora tensors from %s failed", file_path.c_str());
+                        loras.clear();
+                        break;
+                    }
+                    loras.push_back(lora);
+                }
+                if (loras.empty()) {
+                    runtime_loras.erase(lora_name);
+                    continue;
+                }
+            }
+
+            std::vector<float> item_multipliers;
+            for (auto& item_lora_state : item_lora_states) {
+                auto iter = item_lora_state.find(lora_name);
+                item_multipliers.push_back(iter == item_lora_state.end() ? 0.f : iter->second);
+            }
+
+            int n_bound = 0;
+            for (auto& lora : loras) {
+                n_bound += lora->bind_runtime(this, tensors, kv.second, item_multipliers);
+            }
+            LOG_INFO("lora '%s' bound to %d weights", lora_name.c_str(), n_bound);
+        }
+    }
+
+    void apply_loras(const std::unordered_map<std::string, float>& lora_state) {
+        if (lora_runtime) {
+            apply_runtime_loras(lora_state);
+            curr_lora_state = lora_state;
+            return;
+        }
+        if (lora_state.size() > 0 && model_wtype != GGML_TYPE_F16 && model_wtype != GGML_TYPE_F32) {
+            LOG_WARN("In quantized models when applying LoRA, the images have poor quality.");
+        }
+        // Loras that are removed or get another multiplier are undone exactly, by reloading the weights
+        // they changed from the model files. The loras that stay are merged again into those weights.
+        std::set<std::string> restored_tensors;
+        for (auto& kv : curr_lora_state) {
+            auto iter = lora_state.find(kv.first);
+            if (iter == lora_state.end() || iter->second != kv.second) {
+                auto& merged = merged_lora_tensors[kv.first];
+                restored_tensors.insert(merged.begin(), merged.end());
+                merged_lora_tensors.erase(kv.first);
             }
         }
+        if (restored_tensors.size() > 0) {
+            restore_tensors(restored_tensors);
+        }
 
         LOG_INFO("Attempting to apply %lu LoRAs", lora_state.size());
 
-        for (auto& kv : lora_state_diff) {
-            apply_lora(kv.first, kv.second);
+        for (auto& kv : lora_state) {
+            auto iter = curr_lora_state.find(kv.first);
+            if (iter == curr_lora_state.end() || iter->second != kv.second) {
+                apply_lora(kv.first, kv.second);
+            } else if (restored_tensors.size() > 0) {
+                apply_lora(kv.first, kv.second, &restored_tensors);
+            }
         }
 
         curr_lora_state = lora_state;
     }
 
+    std::string get_condition_cache_key(const std::string& text,
+                                        int clip_skip,
+                                        int width,
+                                        int height,
+                                        bool force_zero_embeddings,
+                                        const std::unordered_map<std::string, float>& lora_state) {
+        std::string key = format("%s|%d|%d|%d", cond_model_id.c_str(), clip_skip, (int)force_zero_embeddings, (int)lora_runtime);
+        key += cond_stage_model->get_embeddings_key(text);
+        if (version == VERSION_SDXL) {
+            // size conditioning
+            key += format("|%dx%d", width, height);
+        }
+        if (stacked_id) {
+            key += "|pmid";
+        }
+        std::map<std::string, float> sorted_lora_state(lora_state.begin(), lora_state.end());
+        for (auto& kv : sorted_lora_state) {
+            std::string file_path = get_lora_file_path(kv.first);
+            key += format("|%s:%g:%s:%" PRId64, kv.first.c_str(), kv.second, file_path.c_str(), get_file_mtime(file_path));
+        }
+        return key + "|" + ConditionCache::normalize_prompt(text);
+    }
+
+    // get_learned_conditions of the cond_stage_model, with the loras of lora_state applied to it,
+    // only the texts missing from the condition cache are encoded
+    std::vector<SDCondition> get_learned_conditions(ggml_context* work_ctx,
+                                                    const std::vector<std::string>& texts,
+                                                    int clip_skip,
+                                                    int width,
+                                                    int height,
+                                                    const std::vector<bool>& force_zero_embeddings,
+                                                    const std::unordered_map<std::string, float>& lora_state) {
+        std::vector<SDCondition> conds(texts.size());
+        std::vector<std::string> keys;
+        std::vector<size_t> missing;
+        std::vector<std::string> missing_texts;
+        std::vector<bool> missing_force_zero_embeddings;
+        for (size_t i = 0; i < texts.size(); i++) {
+            keys.push_back(get_condition_cache_key(texts[i], clip_skip, width, height, force_zero_embeddings[i], lora_state));
+            if (!ConditionCache::instance().get(keys[i], work_ctx, conds[i])) {
+                missing.push_back(i);
+                missing_texts.push_back(texts[i]);
+                missing_force_zero_embeddings.push_back(force_zero_embeddings[i]);
+            }
+        }
+        LOG_DEBUG("condition cache: %d of %d prompts cached", (int)(texts.size() - missing.size()), (int)texts.size());
+        if (missing.empty()) {
+            return conds;
+        }
+
+        auto missing_conds = cond_stage_model->get_learned_conditions(work_ctx,
+                                                                      n_threads,
+                                                                      missing_texts,
+                                                                      clip_skip,
+                                                                      width,
+                                                                      height,
+                                                                      diffusion_model->get_adm_in_channels(),
+                                                                      missing_force_zero_embeddings);
+        for (size_t i = 0; i < missing.size(); i++) {
+            conds[missing[i]] = missing_conds[i];
+            ConditionCache::instance().put(keys[missing[i]], missing_conds[i]);
+        }
+        return conds;
+    }
+
     ggml_tensor* id_encoder(ggml_context* work_ctx,
                             ggml_tensor* init_img,
                             ggml_tensor* prompts_embeds,
@@ -730,8 +1046,7 @@ public:
                     ggml_tensor_scale(noise, augmentation_level);
                     ggml_tensor_add(init_img, noise);
                 }
-                ggml_tensor* moments = encode_first_stage(work_ctx, init_img);
-                c_concat             = get_first_stage_encoding(work_ctx, moments);
+                c_concat = encode_to_latent(work_ctx, init_img);
             }
         }
 
@@ -762,7 +1077,9 @@ public:
                         sample_method_t method,
                         const std::vector<float>& sigmas,
                         int start_merge_step,
-                        SDCondition id_cond) {
+                        SDCondition id_cond,
+                        int threads,
+                        bool vae_busy) {
         size_t steps = sigmas.size() - 1;
         // noise = load_tensor_from_file(work_ctx, "./rand0.bin");
         // print_ggml_tensor(noise);
@@ -781,6 +1098,7 @@ public:
             out_uncond = ggml_dup_tensor(work_ctx, x);
         }
         struct ggml_tensor* denoised = ggml_dup_tensor(work_ctx, x);
+        int last_preview_step        = 0;  // second order samplers denoise twice per step
 
         auto denoise = [&](ggml_tensor* input, float sigma, int step) -> ggml_tensor* {
             if (step == 1) {
@@ -807,7 +1125,7 @@ public:
             std::vector<struct ggml_tensor*> controls;
 
             if (control_hint != NULL) {
-                control_net->compute(n_threads, noised_input, control_hint, timesteps, cond.c_crossattn, cond.c_vector);
+                control_net->compute(threads, noised_input, control_hint, timesteps, cond.c_crossattn, cond.c_vector);
                 controls = control_net->controls;
                 // print_ggml_tensor(controls[12]);
                 // GGML_ASSERT(0);
@@ -815,7 +1133,7 @@ public:
 
             if (start_merge_step == -1 || step <= start_merge_step) {
                 // cond
-                diffusion_model->compute(n_threads,
+                diffusion_model->compute(threads,
                                          noised_input,
                                          timesteps,
                                          cond.c_crossattn,
@@ -827,7 +1145,7 @@ public:
                                          control_strength,
                                          &out_cond);
             } else {
-                diffusion_model->compute(n_threads,
+                diffusion_model->compute(threads,
                                          noised_input,
                                          timesteps,
                                          id_cond.c_crossattn,
@@ -844,10 +1162,10 @@ public:
             if (has_unconditioned) {
                 // uncond
                 if (control_hint != NULL) {
-                    control_net->compute(n_threads, noised_input, control_hint, timesteps, uncond.c_crossattn, uncond.c_vector);
+                    control_net->compute(threads, noised_input, control_hint, timesteps, uncond.c_crossattn, uncond.c_vector);
                     controls = control_net->controls;
                 }
-                diffusion_model->compute(n_threads,
+                diffusion_model->compute(threads,
                                          noised_input,
                                          timesteps,
                                          uncond.c_crossattn,
@@ -885,6 +1203,11 @@ public:
                 pretty_progress(step, (int)steps, (t1 - t0) / 1000000.f);
                 // LOG_INFO("step %d sampling completed taking %.2fs", step, (t1 - t0) * 1.0f / 1000000);
             }
+            if (step > last_preview_step && sd_get_preview_mode() != PREVIEW_NONE &&
+                (step % sd_get_preview_interval() == 0 || step == (int)steps)) {
+                preview_latents(denoised, step, (int)steps, threads, vae_busy);
+                last_preview_step = step;
+            }
             return denoised;
         };
 
@@ -900,6 +1223,73 @@ public:
         return x;
     }
 
+    // Hands rgb previews of the latents [N, C, h, w] to the preview callback, decoded with taesd
+    // or projected linearly at latent resolution. vae_busy: the vae decodes the previous image
+    // on another thread, which leaves the taesd of use_tiny_autoencoder to it.
+    void preview_latents(ggml_tensor* latents, int step, int steps, int threads, bool vae_busy) {
+        preview_t mode = sd_get_preview_mode();
+        if (mode == PREVIEW_TAE && (preview_tae == NULL || (preview_tae == tae_first_stage && vae_busy))) {
+            mode = PREVIEW_LINEAR;
+        }
+        int64_t w = latents->ne[0];
+        int64_t h = latents->ne[1];
+        int64_t C = latents->ne[2];
+        int n     = (int)latents->ne[3];
+
+        std::vector<sd_image_t> images(n);
+        if (mode == PREVIEW_TAE) {
+            struct ggml_init_params params;
+            params.mem_size = w * 8 * h * 8 * 3 * n * sizeof(float);  // decoded images
+            params.mem_size += 2 * ggml_tensor_overhead();
+            params.mem_buffer = NULL;
+            params.no_alloc   = false;
+
+            struct ggml_context* preview_ctx = ggml_init(params);
+            if (preview_ctx == NULL) {
+                LOG_ERROR("ggml_init() failed");
+                return;
+            }
+            ggml_tensor* decoded = NULL;
+            preview_tae->compute(threads, latents, true, &decoded, preview_ctx);
+            for (int i = 0; i < n; i++) {
+                images[i] = {(uint32_t)w * 8, (uint32_t)h * 8, 3, sd_tensor_to_mul_image(decoded, i)};
+            }
+            ggml_free(preview_ctx);
+        } else {
+            const float(*factors)[3] = sd_latent_rgb_factors;
+            const float* bias        = NULL;
+            if (version == VERSION_SDXL) {
+                factors = sdxl_latent_rgb_factors;
+                bias    = sdxl_latent_rgb_bias;
+            } else if (version == VERSION_SD3_2B) {
+                factors = sd3_latent_rgb_factors;
+            } else if (version == VERSION_FLUX_DEV || version == VERSION_FLUX_SCHNELL) {
+                factors = flux_latent_rgb_factors;
+                bias    = flux_latent_rgb_bias;
+            }
+            for (int i = 0; i < n; i++) {
+                uint8_t* data = (uint8_t*)malloc(w * h * 3);
+                for (int64_t iy = 0; iy < h; iy++) {
+                    for (int64_t ix = 0; ix < w; ix++) {
+                        for (int k = 0; k < 3; k++) {
+                            float value = bias != NULL ? bias[k] : 0.f;
+                            for (int c = 0; c < C; c++) {
+                                value += ggml_tensor_get_f32(latents, (int)ix, (int)iy, c, i) * factors[c][k];
+                            }
+                            value                       = std::min(std::max((value + 1.f) * 0.5f, 0.f), 1.f);
+                            data[(iy * w + ix) * 3 + k] = (uint8_t)(value * 255.0f);
+                        }
+                    }
+                }
+                images[i] = {(uint32_t)w, (uint32_t)h, 3, data};
+            }
+        }
+        sd_preview(step, steps, images.data(), n);
+        for (auto& image : images) {
+            free(image.data);
+        }
+    }
+
     // ldm.models.diffusion.ddpm.LatentDiffusion.get_first_stage_encoding
     ggml_tensor* get_first_stage_encoding(ggml_context* work_ctx, ggml_tensor* moments) {
         // ldm.modules.distributions.distributions.DiagonalGaussianDistribution.sample
@@ -932,7 +1322,7 @@ public:
         return latent;
     }
 
-    ggml_tensor* compute_first_stage(ggml_context* work_ctx, ggml_tensor* x, bool decode) {
+    ggml_tensor* compute_first_stage(ggml_context* work_ctx, ggml_tensor* x, bool decode, int threads) {
         int64_t W = x->ne[0];
         int64_t H = x->ne[1];
         int64_t C = 8;
@@ -952,56 +1342,481 @@ public:
                                                  x->ne[3]);  // channels
         int64_t t0          = ggml_time_ms();
         if (!use_tiny_autoencoder) {
+            // the graphs scale the input and the output, x is left untouched
+            bool tiled     = decode && tiled_decode(x, threads);
+            auto kl_decode = [&](ggml_tensor* output) {
+                if (tiled) {
+                    // split latent in tiles (32x32 unless tuned) and compute in several steps
+                    int overlap    = 0;
+                    int tile_size  = decode_tile_size(x, threads, &overlap);
+                    auto on_tiling = [&](ggml_tensor* in, ggml_tensor* out, bool init) {
+                        first_stage_model->compute(threads, in, true, &out);
+                    };
+                    sd_tiling(x, output, 8, tile_size, overlap, on_tiling);
+                } else {
+                    first_stage_model->compute(threads, x, true, &output);
+                }
+            };
             if (decode) {
-                ggml_tensor_scale(x, 1.0f / scale_factor);
-            } else {
-                ggml_tensor_scale_input(x);
-            }
-            if (vae_tiling && decode) {  // TODO: support tiling vae encode
-                // split latent in 32x32 tiles and compute in several steps
+                if (tiled && !vae_tiling) {
+                    LOG_INFO("decoding in tiles, the vae decode budget is too small for %dx%d", (int)W * 8, (int)H * 8);
+                }
+                // the validation counts the non finite values, which the clamp would hide
+                bool validate                   = vae_validate && first_stage_model->decoder_activation_type != GGML_TYPE_F32;
+                first_stage_model->clamp_output = !validate;
+                kl_decode(result);
+                if (validate) {
+                    validate_decode(result, kl_decode);
+                }
+                first_stage_model->clamp_output = true;
+            } else if (tiled_encode(x)) {
+                // Split image in 256x256 tiles that overlap by 64 pixels, the GroupNorm layers of
+                // every tile normalize with the statistics of that tile. With sd_vae_tiling_exact
+                // they use those of the whole image instead: passes over the tiles gather them one
+                // layer at a time, each pass only runs the encoder up to its layer, and every tile
+                // counts for the pixels nearer to its center than to the others.
+                auto stats = first_stage_model->group_norm_stats;
+                stats->reset();
+                if (sd_vae_tiling_exact) {
+                    auto regions  = sd_tile_owned_regions((int)W, (int)H, 256, 64);
+                    size_t tile   = 0;
+                    auto on_stats = [&](ggml_tensor* in, ggml_tensor* out, bool init) {
+                        if (!init) {
+                            stats->regions.assign(regions.begin() + tile * 4, regions.begin() + (tile + in->ne[3]) * 4);
+                            first_stage_model->record_group_norm_stats(threads, in);
+                            tile += in->ne[3];
+                        }
+                    };
+                    for (int layer = 0; layer == 0 || layer < stats->num_layers; layer++) {
+                        LOG_DEBUG("gathering the statistics of GroupNorm layer %d", layer);
+                        stats->record(layer);
+                        tile = 0;
+                        sd_tiling(x, NULL, 1.f / 8, 256, 64, on_stats);
+                        stats->finalize();
+                    }
+                    stats->mode = GroupNormStats::APPLY;
+                }
+                ggml_set_f32(result, 0.f);  // tiles are blended into it
+
                 auto on_tiling = [&](ggml_tensor* in, ggml_tensor* out, bool init) {
-                    first_stage_model->compute(n_threads, in, decode, &out);
+                    if (!init) {
+                        first_stage_model->compute(threads, in, decode, &out);
+                    }
                 };
-                sd_tiling(x, result, 8, 32, 0.5f, on_tiling);
+                sd_tiling(x, result, 1.f / 8, 256, 64, on_tiling);
+                stats->reset();
             } else {
-                first_stage_model->compute(n_threads, x, decode, &result);
+                first_stage_model->compute(threads, x, false, &result);
             }
             first_stage_model->free_compute_buffer();
-            if (decode) {
-                ggml_tensor_scale_output(result);
-            }
         } else {
-            if (vae_tiling && decode) {  // TODO: support tiling vae encode
-                // split latent in 64x64 tiles and compute in several steps
+            if (decode && tiled_decode(x, threads)) {
+                if (!vae_tiling) {
+                    LOG_INFO("decoding in tiles, the vae decode budget is too small for %dx%d", (int)W * 8, (int)H * 8);
+                }
+                // split latent in tiles (64x64 unless tuned) and compute in several steps
+                int overlap    = 0;
+                int tile_size  = decode_tile_size(x, threads, &overlap);
                 auto on_tiling = [&](ggml_tensor* in, ggml_tensor* out, bool init) {
-                    tae_first_stage->compute(n_threads, in, decode, &out);
+                    tae_first_stage->compute(threads, in, decode, &out);
+                };
+                sd_tiling(x, result, 8, tile_size, overlap, on_tiling);
+            } else if (!decode && vae_tiling && W > 512 && H > 512) {
+                // split image in 512x512 tiles, the tiny encoder has no normalization layers
+                auto on_tiling = [&](ggml_tensor* in, ggml_tensor* out, bool init) {
+                    if (!init) {
+                        tae_first_stage->compute(threads, in, decode, &out);
+                    }
                 };
-                sd_tiling(x, result, 8, 64, 0.5f, on_tiling);
+                ggml_set_f32(result, 0.f);  // tiles are blended into it
+                sd_tiling(x, result, 1.f / 8, 512, 256, on_tiling);
             } else {
-                tae_first_stage->compute(n_threads, x, decode, &result);
+                tae_first_stage->compute(threads, x, decode, &result);
             }
             tae_first_stage->free_compute_buffer();
         }
 
         int64_t t1 = ggml_time_ms();
         LOG_DEBUG("computing vae [mode: %s] graph completed, taking %.2fs", decode ? "DECODE" : "ENCODE", (t1 - t0) * 1.0f / 1000);
-        if (decode) {
-            ggml_tensor_clamp(result, 0.0f, 1.0f);
-        }
         return result;
     }
 
+    // Decodes again with f32 activations into a reference and logs how far the reduced
+    // precision decode is from it, in 8-bit pixel values. Both decodes come unclamped, they
+    // are clamped here once the non finite values of the reduced precision one are counted.
+    void validate_decode(ggml_tensor* decoded, std::function<void(ggml_tensor*)> decode) {
+        struct ggml_init_params params;
+        params.mem_size   = ggml_nbytes(decoded) + ggml_tensor_overhead();
+        params.mem_buffer = NULL;
+        params.no_alloc   = false;
+
+        struct ggml_context* ref_ctx = ggml_init(params);
+        if (ref_ctx == NULL) {
+            LOG_ERROR("ggml_init() failed");
+            return;
+        }
+        ggml_tensor* reference = ggml_dup_tensor(ref_ctx, decoded);
+        ggml_type type         = first_stage_model->decoder_activation_type;
+
+        first_stage_model->decoder_activation_type = GGML_TYPE_F32;
+        decode(reference);
+        first_stage_model->decoder_activation_type = type;
+
+        auto clamp = [](float value) {
+            return std::isnan(value) ? 0.f : std::min(std::max(value, 0.f), 1.f);
+        };
+        float* a           = (float*)decoded->data;
+        float* b           = (float*)reference->data;
+        int64_t n          = ggml_nelements(decoded);
+        int64_t non_finite = 0;
+        float max_error    = 0.f;
+        double sum_error   = 0.0;
+        for (int64_t i = 0; i < n; i++) {
+            bool finite = std::isfinite(a[i]);
+            a[i]        = clamp(a[i]);
+            b[i]        = clamp(b[i]);
+            if (!finite) {
+                non_finite++;
+                continue;
+            }
+            float error = std::fabs(a[i] - b[i]);
+            max_error   = std::max(max_error, error);
+            sum_error += error;
+        }
+        LOG_INFO("vae %s decode against f32: max pixel error %.2f, mean %.3f, %" PRId64 " non finite values",
+                 ggml_type_name(type), max_error * 255.f, sum_error / n * 255.f, non_finite);
+        ggml_free(ref_ctx);
+    }
+
+    int get_latent_channels() {
+        if (version == VERSION_SD3_2B || version == VERSION_FLUX_DEV || version == VERSION_FLUX_SCHNELL) {
+            return 16;
+        }
+        return 4;
+    }
+
+    // value of the latent txt2img starts from
+    float get_empty_latent_value() {
+        if (version == VERSION_SD3_2B) {
+            return 0.0609f;
+        } else if (version == VERSION_FLUX_DEV || version == VERSION_FLUX_SCHNELL) {
+            return 0.1159f;
+        }
+        return 0.f;
+    }
+
+    // compute buffer of an untiled decode of a size x size latent with the channels of x
+    size_t probe_decode_buffer(ggml_tensor* x, int size, int threads) {
+        GGMLRunner* vae = use_tiny_autoencoder ? (GGMLRunner*)tae_first_stage.get() : (GGMLRunner*)first_stage_model.get();
+
+        struct ggml_init_params params;
+        params.mem_size = (size * size * x->ne[2] + size * 8 * size * 8 * 3) * sizeof(float);
+        params.mem_size += 2 * ggml_tensor_overhead();
+        params.mem_buffer = NULL;
+        params.no_alloc   = false;
+
+        struct ggml_context* probe_ctx = ggml_init(params);
+        if (probe_ctx == NULL) {
+            return 0;
+        }
+        ggml_tensor* in  = ggml_new_tensor_4d(probe_ctx, GGML_TYPE_F32, size, size, x->ne[2], 1);
+        ggml_tensor* out = ggml_new_tensor_4d(probe_ctx, GGML_TYPE_F32, size * 8, size * 8, 3, 1);
+        ggml_set_f32(in, 0.f);
+        if (use_tiny_autoencoder) {
+            tae_first_stage->compute(threads, in, true, &out);
+        } else {
+            first_stage_model->compute(threads, in, true, &out);
+        }
+        vae->free_compute_buffer();
+        ggml_free(probe_ctx);
+        return vae->get_compute_buffer_size();
+    }
+
+    // Compute buffer an untiled decode of x would take, extrapolated from decodes of 16x16 and
+    // 32x32 latents: the convolutions grow with the latent pixels, the attention of the KL
+    // decoder with their square.
+    double decode_buffer_estimate(ggml_tensor* x, int threads) {
+        if (decode_buffer_linear == 0 && decode_buffer_quadratic == 0) {
+            double n1 = 16 * 16;
+            double n2 = 32 * 32;
+            double b1 = (double)probe_decode_buffer(x, 16, threads);
+            double b2 = (double)probe_decode_buffer(x, 32, threads);
+
+            decode_buffer_quadratic = std::max(0.0, (b2 / n2 - b1 / n1) / (n2 - n1));
+            decode_buffer_linear    = std::max(0.0, b1 / n1 - decode_buffer_quadratic * n1);
+        }
+        double n = (double)x->ne[0] * x->ne[1];
+        return (decode_buffer_linear * n + decode_buffer_quadratic * n * n) * x->ne[3];
+    }
+
+    // Tile size of a tiled decode of x, 32 latent pixels (64 for the tiny autoencoder) unless
+    // sd_get_tile_memory_budget() lets it be tuned. overlap gets the latent pixels shared by
+    // neighbouring tiles, half of the default tile size whatever the tuned one.
+    int decode_tile_size(ggml_tensor* x, int threads, int* overlap = NULL) {
+        int default_size = use_tiny_autoencoder ? 64 : 32;
+        int max_size     = (int)std::min(x->ne[0], x->ne[1]);
+        GGMLRunner* vae  = use_tiny_autoencoder ? (GGMLRunner*)tae_first_stage.get() : (GGMLRunner*)first_stage_model.get();
+        std::string key  = format("%s decode (%zu bytes of weights, %s, %d threads)",
+                                  vae->get_desc().c_str(), vae->get_params_buffer_size(), ggml_backend_name(vae->get_backend()), threads);
+
+        auto probe = [&](int size) -> size_t {
+            return probe_decode_buffer(x, size, threads);
+        };
+        int overlap_size = default_size / 2;
+        if (overlap != NULL) {
+            *overlap = overlap_size;
+        }
+        return sd_tune_tile_size(key, default_size, max_size, overlap_size, probe);
+    }
+
+    // Latents decoded in several tiles, see compute_first_stage: with vae_tiling, or when an
+    // untiled decode would take more than sd_vae_decode_budget.
+    bool tiled_decode(ggml_tensor* x, int threads) {
+        if (!vae_tiling && sd_vae_decode_budget == 0) {
+            return false;
+        }
+        int tile_size = decode_tile_size(x, threads);
+        if (x->ne[0] <= tile_size && x->ne[1] <= tile_size) {
+            return false;
+        }
+        return vae_tiling || decode_buffer_estimate(x, threads) > sd_vae_decode_budget;
+    }
+
+    // the KL encoder is tiled on large images, see compute_first_stage
+    bool tiled_encode(ggml_tensor* x) {
+        return vae_tiling && x->ne[0] > 256 && x->ne[1] > 256;
+    }
+
     ggml_tensor* encode_first_stage(ggml_context* work_ctx, ggml_tensor* x) {
-        return compute_first_stage(work_ctx, x, false);
+        return compute_first_stage(work_ctx, x, false, n_threads);
+    }
+
+    // Encodes x to the latent the diffusion model starts from. The posterior of the KL
+    // autoencoder is sampled in the encode graph, except when tiled: the tiles are blended
+    // as moments, which are sampled by get_first_stage_encoding.
+    ggml_tensor* encode_to_latent(ggml_context* work_ctx, ggml_tensor* x) {
+        if (use_tiny_autoencoder) {
+            return encode_first_stage(work_ctx, x);
+        }
+        if (tiled_encode(x)) {
+            return get_first_stage_encoding(work_ctx, encode_first_stage(work_ctx, x));
+        }
+        ggml_tensor* latent = ggml_new_tensor_4d(work_ctx, GGML_TYPE_F32, x->ne[0] / 8, x->ne[1] / 8, get_latent_channels(), x->ne[3]);
+        ggml_tensor* noise  = ggml_dup_tensor(work_ctx, latent);
+        ggml_tensor_set_f32_randn(noise, rng);
+
+        int64_t t0 = ggml_time_ms();
+        first_stage_model->compute(n_threads, x, false, &latent, NULL, noise);
+        first_stage_model->free_compute_buffer();
+        int64_t t1 = ggml_time_ms();
+        LOG_DEBUG("computing vae [mode: ENCODE] graph completed, taking %.2fs", (t1 - t0) * 1.0f / 1000);
+        return latent;
     }
 
-    ggml_tensor* decode_first_stage(ggml_context* work_ctx, ggml_tensor* x) {
-        return compute_first_stage(work_ctx, x, true);
+    ggml_tensor* decode_first_stage(ggml_context* work_ctx, ggml_tensor* x, int threads) {
+        return compute_first_stage(work_ctx, x, true, threads);
+    }
+
+    // Decodes x in bands of VAE_DECODE_BAND_ROWS latent rows that overlap by a quarter and
+    // returns the 8-bit image. Rows are handed to on_rows as soon as the next band can no
+    // longer change them, so only one band is kept in F32.
+    uint8_t* decode_first_stage_rows(ggml_tensor* x, std::function<void(int64_t, int64_t, const uint8_t*)> on_rows, int threads) {
+        int64_t w       = x->ne[0];
+        int64_t h       = x->ne[1];
+        int64_t C       = x->ne[2];
+        int64_t W       = w * 8;
+        int64_t band    = std::min<int64_t>(VAE_DECODE_BAND_ROWS, h);
+        int64_t overlap = band < h ? band / 4 : 0;
+
+        uint8_t* image = (uint8_t*)malloc(W * h * 8 * 3);
+        if (image == NULL) {
+            LOG_ERROR("failed to allocate the decoded image");
+            return NULL;
+        }
+
+        struct ggml_init_params params;
+        params.mem_size = (w * band * C + W * band * 8 * 3) * sizeof(float);
+        params.mem_size += 4 * ggml_tensor_overhead();
+        params.mem_buffer = NULL;
+        params.no_alloc   = false;
+
+        // rows [y_done, y_pending) of the previous band, waiting to be blended with this one
+        std::vector<float> pending;
+        int64_t y_done    = 0;
+        int64_t y_pending = 0;
+        bool last         = false;
+        for (int64_t y = 0; !last; y += band - overlap) {
+            if (y + band >= h) {
+                y    = h - band;
+                last = true;
+            }
+            struct ggml_context* band_ctx = ggml_init(params);
+            if (band_ctx == NULL) {
+                LOG_ERROR("ggml_init() failed");
+                free(image);
+                return NULL;
+            }
+            ggml_tensor* latent = ggml_new_tensor_4d(band_ctx, GGML_TYPE_F32, w, band, C, 1);
+            ggml_split_tensor_2d(x, latent, 0, (int)y);
+            ggml_tensor* img = compute_first_stage(band_ctx, latent, true, threads);  // [3, band * 8, W]
+
+            int64_t y0     = y * 8;
+            int64_t y1     = y0 + band * 8;
+            int64_t y_keep = last ? y1 : y1 - overlap * 8;  // the rows below go to the next band
+            std::vector<float> next_pending((y1 - y_keep) * W * 3);
+            for (int64_t iy = y_done; iy < y1; iy++) {
+                float t = 1.f;
+                if (iy < y_pending) {
+                    t = ggml_smootherstep_f32((iy - y_done + 0.5f) / (y_pending - y_done));
+                }
+                for (int64_t ix = 0; ix < W; ix++) {
+                    for (int k = 0; k < 3; k++) {
+                        float value = ggml_tensor_get_f32(img, (int)ix, (int)(iy - y0), k);
+                        if (iy < y_pending) {
+                            value = pending[((iy - y_done) * W + ix) * 3 + k] * (1.f - t) + value * t;
+                        }
+                        if (iy < y_keep) {
+                            image[(iy * W + ix) * 3 + k] = (uint8_t)(value * 255.0f);
+                        } else {
+                            next_pending[((iy - y_keep) * W + ix) * 3 + k] = value;
+                        }
+                    }
+                }
+            }
+            ggml_free(band_ctx);
+
+            if (on_rows) {
+                on_rows(y_done, y_keep - y_done, image + y_done * W * 3);
+            }
+            pending.swap(next_pending);
+            y_done    = y_keep;
+            y_pending = y1;
+        }
+        return image;
     }
 };
 
 /*================================================= SD API ==================================================*/
 
+static sd_image_rows_cb_t sd_image_rows_cb = NULL;
+static void* sd_image_rows_cb_data         = NULL;
+
+// decodes a latent to an 8-bit image, band by band when its rows are streamed to the caller
+static uint8_t* decode_to_image(StableDiffusionGGML* sd, ggml_context* work_ctx, ggml_tensor* latent, int index, int threads) {
+    if (sd_image_rows_cb != NULL) {
+        uint32_t width  = (uint32_t)latent->ne[0] * 8;
+        uint32_t height = (uint32_t)latent->ne[1] * 8;
+        auto on_rows    = [&](int64_t y, int64_t n_rows, const uint8_t* rows) {
+            std::lock_guard<std::recursive_mutex> lock(sd_callback_mutex());
+            sd_image_rows_cb(index, width, height, (uint32_t)y, (uint32_t)n_rows, rows, sd_image_rows_cb_data);
+        };
+        return sd->decode_first_stage_rows(latent, on_rows, threads);
+    }
+    ggml_tensor* img = sd->decode_first_stage(work_ctx, latent, threads);
+    return img != NULL ? sd_tensor_to_image(img) : NULL;
+}
+
+// decode_to_image with a context of its own, so that it can run next to the sampler
+static uint8_t* decode_to_image_detached(StableDiffusionGGML* sd, ggml_tensor* latent, int index, int threads) {
+    struct ggml_init_params params;
+    params.mem_size = latent->ne[0] * 8 * latent->ne[1] * 8 * 3 * sizeof(float);  // decoded image
+    params.mem_size += 2 * ggml_tensor_overhead();
+    params.mem_buffer = NULL;
+    params.no_alloc   = false;
+
+    struct ggml_context* decode_ctx = ggml_init(params);
+    if (decode_ctx == NULL) {
+        LOG_ERROR("ggml_init() failed");
+        return NULL;
+    }
+    uint8_t* data = decode_to_image(sd, decode_ctx, latent, index, threads);
+    ggml_free(decode_ctx);
+    return data;
+}
+
+// decodes the n latents latents[items[0..n)], which have the same size, in one graph
+static void decode_batch_to_images(StableDiffusionGGML* sd,
+                                   const std::vector<ggml_tensor*>& latents,
+                                   const int* items,
+                                   size_t n,
+                                   std::vector<uint8_t*>& images) {
+    ggml_tensor* first  = latents[items[0]];
+    size_t latent_size  = ggml_nbytes(first);
+    size_t decoded_size = first->ne[0] * 8 * first->ne[1] * 8 * 3 * sizeof(float);
+
+    struct ggml_init_params params;
+    params.mem_size = (latent_size + decoded_size) * n;
+    params.mem_size += 2 * ggml_tensor_overhead();
+    params.mem_buffer = NULL;
+    params.no_alloc   = false;
+
+    struct ggml_context* batch_ctx = ggml_init(params);
+    if (batch_ctx == NULL) {
+        LOG_ERROR("ggml_init() failed");
+        return;
+    }
+    ggml_tensor* stacked = ggml_new_tensor_4d(batch_ctx, GGML_TYPE_F32, first->ne[0], first->ne[1], first->ne[2], n);
+    for (size_t k = 0; k < n; k++) {
+        memcpy((char*)stacked->data + k * latent_size, latents[items[k]]->data, latent_size);
+    }
+    ggml_tensor* decoded = sd->decode_first_stage(batch_ctx, stacked, sd->n_threads);
+    for (size_t k = 0; k < n; k++) {
+        images[items[k]] = sd_tensor_to_mul_image(decoded, (int)k);
+    }
+    ggml_free(batch_ctx);
+}
+
+// Decodes the latents whose image is still NULL. The first one is decoded alone, the compute
+// buffer it took tells how many of the others fit in sd_vae_decode_budget; they are stacked
+// and go through the vae together. Streamed rows and tiled decodes stay one latent at a time.
+// All latents have the same size.
+static void decode_to_images(StableDiffusionGGML* sd,
+                             ggml_context* work_ctx,
+                             const std::vector<ggml_tensor*>& latents,
+                             std::vector<uint8_t*>& images) {
+    std::vector<int> pending;
+    for (size_t i = 0; i < latents.size(); i++) {
+        if (images[i] == NULL) {
+            pending.push_back((int)i);
+        }
+    }
+    if (pending.empty()) {
+        return;
+    }
+    GGMLRunner* vae = sd->use_tiny_autoencoder ? (GGMLRunner*)sd->tae_first_stage.get() : (GGMLRunner*)sd->first_stage_model.get();
+    bool batched    = sd_vae_decode_budget > 0 && pending.size() > 1 && sd_image_rows_cb == NULL && !sd->tiled_decode(latents[pending[0]], sd->n_threads);
+
+    size_t batch = 1;
+    for (size_t next = 0; next < pending.size();) {
+        size_t n   = std::min(batch, pending.size() - next);
+        int64_t t0 = ggml_time_ms();
+        if (n == 1) {
+            int i     = pending[next];
+            images[i] = decode_to_image(sd, work_ctx, latents[i], i, sd->n_threads);
+        } else {
+            decode_batch_to_images(sd, latents, pending.data() + next, n, images);
+        }
+        int64_t t1 = ggml_time_ms();
+        if (n == 1) {
+            LOG_INFO("latent %d decoded, taking %.2fs", pending[next] + 1, (t1 - t0) * 1.0f / 1000);
+        } else {
+            LOG_INFO("latents %d-%d decoded, taking %.2fs", pending[next] + 1, pending[next + n - 1] + 1, (t1 - t0) * 1.0f / 1000);
+        }
+        next += n;
+
+        if (batched && next == 1) {
+            size_t image_size = vae->get_compute_buffer_size();
+            if (image_size > 0) {
+                batch = std::max<size_t>(1, (size_t)(sd_vae_decode_budget / image_size));
+            }
+            if (batch > 1) {
+                LOG_INFO("decoding up to %zu latents at once, %.2f MB of compute buffer each",
+                         batch, image_size / 1024.0 / 1024.0);
+            }
+        }
+    }
+}
+
 struct sd_ctx_t {
     StableDiffusionGGML* sd = NULL;
 };
@@ -1025,7 +1840,13 @@ sd_ctx_t* new_sd_ctx(const char* model_path_c_str,
                      enum schedule_t s,
                      bool keep_clip_on_cpu,
                      bool keep_control_net_cpu,
-                     bool keep_vae_on_cpu) {
+                     bool keep_vae_on_cpu,
+                     bool lora_runtime,
+                     bool t5_mask_padding,
+                     int decode_threads,
+                     bool vae_f16,
+                     bool vae_validate,
+                     const char* preview_taesd_path_c_str) {
     sd_ctx_t* sd_ctx = (sd_ctx_t*)malloc(sizeof(sd_ctx_t));
     if (sd_ctx == NULL) {
         return NULL;
@@ -1049,6 +1870,12 @@ sd_ctx_t* new_sd_ctx(const char* model_path_c_str,
     if (sd_ctx->sd == NULL) {
         return NULL;
     }
+    sd_ctx->sd->lora_runtime       = lora_runtime;
+    sd_ctx->sd->t5_mask_padding    = t5_mask_padding;
+    sd_ctx->sd->decode_threads     = std::max(0, std::min(decode_threads, n_threads - 1));
+    sd_ctx->sd->vae_f16            = vae_f16;
+    sd_ctx->sd->vae_validate       = vae_validate;
+    sd_ctx->sd->preview_taesd_path = preview_taesd_path_c_str;
 
     if (!sd_ctx->sd->load_from_file(model_path,
                                     clip_l_path,
@@ -1081,6 +1908,109 @@ void free_sd_ctx(sd_ctx_t* sd_ctx) {
     free(sd_ctx);
 }
 
+void sd_set_image_rows_callback(sd_image_rows_cb_t cb, void* data) {
+    sd_image_rows_cb      = cb;
+    sd_image_rows_cb_data = data;
+}
+
+void sd_set_vae_decode_budget(uint64_t size) {
+    sd_vae_decode_budget = size;
+}
+
+void sd_set_vae_tiling_exact(bool exact) {
+    sd_vae_tiling_exact = exact;
+}
+
+void sd_set_lora_cache_size(uint64_t size) {
+    LoraCache::instance().set_max_size((size_t)size);
+}
+
+void sd_set_condition_cache_size(uint64_t size) {
+    ConditionCache::instance().set_max_size((size_t)size);
+}
+
+void sd_set_condition_cache_dir(const char* dir) {
+    ConditionCache::instance().set_dir(dir != NULL ? dir : "");
+}
+
+// work_ctx memory of one generated image: its conditions, latents and decoded image
+static size_t get_work_ctx_size(StableDiffusionGGML* sd, int width, int height) {
+    size_t mem_size = static_cast<size_t>(10 * 1024 * 1024);  // 10 MB
+    if (sd->version == VERSION_SD3_2B) {
+        mem_size *= 3;
+    }
+    if (sd->version == VERSION_FLUX_DEV || sd->version == VERSION_FLUX_SCHNELL) {
+        mem_size *= 4;
+    }
+    if (sd->stacked_id) {
+        mem_size += static_cast<size_t>(10 * 1024 * 1024);  // 10 MB
+    }
+    mem_size += width * height * 3 * sizeof(float);
+    return mem_size;
+}
+
+// Learned conditions of prompt and, with cfg, of negative_prompt, encoded in one batch
+static void get_conditions(StableDiffusionGGML* sd,
+                           ggml_context* work_ctx,
+                           const std::string& prompt,
+                           const std::string& negative_prompt,
+                           int clip_skip,
+                           float cfg_scale,
+                           int width,
+                           int height,
+                           const std::unordered_map<std::string, float>& lora_state,
+                           SDCondition& cond,
+                           SDCondition& uncond) {
+    std::vector<std::string> cond_texts     = {prompt};
+    std::vector<bool> force_zero_embeddings = {false};
+    if (cfg_scale != 1.0) {
+        cond_texts.push_back(negative_prompt);
+        force_zero_embeddings.push_back(sd->version == VERSION_SDXL && negative_prompt.size() == 0);
+    }
+    std::vector<SDCondition> conds = sd->get_learned_conditions(work_ctx,
+                                                                cond_texts,
+                                                                clip_skip,
+                                                                width,
+                                                                height,
+                                                                force_zero_embeddings,
+                                                                lora_state);
+    cond = conds[0];
+    if (cfg_scale != 1.0) {
+        uncond = conds[1];
+    }
+}
+
+// Decodes the final latents whose image is still NULL and returns all the images, in the order
+// of the latents. An image that failed to decode has no data.
+static sd_image_t* decode_final_latents(StableDiffusionGGML* sd,
+                                        ggml_context* work_ctx,
+                                        const std::vector<ggml_tensor*>& latents,
+                                        std::vector<uint8_t*>& images,
+                                        int width,
+                                        int height) {
+    sd_image_t* result_images = (sd_image_t*)calloc(latents.size(), sizeof(sd_image_t));
+    if (result_images == NULL) {
+        for (uint8_t* data : images) {
+            free(data);
+        }
+        return NULL;
+    }
+    LOG_INFO("decoding %zu latents", latents.size());
+    decode_to_images(sd, work_ctx, latents, images);
+    for (size_t i = 0; i < latents.size(); i++) {
+        if (images[i] != NULL) {
+            result_images[i].width   = width;
+            result_images[i].height  = height;
+            result_images[i].channel = 3;
+            result_images[i].data    = images[i];
+        }
+    }
+    if (sd->free_params_immediately && !sd->use_tiny_autoencoder) {
+        sd->first_stage_model->free_params_buffer();
+    }
+    return result_images;
+}
+
 sd_image_t* generate_image(sd_ctx_t* sd_ctx,
                            struct ggml_context* work_ctx,
                            ggml_tensor* init_latent,
@@ -1139,7 +2069,7 @@ sd_image_t* generate_image(sd_ctx_t* sd_ctx,
     if (sd_ctx->sd->stacked_id) {
         if (!sd_ctx->sd->pmid_lora->applied) {
             t0 = ggml_time_ms();
-            sd_ctx->sd->pmid_lora->apply(sd_ctx->sd->tensors, sd_ctx->sd->n_threads);
+            sd_ctx->sd->pmid_lora->apply(sd_ctx->sd->tensors, 1.0f, sd_ctx->sd->n_threads);
             t1                             = ggml_time_ms();
             sd_ctx->sd->pmid_lora->applied = true;
             LOG_INFO("pmid_lora apply completed, taking %.2fs", (t1 - t0) * 1.0f / 1000);
@@ -1228,30 +2158,10 @@ sd_image_t* generate_image(sd_ctx_t* sd_ctx,
     }
 
     // Get learned condition
-    t0               = ggml_time_ms();
-    SDCondition cond = sd_ctx->sd->cond_stage_model->get_learned_condition(work_ctx,
-                                                                           sd_ctx->sd->n_threads,
-                                                                           prompt,
-                                                                           clip_skip,
-                                                                           width,
-                                                                           height,
-                                                                           sd_ctx->sd->diffusion_model->get_adm_in_channels());
-
+    t0 = ggml_time_ms();
+    SDCondition cond;
     SDCondition uncond;
-    if (cfg_scale != 1.0) {
-        bool force_zero_embeddings = false;
-        if (sd_ctx->sd->version == VERSION_SDXL && negative_prompt.size() == 0) {
-            force_zero_embeddings = true;
-        }
-        uncond = sd_ctx->sd->cond_stage_model->get_learned_condition(work_ctx,
-                                                                     sd_ctx->sd->n_threads,
-                                                                     negative_prompt,
-                                                                     clip_skip,
-                                                                     width,
-                                                                     height,
-                                                                     sd_ctx->sd->diffusion_model->get_adm_in_channels(),
-                                                                     force_zero_embeddings);
-    }
+    get_conditions(sd_ctx->sd, work_ctx, prompt, negative_prompt, clip_skip, cfg_scale, width, height, lora_f2m, cond, uncond);
     t1 = ggml_time_ms();
     LOG_INFO("get_learned_condition completed, taking %" PRId64 " ms", t1 - t0);
 
@@ -1268,14 +2178,20 @@ sd_image_t* generate_image(sd_ctx_t* sd_ctx,
 
     // Sample
     std::vector<struct ggml_tensor*> final_latents;  // collect latents to decode
-    int C = 4;
-    if (sd_ctx->sd->version == VERSION_SD3_2B) {
-        C = 16;
-    } else if (sd_ctx->sd->version == VERSION_FLUX_DEV || sd_ctx->sd->version == VERSION_FLUX_SCHNELL) {
-        C = 16;
-    }
+    int C = sd_ctx->sd->get_latent_channels();
     int W = width / 8;
     int H = height / 8;
+
+    // latent b is decoded on a thread of its own while latent b + 1 is sampled, the last
+    // one after sampling with all threads
+    StableDiffusionGGML* sd = sd_ctx->sd;
+    bool pipelined          = sd->decode_threads > 0 && sd->vae_backend != sd->backend && batch_count > 1;
+    std::vector<uint8_t*> pipelined_images(batch_count, NULL);
+    std::thread decoder;
+    if (pipelined) {
+        LOG_INFO("decoding next to sampling, %d threads sample and %d decode", sd->n_threads - sd->decode_threads, sd->decode_threads);
+    }
+
     LOG_INFO("sampling using %s method", sampling_methods_str[sample_method]);
     for (int b = 0; b < batch_count; b++) {
         int64_t sampling_start = ggml_time_ms();
@@ -1295,6 +2211,7 @@ sd_image_t* generate_image(sd_ctx_t* sd_ctx,
             LOG_INFO("PHOTOMAKER: start_merge_step: %d", start_merge_step);
         }
 
+        bool decoding           = decoder.joinable();  // the previous latent is decoded meanwhile
         struct ggml_tensor* x_0 = sd_ctx->sd->sample(work_ctx,
                                                      x_t,
                                                      noise,
@@ -1308,12 +2225,28 @@ sd_image_t* generate_image(sd_ctx_t* sd_ctx,
                                                      sample_method,
                                                      sigmas,
                                                      start_merge_step,
-                                                     id_cond);
+                                                     id_cond,
+                                                     decoding ? sd->n_threads - sd->decode_threads : sd->n_threads,
+                                                     decoding);
         // struct ggml_tensor* x_0 = load_tensor_from_file(ctx, "samples_ddim.bin");
         // print_ggml_tensor(x_0);
         int64_t sampling_end = ggml_time_ms();
         LOG_INFO("sampling completed, taking %.2fs", (sampling_end - sampling_start) * 1.0f / 1000);
         final_latents.push_back(x_0);
+
+        if (pipelined && b + 1 < batch_count) {
+            if (decoder.joinable()) {
+                decoder.join();
+            }
+            // the tiles of the decode would interleave their progress with the sampling steps
+            decoder = std::thread([sd, x_0, b, &pipelined_images]() {
+                sd_set_thread_progress(false);
+                pipelined_images[b] = decode_to_image_detached(sd, x_0, b, sd->decode_threads);
+            });
+        }
+    }
+    if (decoder.joinable()) {
+        decoder.join();
     }
 
     if (sd_ctx->sd->free_params_immediately) {
@@ -1323,36 +2256,10 @@ sd_image_t* generate_image(sd_ctx_t* sd_ctx,
     LOG_INFO("generating %" PRId64 " latent images completed, taking %.2fs", final_latents.size(), (t3 - t1) * 1.0f / 1000);
 
     // Decode to image
-    LOG_INFO("decoding %zu latents", final_latents.size());
-    std::vector<struct ggml_tensor*> decoded_images;  // collect decoded images
-    for (size_t i = 0; i < final_latents.size(); i++) {
-        t1                      = ggml_time_ms();
-        struct ggml_tensor* img = sd_ctx->sd->decode_first_stage(work_ctx, final_latents[i] /* x_0 */);
-        // print_ggml_tensor(img);
-        if (img != NULL) {
-            decoded_images.push_back(img);
-        }
-        int64_t t2 = ggml_time_ms();
-        LOG_INFO("latent %" PRId64 " decoded, taking %.2fs", i + 1, (t2 - t1) * 1.0f / 1000);
-    }
+    sd_image_t* result_images = decode_final_latents(sd, work_ctx, final_latents, pipelined_images, width, height);
 
     int64_t t4 = ggml_time_ms();
     LOG_INFO("decode_first_stage completed, taking %.2fs", (t4 - t3) * 1.0f / 1000);
-    if (sd_ctx->sd->free_params_immediately && !sd_ctx->sd->use_tiny_autoencoder) {
-        sd_ctx->sd->first_stage_model->free_params_buffer();
-    }
-    sd_image_t* result_images = (sd_image_t*)calloc(batch_count, sizeof(sd_image_t));
-    if (result_images == NULL) {
-        ggml_free(work_ctx);
-        return NULL;
-    }
-
-    for (size_t i = 0; i < decoded_images.size(); i++) {
-        result_images[i].width   = width;
-        result_images[i].height  = height;
-        result_images[i].channel = 3;
-        result_images[i].data    = sd_tensor_to_image(decoded_images[i]);
-    }
     ggml_free(work_ctx);
 
     return result_images;
@@ -1381,18 +2288,7 @@ sd_image_t* txt2img(sd_ctx_t* sd_ctx,
     }
 
     struct ggml_init_params params;
-    params.mem_size = static_cast<size_t>(10 * 1024 * 1024);  // 10 MB
-    if (sd_ctx->sd->version == VERSION_SD3_2B) {
-        params.mem_size *= 3;
-    }
-    if (sd_ctx->sd->version == VERSION_FLUX_DEV || sd_ctx->sd->version == VERSION_FLUX_SCHNELL) {
-        params.mem_size *= 4;
-    }
-    if (sd_ctx->sd->stacked_id) {
-        params.mem_size += static_cast<size_t>(10 * 1024 * 1024);  // 10 MB
-    }
-    params.mem_size += width * height * 3 * sizeof(float);
-    params.mem_size *= batch_count;
+    params.mem_size   = get_work_ctx_size(sd_ctx->sd, width, height) * batch_count;
     params.mem_buffer = NULL;
     params.no_alloc   = false;
     // LOG_DEBUG("mem_size %u ", params.mem_size);
@@ -1407,22 +2303,11 @@ sd_image_t* txt2img(sd_ctx_t* sd_ctx,
 
     std::vector<float> sigmas = sd_ctx->sd->denoiser->get_sigmas(sample_steps);
 
-    int C = 4;
-    if (sd_ctx->sd->version == VERSION_SD3_2B) {
-        C = 16;
-    } else if (sd_ctx->sd->version == VERSION_FLUX_DEV || sd_ctx->sd->version == VERSION_FLUX_SCHNELL) {
-        C = 16;
-    }
+    int C                    = sd_ctx->sd->get_latent_channels();
     int W                    = width / 8;
     int H                    = height / 8;
     ggml_tensor* init_latent = ggml_new_tensor_4d(work_ctx, GGML_TYPE_F32, W, H, C, 1);
-    if (sd_ctx->sd->version == VERSION_SD3_2B) {
-        ggml_set_f32(init_latent, 0.0609f);
-    } else if (sd_ctx->sd->version == VERSION_FLUX_DEV || sd_ctx->sd->version == VERSION_FLUX_SCHNELL) {
-        ggml_set_f32(init_latent, 0.1159f);
-    } else {
-        ggml_set_f32(init_latent, 0.f);
-    }
+    ggml_set_f32(init_latent, sd_ctx->sd->get_empty_latent_value());
 
     sd_image_t* result_images = generate_image(sd_ctx,
                                                work_ctx,
@@ -1451,6 +2336,202 @@ sd_image_t* txt2img(sd_ctx_t* sd_ctx,
     return result_images;
 }
 
+// stacks tensors of the same shape along their batch dimension `dim`
+static ggml_tensor* stack_batch_items(ggml_context* work_ctx, const std::vector<ggml_tensor*>& items, int dim) {
+    if (items.empty() || items[0] == NULL) {
+        return NULL;
+    }
+    ggml_tensor* first = items[0];
+    GGML_ASSERT(first->ne[dim] == 1);
+    int64_t ne[4]       = {first->ne[0], first->ne[1], first->ne[2], first->ne[3]};
+    ne[dim]             = items.size();
+    ggml_tensor* result = ggml_new_tensor(work_ctx, GGML_TYPE_F32, 4, ne);
+    size_t nbytes       = ggml_nbytes(first);
+    for (size_t i = 0; i < items.size(); i++) {
+        GGML_ASSERT(ggml_are_same_shape(items[i], first));
+        memcpy((char*)result->data + i * nbytes, items[i]->data, nbytes);
+    }
+    return result;
+}
+
+sd_image_t* txt2img_batch(sd_ctx_t* sd_ctx,
+                          const char** prompts,
+                          int n_prompts,
+                          const char* negative_prompt_c_str,
+                          int clip_skip,
+                          float cfg_scale,
+                          float guidance,
+                          int width,
+                          int height,
+                          enum sample_method_t sample_method,
+                          int sample_steps,
+                          int64_t seed) {
+    LOG_DEBUG("txt2img_batch %dx%d, %d prompts", width, height, n_prompts);
+    if (sd_ctx == NULL || prompts == NULL || n_prompts <= 0) {
+        return NULL;
+    }
+    StableDiffusionGGML* sd = sd_ctx->sd;
+    if (seed < 0) {
+        srand((int)time(NULL));
+        seed = rand();
+    }
+    std::string negative_prompt = negative_prompt_c_str != NULL ? negative_prompt_c_str : "";
+
+    std::vector<std::string> item_prompts;
+    std::vector<std::unordered_map<std::string, float>> item_lora_states;
+    std::unordered_map<std::string, float> batch_lora_state;  // every lora used by the batch
+    for (int i = 0; i < n_prompts; i++) {
+        auto result_pair = extract_and_remove_lora(prompts[i] != NULL ? prompts[i] : "");
+        item_prompts.push_back(result_pair.second);
+        item_lora_states.push_back(result_pair.first);
+        for (auto& kv : result_pair.first) {
+            batch_lora_state[kv.first] = kv.second;
+        }
+    }
+    if (!sd->lora_runtime) {
+        for (auto& item_lora_state : item_lora_states) {
+            if (item_lora_state != item_lora_states[0]) {
+                LOG_ERROR("prompts of a batch using different loras require lora_runtime");
+                return NULL;
+            }
+        }
+    }
+
+    // conditions and latents exist both per item and stacked into batches
+    struct ggml_init_params params;
+    params.mem_size   = get_work_ctx_size(sd, width, height) * 2 * n_prompts;
+    params.mem_buffer = NULL;
+    params.no_alloc   = false;
+
+    struct ggml_context* work_ctx = ggml_init(params);
+    if (!work_ctx) {
+        LOG_ERROR("ggml_init() failed");
+        return NULL;
+    }
+
+    int64_t t0 = ggml_time_ms();
+
+    // Get learned conditions, each prompt with its own loras applied to the text encoders. The
+    // negative prompt is shared, it is encoded once per set of loras and reused by the items.
+    std::vector<SDCondition> conds(n_prompts);
+    std::vector<SDCondition> unconds(n_prompts);
+    std::map<std::map<std::string, float>, SDCondition> lora_unconds;
+    for (int i = 0; i < n_prompts; i++) {
+        if (sd->lora_runtime) {
+            sd->apply_runtime_loras(batch_lora_state, {item_lora_states[i]});
+        } else if (i == 0) {
+            sd->apply_loras(item_lora_states[i]);
+        }
+        std::map<std::string, float> loras(item_lora_states[i].begin(), item_lora_states[i].end());
+        auto iter          = lora_unconds.find(loras);
+        bool encode_uncond = cfg_scale != 1.0 && iter == lora_unconds.end();
+        get_conditions(sd, work_ctx, item_prompts[i], negative_prompt, clip_skip, encode_uncond ? cfg_scale : 1.0f,
+                       width, height, item_lora_states[i], conds[i], unconds[i]);
+        if (encode_uncond) {
+            lora_unconds[loras] = unconds[i];
+        } else if (cfg_scale != 1.0) {
+            unconds[i] = iter->second;
+        }
+    }
+    int64_t t1 = ggml_time_ms();
+    LOG_INFO("get_learned_condition completed, taking %" PRId64 " ms", t1 - t0);
+
+    if (sd->free_params_immediately) {
+        sd->cond_stage_model->free_params_buffer();
+    }
+
+    // Only prompts with the same condition shape (number of prompt chunks) can share a batch,
+    // flux samples a single image at a time
+    bool batchable = sd->version != VERSION_FLUX_DEV && sd->version != VERSION_FLUX_SCHNELL;
+    std::map<std::vector<int64_t>, std::vector<int>> batches;
+    for (int i = 0; i < n_prompts; i++) {
+        std::vector<int64_t> key(conds[i].c_crossattn->ne, conds[i].c_crossattn->ne + GGML_MAX_DIMS);
+        key.push_back(batchable ? -1 : i);
+        batches[key].push_back(i);
+    }
+
+    int C                     = sd->get_latent_channels();
+    int W                     = width / 8;
+    int H                     = height / 8;
+    std::vector<float> sigmas = sd->denoiser->get_sigmas(sample_steps);
+
+    // Sample
+    LOG_INFO("sampling using %s method", sampling_methods_str[sample_method]);
+    std::vector<struct ggml_tensor*> final_latents(n_prompts, NULL);
+    for (auto& kv : batches) {
+        const std::vector<int>& items = kv.second;
+        int N                         = (int)items.size();
+        int64_t sampling_start        = ggml_time_ms();
+        LOG_INFO("generating %d images in one batch", N);
+
+        std::vector<std::unordered_map<std::string, float>> batch_item_lora_states;
+        std::vector<ggml_tensor*> c_crossattns, c_vectors, uc_crossattns, uc_vectors;
+        for (int i : items) {
+            batch_item_lora_states.push_back(item_lora_states[i]);
+            c_crossattns.push_back(conds[i].c_crossattn);
+            c_vectors.push_back(conds[i].c_vector);
+            uc_crossattns.push_back(unconds[i].c_crossattn);
+            uc_vectors.push_back(unconds[i].c_vector);
+        }
+        if (sd->lora_runtime) {
+            sd->apply_runtime_loras(batch_lora_state, batch_item_lora_states);
+        }
+        SDCondition cond(stack_batch_items(work_ctx, c_crossattns, 2), stack_batch_items(work_ctx, c_vectors, 1), NULL);
+        SDCondition uncond(stack_batch_items(work_ctx, uc_crossattns, 2), stack_batch_items(work_ctx, uc_vectors, 1), NULL);
+
+        ggml_tensor* init_latent = ggml_new_tensor_4d(work_ctx, GGML_TYPE_F32, W, H, C, N);
+        ggml_set_f32(init_latent, sd->get_empty_latent_value());
+        ggml_tensor* noise = ggml_new_tensor_4d(work_ctx, GGML_TYPE_F32, W, H, C, N);
+        for (int b = 0; b < N; b++) {
+            // same noise as generating the prompt alone
+            ggml_tensor* item_noise = ggml_new_tensor_4d(work_ctx, GGML_TYPE_F32, W, H, C, 1);
+            sd->rng->manual_seed(seed + items[b]);
+            ggml_tensor_set_f32_randn(item_noise, sd->rng);
+            memcpy((char*)noise->data + b * ggml_nbytes(item_noise), item_noise->data, ggml_nbytes(item_noise));
+        }
+
+        struct ggml_tensor* x_0 = sd->sample(work_ctx,
+                                             init_latent,
+                                             noise,
+                                             cond,
+                                             uncond,
+                                             NULL,
+                                             0.f,
+                                             cfg_scale,
+                                             cfg_scale,
+                                             guidance,
+                                             sample_method,
+                                             sigmas,
+                                             -1,
+                                             SDCondition(NULL, NULL, NULL),
+                                             sd->n_threads,
+                                             false);
+        for (int b = 0; b < N; b++) {
+            ggml_tensor* latent = ggml_new_tensor_4d(work_ctx, GGML_TYPE_F32, W, H, C, 1);
+            memcpy(latent->data, (char*)x_0->data + b * ggml_nbytes(latent), ggml_nbytes(latent));
+            final_latents[items[b]] = latent;
+        }
+        int64_t sampling_end = ggml_time_ms();
+        LOG_INFO("sampling completed, taking %.2fs", (sampling_end - sampling_start) * 1.0f / 1000);
+    }
+
+    if (sd->free_params_immediately) {
+        sd->diffusion_model->free_params_buffer();
+    }
+    int64_t t2 = ggml_time_ms();
+    LOG_INFO("generating %d latent images completed, taking %.2fs", n_prompts, (t2 - t1) * 1.0f / 1000);
+
+    // Decode to image
+    std::vector<uint8_t*> images(n_prompts, NULL);
+    sd_image_t* result_images = decode_final_latents(sd, work_ctx, final_latents, images, width, height);
+    ggml_free(work_ctx);
+
+    int64_t t3 = ggml_time_ms();
+    LOG_INFO("txt2img_batch completed in %.2fs", (t3 - t0) * 1.0f / 1000);
+
+    return result_images;
+}
+
 sd_image_t* img2img(sd_ctx_t* sd_ctx,
                     sd_image_t init_image,
                     const char* prompt_c_str,
@@ -1508,13 +2589,7 @@ sd_image_t* img2img(sd_ctx_t* sd_ctx,
 
     ggml_tensor* init_img = ggml_new_tensor_4d(work_ctx, GGML_TYPE_F32, width, height, 3, 1);
     sd_image_to_tensor(init_image.data, init_img);
-    ggml_tensor* init_latent = NULL;
-    if (!sd_ctx->sd->use_tiny_autoencoder) {
-        ggml_tensor* moments = sd_ctx->sd->encode_first_stage(work_ctx, init_img);
-        init_latent          = sd_ctx->sd->get_first_stage_encoding(work_ctx, moments);
-    } else {
-        init_latent = sd_ctx->sd->encode_first_stage(work_ctx, init_img);
-    }
+    ggml_tensor* init_latent = sd_ctx->sd->encode_to_latent(work_ctx, init_img);
     print_ggml_tensor(init_latent, true);
     size_t t1 = ggml_time_ms();
     LOG_INFO("encode_first_stage completed, taking %.2fs", (t1 - t0) * 1.0f / 1000);
@@ -1644,7 +2719,9 @@ SD_API sd_image_t* img2vid(sd_ctx_t* sd_ctx,
                                                  sample_method,
                                                  sigmas,
                                                  -1,
-                                                 SDCondition(NULL, NULL, NULL));
+                                                 SDCondition(NULL, NULL, NULL),
+                                                 sd_ctx->sd->n_threads,
+                                                 false);
 
     int64_t t2 = ggml_time_ms();
     LOG_INFO("sampling completed, taking %.2fs", (t2 - t1) * 1.0f / 1000);
@@ -1652,7 +2729,7 @@ SD_API sd_image_t* img2vid(sd_ctx_t* sd_ctx,
         sd_ctx->sd->diffusion_model->free_params_buffer();
     }
 
-    struct ggml_tensor* img = sd_ctx->sd->decode_first_stage(work_ctx, x_0);
+    struct ggml_tensor* img = sd_ctx->sd->decode_first_stage(work_ctx, x_0, sd_ctx->sd->n_threads);
     if (sd_ctx->sd->free_params_immediately) {
         sd_ctx->sd->first_stage_model->free_params_buffer();
     }
@@ -57,6 +57,13 @@ enum schedule_t {
     N_SCHEDULES
 };
 
+enum preview_t {
+    PREVIEW_NONE,
+    PREVIEW_LINEAR,  // latent projected to rgb, 1/8 of the image size, nearly free
+    PREVIEW_TAE,     // latent decoded with taesd, needs a context created with a taesd or preview taesd model
+    N_PREVIEWS
+};
+
 // same as enum ggml_type
 enum sd_type_t {
     SD_TYPE_F32  = 0,
@@ -108,8 +115,37 @@ enum sd_log_level_t {
 typedef void (*sd_log_cb_t)(enum sd_log_level_t level, const char* text, void* data);
 typedef void (*sd_progress_cb_t)(int step, int steps, float time, void* data);
 
+// rows [y, y + n_rows) of the image at index of the current generation, 8-bit RGB with width * 3
+// bytes per row, handed over as soon as they are decoded; the images are still returned as usual
+typedef void (*sd_image_rows_cb_t)(int index, uint32_t width, uint32_t height, uint32_t y, uint32_t n_rows, const uint8_t* rows, void* data);
+
 SD_API void sd_set_log_callback(sd_log_cb_t sd_log_cb, void* data);
 SD_API void sd_set_progress_callback(sd_progress_cb_t cb, void* data);
+// decode the images band by band and stream their rows (default: none, NULL disables)
+SD_API void sd_set_image_rows_callback(sd_image_rows_cb_t cb, void* data);
+// vae compute memory a decode may use (default: 0, unlimited). Images whose decode would take more
+// are decoded in tiles, and the final latents of a batch are decoded together as far as they fit
+SD_API void sd_set_vae_decode_budget(uint64_t size);
+// normalize the tiles of a tiled vae encode with the GroupNorm statistics of the whole image instead of
+// their own, which keeps the colors of the tiles from drifting apart. It takes one pass over the tiles per
+// GroupNorm layer, 22 of them, each running the encoder up to its layer: over ten times the cost of the
+// encode (default: false)
+SD_API void sd_set_vae_tiling_exact(bool exact);
+// memory kept for loaded loras, so that reusing a lora doesn't read it again. The loras stay on the
+// backend of the model, in VRAM on gpu builds (default: 0, disabled)
+SD_API void sd_set_lora_cache_size(uint64_t size);
+// memory kept for learned conditions of prompts that were encoded before (default: 256 MB, 0 disables)
+SD_API void sd_set_condition_cache_size(uint64_t size);
+// directory where learned conditions are also stored, shared by processes using the same directory
+// (default: none, NULL or "" disables)
+SD_API void sd_set_condition_cache_dir(const char* dir);
+// number of tiles of a tiled vae or upscale pass that go through the model at once (default: 1),
+// more tiles use more memory but less graph calls
+SD_API void sd_set_tile_batch_size(int n);
+// compute memory a tile of a tiled vae decode or upscale pass may use. The tile size is tuned to
+// the fastest one that fits, measured once per model, backend and thread count (default: 0, the
+// fixed tile sizes)
+SD_API void sd_set_tile_memory_budget(uint64_t size);
 SD_API int32_t get_num_physical_cores();
 SD_API const char* sd_get_system_info();
 
@@ -120,8 +156,22 @@ typedef struct {
     uint8_t* data;
 } sd_image_t;
 
+// previews of the images being sampled, one per image of the sampled batch
+typedef void (*sd_preview_cb_t)(int step, int steps, const sd_image_t* images, int n_images, void* data);
+
+// preview the denoised latents every interval steps (default: none, NULL or PREVIEW_NONE disables)
+SD_API void sd_set_preview_callback(sd_preview_cb_t cb, enum preview_t mode, int interval, void* data);
+
 typedef struct sd_ctx_t sd_ctx_t;
 
+// decode_threads > 0 decodes every image but the last of a batch on that many of the n_threads
+// while the next image is sampled; the vae needs the cpu for it (always true on a cpu build,
+// keep_vae_on_cpu otherwise). The decode then runs on a thread of its own: the image rows
+// callback and the log callback are called from it while the sampler reports progress and
+// previews from the calling thread. The callbacks never run at the same time, and the tile
+// progress of that decode is not reported.
+// preview_taesd_path loads a taesd that only decodes the PREVIEW_TAE previews, the images are still
+// decoded with the vae (empty: none, taesd_path replaces the vae and decodes the previews as well)
 SD_API sd_ctx_t* new_sd_ctx(const char* model_path,
                             const char* clip_l_path,
                             const char* t5xxl_path,
@@ -141,7 +191,13 @@ SD_API sd_ctx_t* new_sd_ctx(const char* model_path,
                             enum schedule_t s,
                             bool keep_clip_on_cpu,
                             bool keep_control_net_cpu,
-                            bool keep_vae_on_cpu);
+                            bool keep_vae_on_cpu,
+                            bool lora_runtime,
+                            bool t5_mask_padding,
+                            int decode_threads,
+                            bool vae_f16,
+                            bool vae_validate,
+                            const char* preview_taesd_path);
 
 SD_API void free_sd_ctx(sd_ctx_t* sd_ctx);
 
@@ -163,6 +219,22 @@ SD_API sd_image_t* txt2img(sd_ctx_t* sd_ctx,
                            bool normalize_input,
                            const char* input_id_images_path);
 
+// Generates one image per prompt, sampling the prompts together in batches (one prompt at a time
+// with flux). Every prompt may use its own <lora:name:multiplier> tags, which requires a context
+// created with lora_runtime.
+SD_API sd_image_t* txt2img_batch(sd_ctx_t* sd_ctx,
+                                 const char** prompts,
+                                 int n_prompts,
+                                 const char* negative_prompt,
+                                 int clip_skip,
+                                 float cfg_scale,
+                                 float guidance,
+                                 int width,
+                                 int height,
+                                 enum sample_method_t sample_method,
+                                 int sample_steps,
+                                 int64_t seed);
+
 SD_API sd_image_t* img2img(sd_ctx_t* sd_ctx,
                            sd_image_t init_image,
                            const char* prompt,
@@ -207,7 +279,22 @@ SD_API void free_upscaler_ctx(upscaler_ctx_t* upscaler_ctx);
 
 SD_API sd_image_t upscale(upscaler_ctx_t* upscaler_ctx, sd_image_t input_image, uint32_t upscale_factor);
 
-SD_API bool convert(const char* input_path, const char* vae_path, const char* output_path, enum sd_type_t output_type);
+SD_API bool convert(const char* input_path,
+                    const char* vae_path,
+                    const char* output_path,
+                    enum sd_type_t output_type,
+                    const char* tensor_type_rules,
+                    int n_threads);
+
+// Measures the quantization error of every tensor for each candidate type (a default set
+// of types if types is NULL) and writes the tensor type rules that fit into target_size bytes.
+SD_API bool analyze_quantization(const char* input_path,
+                                 const char* vae_path,
+                                 const char* output_path,
+                                 const enum sd_type_t* types,
+                                 int n_types,
+                                 uint64_t target_size,
+                                 int n_threads);
 
 SD_API uint8_t* preprocess_canny(uint8_t* img,
                                  int width,
@@ -425,6 +425,8 @@ public:
         }
     }
 
+    int pad_id() const { return pad_id_; }
+
     // Returns the minimum score in sentence pieces.
     // min_score() - 10 is used for the cost of unknown sentence.
     float min_score() const { return min_score_; }
@@ -578,10 +580,14 @@ public:
         }
         if (past_bias != NULL) {
             if (mask != NULL) {
-                mask = ggml_add(ctx, mask, past_bias);
-            } else {
-                mask = past_bias;
+                // mask: [N, 1, 1, n_token], masks the keys of each item for all of its heads and queries
+                int64_t N = x->ne[2];
+                auto bias = ggml_reshape_4d(ctx, past_bias, past_bias->ne[0], past_bias->ne[1], past_bias->ne[2], 1);
+                bias      = ggml_repeat(ctx, bias, ggml_new_tensor_4d(ctx, bias->type, bias->ne[0], bias->ne[1], bias->ne[2], N));
+                bias      = ggml_add(ctx, bias, mask);
+                past_bias = ggml_reshape_3d(ctx, bias, bias->ne[0], bias->ne[1], bias->ne[2] * N);  // [N * n_head, n_token, n_token]
             }
+            mask = past_bias;
         }
 
         k = ggml_scale_inplace(ctx, k, sqrt(d_head));
@@ -676,6 +682,8 @@ public:
             auto ret  = block->forward(ctx, x, past_bias, attention_mask, relative_position_bucket);
             x         = ret.first;
             past_bias = ret.second;
+            // the first block folds the attention mask into past_bias
+            attention_mask = NULL;
         }
 
         auto final_layer_norm = std::dynamic_pointer_cast<T5LayerNorm>(blocks["final_layer_norm"]);
@@ -737,18 +745,21 @@ struct T5Runner : public GGMLRunner {
 
     struct ggml_tensor* forward(struct ggml_context* ctx,
                                 struct ggml_tensor* input_ids,
-                                struct ggml_tensor* relative_position_bucket) {
+                                struct ggml_tensor* relative_position_bucket,
+                                struct ggml_tensor* attention_mask = NULL) {
         size_t N       = input_ids->ne[1];
         size_t n_token = input_ids->ne[0];
 
-        auto hidden_states = model.forward(ctx, input_ids, NULL, NULL, relative_position_bucket);  // [N, n_token, model_dim]
+        auto hidden_states = model.forward(ctx, input_ids, NULL, attention_mask, relative_position_bucket);  // [N, n_token, model_dim]
         return hidden_states;
     }
 
-    struct ggml_cgraph* build_graph(struct ggml_tensor* input_ids) {
-        struct ggml_cgraph* gf = ggml_new_graph(compute_ctx);
+    struct ggml_cgraph* build_graph(struct ggml_tensor* input_ids,
+                                    struct ggml_tensor* attention_mask = NULL) {
+        struct ggml_cgraph* gf = ggml_new_graph_custom(compute_ctx, sd_graph_size(GGML_DEFAULT_GRAPH_SIZE), false);
 
-        input_ids = to_backend(input_ids);
+        input_ids      = to_backend(input_ids);
+        attention_mask = to_backend(attention_mask);
 
         relative_position_bucket_vec = compute_relative_position_bucket(input_ids->ne[0], input_ids->ne[0]);
 
@@ -765,19 +776,21 @@ struct T5Runner : public GGMLRunner {
                                                            input_ids->ne[0]);
         set_backend_tensor_data(relative_position_bucket, relative_position_bucket_vec.data());
 
-        struct ggml_tensor* hidden_states = forward(compute_ctx, input_ids, relative_position_bucket);
+        struct ggml_tensor* hidden_states = forward(compute_ctx, input_ids, relative_position_bucket, attention_mask);
 
         ggml_build_forward_expand(gf, hidden_states);
 
         return gf;
     }
 
+    // attention_mask: optional [N, 1, 1, n_token] additive mask, -INFINITY for the padding tokens of each item
     void compute(const int n_threads,
                  struct ggml_tensor* input_ids,
+                 struct ggml_tensor* attention_mask,
                  ggml_tensor** output,
                  ggml_context* output_ctx = NULL) {
         auto get_graph = [&]() -> struct ggml_cgraph* {
-            return build_graph(input_ids);
+            return build_graph(input_ids, attention_mask);
         };
         GGMLRunner::compute(get_graph, n_threads, true, output, output_ctx);
     }
@@ -939,7 +952,7 @@ struct T5Embedder {
             struct ggml_tensor* out = NULL;
 
             int t0 = ggml_time_ms();
-            model.compute(8, input_ids, &out, work_ctx);
+            model.compute(8, input_ids, NULL, &out, work_ctx);
             int t1 = ggml_time_ms();
 
             print_ggml_tensor(out);
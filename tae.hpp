@@ -231,6 +231,9 @@ struct TinyAutoEncoder : public GGMLRunner {
         struct ggml_cgraph* gf  = ggml_new_graph(compute_ctx);
         z                       = to_backend(z);
         struct ggml_tensor* out = decode_graph ? taesd.decode(compute_ctx, z) : taesd.encode(compute_ctx, z);
+        if (decode_graph) {
+            out = ggml_clamp(compute_ctx, out, 0.0f, 1.0f);
+        }
         ggml_build_forward_expand(gf, out);
         return gf;
     }
@@ -45,6 +45,35 @@ struct UpscalerGGML {
         return true;
     }
 
+    // esrgan_upscaler->tile_size unless sd_get_tile_memory_budget() lets it be tuned
+    int tune_tile_size(int max_size, int overlap_size) {
+        int scale       = esrgan_upscaler->scale;
+        std::string key = format("%s (%zu bytes of weights, %s, %d threads)",
+                                 esrgan_upscaler->get_desc().c_str(), esrgan_upscaler->get_params_buffer_size(), ggml_backend_name(backend), n_threads);
+
+        auto probe = [&](int size) -> size_t {
+            struct ggml_init_params params;
+            params.mem_size = (size * size + size * scale * size * scale) * 3 * sizeof(float);
+            params.mem_size += 2 * ggml_tensor_overhead();
+            params.mem_buffer = NULL;
+            params.no_alloc   = false;
+
+            struct ggml_context* probe_ctx = ggml_init(params);
+            if (probe_ctx == NULL) {
+                return 0;
+            }
+            ggml_tensor* in  = ggml_new_tensor_4d(probe_ctx, GGML_TYPE_F32, size, size, 3, 1);
+            ggml_tensor* out = ggml_new_tensor_4d(probe_ctx, GGML_TYPE_F32, size * scale, size * scale, 3, 1);
+            ggml_set_f32(in, 0.f);
+            esrgan_upscaler->compute(n_threads, in, &out);
+            // the compute buffer is kept between tiles, it has to fit the next size
+            esrgan_upscaler->free_compute_buffer();
+            ggml_free(probe_ctx);
+            return esrgan_upscaler->get_compute_buffer_size();
+        };
+        return sd_tune_tile_size(key, esrgan_upscaler->tile_size, max_size, overlap_size, probe);
+    }
+
     sd_image_t upscale(sd_image_t input_image, uint32_t upscale_factor) {
         // upscale_factor, unused for RealESRGAN_x4plus_anime_6B.pth
         sd_image_t upscaled_image = {0, 0, 0, NULL};
@@ -73,8 +102,10 @@ struct UpscalerGGML {
         auto on_tiling        = [&](ggml_tensor* in, ggml_tensor* out, bool init) {
             esrgan_upscaler->compute(n_threads, in, &out);
         };
-        int64_t t0 = ggml_time_ms();
-        sd_tiling(input_image_tensor, upscaled, esrgan_upscaler->scale, esrgan_upscaler->tile_size, 0.25f, on_tiling);
+        int64_t t0       = ggml_time_ms();
+        int overlap_size = esrgan_upscaler->tile_size / 4;
+        int tile_size    = tune_tile_size((int)std::min(input_image.width, input_image.height), overlap_size);
+        sd_tiling(input_image_tensor, upscaled, esrgan_upscaler->scale, tile_size, overlap_size, on_tiling);
         esrgan_upscaler->free_compute_buffer();
         ggml_tensor_clamp(upscaled, 0.f, 1.f);
         uint8_t* upscaled_data = sd_tensor_to_image(upscaled);
@@ -84,6 +84,14 @@ bool is_directory(const std::string& path) {
     return (attributes != INVALID_FILE_ATTRIBUTES && (attributes & FILE_ATTRIBUTE_DIRECTORY));
 }
 
+int64_t get_file_mtime(const std::string& filename) {
+    WIN32_FILE_ATTRIBUTE_DATA data;
+    if (!GetFileAttributesExA(filename.c_str(), GetFileExInfoStandard, &data)) {
+        return -1;
+    }
+    return ((int64_t)data.ftLastWriteTime.dwHighDateTime << 32) | data.ftLastWriteTime.dwLowDateTime;
+}
+
 std::string get_full_path(const std::string& dir, const std::string& filename) {
     std::string full_path = dir + "\\" + filename;
 
@@ -104,14 +112,11 @@ std::vector<std::string> get_files_from_dir(const std::string& dir) {
     WIN32_FIND_DATA findFileData;
     HANDLE hFind;
 
-    char currentDirectory[MAX_PATH];
-    GetCurrentDirectory(MAX_PATH, currentDirectory);
-
-    char directoryPath[MAX_PATH];  // this is absolute path
-    sprintf(directoryPath, "%s\\%s\\*", currentDirectory, dir.c_str());
+    // dir may be relative to the current directory or absolute
+    std::string directoryPath = dir + "\\*";
 
     // Find the first file in the directory
-    hFind = FindFirstFile(directoryPath, &findFileData);
+    hFind = FindFirstFile(directoryPath.c_str(), &findFileData);
 
     // Check if the directory was found
     if (hFind == INVALID_HANDLE_VALUE) {
@@ -123,7 +128,7 @@ std::vector<std::string> get_files_from_dir(const std::string& dir) {
     do {
         // Check if the found file is a regular file (not a directory)
         if (!(findFileData.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY)) {
-            files.push_back(std::string(currentDirectory) + "\\" + dir + "\\" + std::string(findFileData.cFileName));
+            files.push_back(dir + "\\" + std::string(findFileData.cFileName));
         }
     } while (FindNextFile(hFind, &findFileData) != 0);
 
@@ -149,6 +154,14 @@ bool is_directory(const std::string& path) {
     return (stat(path.c_str(), &buffer) == 0 && S_ISDIR(buffer.st_mode));
 }
 
+int64_t get_file_mtime(const std::string& filename) {
+    struct stat buffer;
+    if (stat(filename.c_str(), &buffer) != 0) {
+        return -1;
+    }
+    return (int64_t)buffer.st_mtime;
+}
+
 // TODO: add windows version
 std::string get_full_path(const std::string& dir, const std::string& filename) {
     DIR* dp = opendir(dir.c_str());
@@ -309,7 +322,22 @@ sd_image_t* preprocess_id_image(sd_image_t* img) {
     return resized;
 }
 
+static thread_local bool sd_thread_progress = true;
+
+void sd_set_thread_progress(bool enabled) {
+    sd_thread_progress = enabled;
+}
+
+std::recursive_mutex& sd_callback_mutex() {
+    static std::recursive_mutex mutex;
+    return mutex;
+}
+
 void pretty_progress(int step, int steps, float time) {
+    if (!sd_thread_progress) {
+        return;
+    }
+    std::lock_guard<std::recursive_mutex> lock(sd_callback_mutex());
     if (sd_progress_cb) {
         sd_progress_cb(step, steps, time, sd_progress_cb_data);
         return;
@@ -360,13 +388,21 @@ std::string trim(const std::string& s) {
 static sd_log_cb_t sd_log_cb = NULL;
 void* sd_log_cb_data         = NULL;
 
+static int sd_tile_batch_size         = 1;
+static uint64_t sd_tile_memory_budget = 0;
+
+static sd_preview_cb_t sd_preview_cb = NULL;
+static preview_t sd_preview_mode     = PREVIEW_NONE;
+static int sd_preview_interval       = 1;
+void* sd_preview_cb_data             = NULL;
+
 #define LOG_BUFFER_SIZE 1024
 
 void log_printf(sd_log_level_t level, const char* file, int line, const char* format, ...) {
     va_list args;
     va_start(args, format);
 
-    static char log_buffer[LOG_BUFFER_SIZE + 1];
+    static thread_local char log_buffer[LOG_BUFFER_SIZE + 1];  // vae decodes log from a thread of their own
     int written = snprintf(log_buffer, LOG_BUFFER_SIZE, "%s:%-4d - ", sd_basename(file).c_str(), line);
 
     if (written >= 0 && written < LOG_BUFFER_SIZE) {
@@ -375,6 +411,7 @@ void log_printf(sd_log_level_t level, const char* file, int line, const char* fo
     strncat(log_buffer, "\n", LOG_BUFFER_SIZE - strlen(log_buffer));
 
     if (sd_log_cb) {
+        std::lock_guard<std::recursive_mutex> lock(sd_callback_mutex());
         sd_log_cb(level, log_buffer, sd_log_cb_data);
     }
 
@@ -389,6 +426,36 @@ void sd_set_progress_callback(sd_progress_cb_t cb, void* data) {
     sd_progress_cb      = cb;
     sd_progress_cb_data = data;
 }
+void sd_set_preview_callback(sd_preview_cb_t cb, preview_t mode, int interval, void* data) {
+    sd_preview_cb       = cb;
+    sd_preview_mode     = cb != NULL ? mode : PREVIEW_NONE;
+    sd_preview_interval = std::max(interval, 1);
+    sd_preview_cb_data  = data;
+}
+preview_t sd_get_preview_mode() {
+    return sd_preview_mode;
+}
+int sd_get_preview_interval() {
+    return sd_preview_interval;
+}
+void sd_preview(int step, int steps, const sd_image_t* images, int n_images) {
+    if (sd_preview_cb) {
+        std::lock_guard<std::recursive_mutex> lock(sd_callback_mutex());
+        sd_preview_cb(step, steps, images, n_images, sd_preview_cb_data);
+    }
+}
+void sd_set_tile_batch_size(int n) {
+    sd_tile_batch_size = std::max(n, 1);
+}
+int sd_get_tile_batch_size() {
+    return sd_tile_batch_size;
+}
+void sd_set_tile_memory_budget(uint64_t size) {
+    sd_tile_memory_budget = size;
+}
+uint64_t sd_get_tile_memory_budget() {
+    return sd_tile_memory_budget;
+}
 const char* sd_get_system_info() {
     static char buffer[1024];
     std::stringstream ss;
@@ -2,6 +2,7 @@
 #define __UTIL_H__
 
 #include <cstdint>
+#include <mutex>
 #include <string>
 #include <vector>
 
@@ -17,6 +18,7 @@ void replace_all_chars(std::string& str, char target, char replacement);
 
 bool file_exists(const std::string& filename);
 bool is_directory(const std::string& path);
+int64_t get_file_mtime(const std::string& filename);  // -1 if the file can't be accessed
 std::string get_full_path(const std::string& dir, const std::string& filename);
 
 std::vector<std::string> get_files_from_dir(const std::string& dir);
@@ -47,6 +49,19 @@ sd_image_f32_t clip_preprocess(sd_image_f32_t image, int size);
 std::string path_join(const std::string& p1, const std::string& p2);
 
 void pretty_progress(int step, int steps, float time);
+// pretty_progress on the calling thread, the vae decoding next to the sampler keeps its tiles quiet
+void sd_set_thread_progress(bool enabled);
+// held while a log, progress, preview or image rows callback runs, callbacks never overlap
+std::recursive_mutex& sd_callback_mutex();
+
+// PREVIEW_NONE without a preview callback
+preview_t sd_get_preview_mode();
+int sd_get_preview_interval();
+void sd_preview(int step, int steps, const sd_image_t* images, int n_images);
+
+int sd_get_tile_batch_size();
+// 0 when the tile sizes are not tuned
+uint64_t sd_get_tile_memory_budget();
 
 void log_printf(sd_log_level_t level, const char* file, int line, const char* format, ...);
 
@@ -8,6 +8,14 @@
 
 #define VAE_GRAPH_SIZE 20480
 
+// from this many latent positions on (1024x1024 images), the mid-block attention uses online
+// softmax when it can, the [h * w, h * w] scores would take 1 GB and more. Below, the exact f32
+// attention is cheap enough and keeps the usual 512x512 decodes unchanged.
+#define VAE_ONLINE_SOFTMAX_MIN_TOKENS (128 * 128)
+
+// latent rows decoded at once when the image is streamed row by row
+#define VAE_DECODE_BAND_ROWS 32
+
 class ResnetBlock : public UnaryBlock {
 protected:
     int64_t in_channels;
@@ -64,10 +72,11 @@ public:
 class AttnBlock : public UnaryBlock {
 protected:
     int64_t in_channels;
+    bool flash_attn;
 
 public:
-    AttnBlock(int64_t in_channels)
-        : in_channels(in_channels) {
+    AttnBlock(int64_t in_channels, bool flash_attn = false)
+        : in_channels(in_channels), flash_attn(flash_attn) {
         blocks["norm"] = std::shared_ptr<GGMLBlock>(new GroupNorm32(in_channels));
         blocks["q"]    = std::shared_ptr<GGMLBlock>(new Conv2d(in_channels, in_channels, {1, 1}));
         blocks["k"]    = std::shared_ptr<GGMLBlock>(new Conv2d(in_channels, in_channels, {1, 1}));
@@ -99,10 +108,15 @@ public:
         k      = ggml_cont(ctx, ggml_permute(ctx, k, 1, 2, 0, 3));  // [N, h, w, in_channels]
         k      = ggml_reshape_3d(ctx, k, c, h * w, n);              // [N, h * w, in_channels]
 
-        auto v = v_proj->forward(ctx, h_);              // [N, in_channels, h, w]
-        v      = ggml_reshape_3d(ctx, v, h * w, c, n);  // [N, in_channels, h * w]
-
-        h_ = ggml_nn_attention(ctx, q, k, v, false);  // [N, h * w, in_channels]
+        auto v = v_proj->forward(ctx, h_);  // [N, in_channels, h, w]
+        if (flash_attn && h * w >= VAE_ONLINE_SOFTMAX_MIN_TOKENS) {
+            v  = ggml_cont(ctx, ggml_permute(ctx, v, 1, 2, 0, 3));  // [N, h, w, in_channels]
+            v  = ggml_reshape_3d(ctx, v, c, h * w, n);              // [N, h * w, in_channels]
+            h_ = ggml_nn_attention_online_softmax(ctx, q, k, v);    // [N, h * w, in_channels]
+        } else {
+            v  = ggml_reshape_3d(ctx, v, h * w, c, n);     // [N, in_channels, h * w]
+            h_ = ggml_nn_attention(ctx, q, k, v, false);  // [N, h * w, in_channels]
+        }
 
         h_ = ggml_cont(ctx, ggml_permute(ctx, h_, 1, 0, 2, 3));  // [N, in_channels, h * w]
         h_ = ggml_reshape_4d(ctx, h_, w, h, c, n);               // [N, in_channels, h, w]
@@ -232,7 +246,8 @@ public:
             int num_res_blocks,
             int in_channels,
             int z_channels,
-            bool double_z = true)
+            bool double_z   = true,
+            bool flash_attn = false)
         : ch(ch),
           ch_mult(ch_mult),
           num_res_blocks(num_res_blocks),
@@ -263,7 +278,7 @@ public:
         }
 
         blocks["mid.block_1"] = std::shared_ptr<GGMLBlock>(new ResnetBlock(block_in, block_in));
-        blocks["mid.attn_1"]  = std::shared_ptr<GGMLBlock>(new AttnBlock(block_in));
+        blocks["mid.attn_1"]  = std::shared_ptr<GGMLBlock>(new AttnBlock(block_in, flash_attn));
         blocks["mid.block_2"] = std::shared_ptr<GGMLBlock>(new ResnetBlock(block_in, block_in));
 
         blocks["norm_out"] = std::shared_ptr<GGMLBlock>(new GroupNorm32(block_in));
@@ -351,7 +366,8 @@ public:
             int num_res_blocks,
             int z_channels,
             bool video_decoder    = false,
-            int video_kernel_size = 3)
+            int video_kernel_size = 3,
+            bool flash_attn       = false)
         : ch(ch),
           out_ch(out_ch),
           ch_mult(ch_mult),
@@ -365,7 +381,7 @@ public:
         blocks["conv_in"] = std::shared_ptr<GGMLBlock>(new Conv2d(z_channels, block_in, {3, 3}, {1, 1}, {1, 1}));
 
         blocks["mid.block_1"] = get_resnet_block(block_in, block_in);
-        blocks["mid.attn_1"]  = std::shared_ptr<GGMLBlock>(new AttnBlock(block_in));
+        blocks["mid.attn_1"]  = std::shared_ptr<GGMLBlock>(new AttnBlock(block_in, flash_attn));
         blocks["mid.block_2"] = get_resnet_block(block_in, block_in);
 
         for (int i = num_resolutions - 1; i >= 0; i--) {
@@ -455,7 +471,8 @@ protected:
 public:
     AutoencodingEngine(bool decode_only       = true,
                        bool use_video_decoder = false,
-                       SDVersion version      = VERSION_SD1)
+                       SDVersion version      = VERSION_SD1,
+                       bool flash_attn        = false)
         : decode_only(decode_only), use_video_decoder(use_video_decoder) {
         if (version == VERSION_SD3_2B || version == VERSION_FLUX_DEV || version == VERSION_FLUX_SCHNELL) {
             dd_config.z_channels = 16;
@@ -469,7 +486,9 @@ public:
                                                                    dd_config.ch_mult,
                                                                    dd_config.num_res_blocks,
                                                                    dd_config.z_channels,
-                                                                   use_video_decoder));
+                                                                   use_video_decoder,
+                                                                   3,
+                                                                   flash_attn));
         if (use_quant) {
             blocks["post_quant_conv"] = std::shared_ptr<GGMLBlock>(new Conv2d(dd_config.z_channels,
                                                                               embed_dim,
@@ -481,7 +500,8 @@ public:
                                                                        dd_config.num_res_blocks,
                                                                        dd_config.in_channels,
                                                                        dd_config.z_channels,
-                                                                       dd_config.double_z));
+                                                                       dd_config.double_z,
+                                                                       flash_attn));
             if (use_quant) {
                 int factor = dd_config.double_z ? 2 : 1;
 
@@ -522,14 +542,29 @@ public:
 struct AutoEncoderKL : public GGMLRunner {
     bool decode_only = true;
     AutoencodingEngine ae;
+    std::shared_ptr<GroupNormStats> group_norm_stats;
+    float scale_factor = 0.18215f;  // latents are scaled by it for the diffusion model
+
+    // the convs unfold their input to these types, f16 overflows in the original sdxl vae
+    ggml_type encoder_activation_type = GGML_TYPE_F16;
+    ggml_type decoder_activation_type = GGML_TYPE_F16;
+
+    // graph inputs, the ggml ops have no scalar add
+    float input_offset  = -1.f;  // [0, 1] => [-1, 1] is x * 2 - 1
+    float output_offset = 0.5f;  // [-1, 1] => [0, 1] is x * 0.5 + 0.5
+
+    // the decode graph clamps its output to [0, 1], which also turns nan and inf into numbers
+    bool clamp_output = true;
 
     AutoEncoderKL(ggml_backend_t backend,
                   ggml_type wtype,
                   bool decode_only       = false,
                   bool use_video_decoder = false,
                   SDVersion version      = VERSION_SD1)
-        : decode_only(decode_only), ae(decode_only, use_video_decoder, version), GGMLRunner(backend, wtype) {
+        : decode_only(decode_only), ae(decode_only, use_video_decoder, version, ggml_backend_is_cpu(backend)), GGMLRunner(backend, wtype) {
         ae.init(params_ctx, wtype);
+        group_norm_stats = std::make_shared<GroupNormStats>();
+        ae.set_group_norm_stats(group_norm_stats);
     }
 
     std::string get_desc() {
@@ -540,13 +575,62 @@ struct AutoEncoderKL : public GGMLRunner {
         ae.get_param_tensors(tensors, prefix);
     }
 
-    struct ggml_cgraph* build_graph(struct ggml_tensor* z, bool decode_graph) {
+    struct ggml_tensor* new_scalar(float* value) {
+        struct ggml_tensor* scalar = ggml_new_tensor_1d(compute_ctx, GGML_TYPE_F32, 1);
+        set_backend_tensor_data(scalar, value);
+        return scalar;
+    }
+
+    // ldm.modules.distributions.distributions.DiagonalGaussianDistribution.sample, scaled for the diffusion model
+    // moments: [N, 2 * C, h, w], noise: [N, C, h, w]
+    struct ggml_tensor* sample_latent(struct ggml_tensor* moments, struct ggml_tensor* noise) {
+        int64_t C                  = moments->ne[2] / 2;
+        struct ggml_tensor* mean   = ggml_view_4d(compute_ctx, moments, moments->ne[0], moments->ne[1], C, moments->ne[3],
+                                                  moments->nb[1], moments->nb[2], moments->nb[3], 0);
+        struct ggml_tensor* logvar = ggml_view_4d(compute_ctx, moments, moments->ne[0], moments->ne[1], C, moments->ne[3],
+                                                  moments->nb[1], moments->nb[2], moments->nb[3], C * moments->nb[2]);
+        logvar                     = ggml_clamp(compute_ctx, ggml_cont(compute_ctx, logvar), -30.0f, 20.0f);
+        struct ggml_tensor* std_   = ggml_exp(compute_ctx, ggml_scale(compute_ctx, logvar, 0.5f));
+        struct ggml_tensor* latent = ggml_add(compute_ctx, ggml_cont(compute_ctx, mean), ggml_mul(compute_ctx, std_, noise));
+        return ggml_scale(compute_ctx, latent, scale_factor);
+    }
+
+    // Decode: scaled latent => image in [0, 1]. Encode: image in [0, 1] => moments, or the
+    // sampled and scaled latent if noise is given.
+    struct ggml_cgraph* build_graph(struct ggml_tensor* z, bool decode_graph, struct ggml_tensor* noise = NULL) {
         struct ggml_cgraph* gf = ggml_new_graph(compute_ctx);
 
         z = to_backend(z);
+        if (decode_graph) {
+            z = ggml_scale(compute_ctx, z, 1.0f / scale_factor);
+        } else {
+            z = ggml_add(compute_ctx, ggml_scale(compute_ctx, z, 2.0f), new_scalar(&input_offset));
+        }
 
+        group_norm_stats->begin_graph();
+        if (group_norm_stats->mode != GroupNormStats::NONE && !group_norm_stats->values.empty()) {
+            group_norm_stats->input = ggml_new_tensor_1d(compute_ctx, GGML_TYPE_F32, group_norm_stats->values.size());
+            set_backend_tensor_data(group_norm_stats->input, group_norm_stats->values.data());
+        }
+
+        ae.set_conv_activation_type(decode_graph ? decoder_activation_type : encoder_activation_type);
         struct ggml_tensor* out = decode_graph ? ae.decode(compute_ctx, z) : ae.encode(compute_ctx, z);
 
+        if (decode_graph) {
+            out = ggml_add(compute_ctx, ggml_scale(compute_ctx, out, 0.5f), new_scalar(&output_offset));
+            if (clamp_output) {
+                out = ggml_clamp(compute_ctx, out, 0.0f, 1.0f);
+            }
+        } else if (noise != NULL) {
+            out = sample_latent(out, to_backend(noise));
+        }
+
+        if (group_norm_stats->mode == GroupNormStats::RECORD) {
+            // the statistics of the recorded layer are the output, the rest of the graph is not needed
+            GGML_ASSERT(group_norm_stats->recorded.size() == 1);
+            out = group_norm_stats->recorded[0];
+        }
+
         ggml_build_forward_expand(gf, out);
 
         return gf;
@@ -556,15 +640,41 @@ struct AutoEncoderKL : public GGMLRunner {
                  struct ggml_tensor* z,
                  bool decode_graph,
                  struct ggml_tensor** output,
-                 struct ggml_context* output_ctx = NULL) {
+                 struct ggml_context* output_ctx = NULL,
+                 struct ggml_tensor* noise       = NULL) {
         auto get_graph = [&]() -> struct ggml_cgraph* {
-            return build_graph(z, decode_graph);
+            return build_graph(z, decode_graph, noise);
         };
         // ggml_set_f32(z, 0.5f);
         // print_ggml_tensor(z);
         GGMLRunner::compute(get_graph, n_threads, true, output, output_ctx);
     }
 
+    // Tiled encode, first passes: adds the statistics of the GroupNorm layer group_norm_stats->layer
+    // over the parts of the tiles x that they own, set in group_norm_stats->regions, to those of the
+    // image. Call finalize() on group_norm_stats once every tile went through.
+    void record_group_norm_stats(const int n_threads, struct ggml_tensor* x) {
+        struct ggml_init_params params;
+        params.mem_size   = static_cast<size_t>(1024 * 1024);  // 1 MB, a few thousands of floats are needed
+        params.mem_buffer = NULL;
+        params.no_alloc   = false;
+
+        struct ggml_context* stats_ctx = ggml_init(params);
+        GGML_ASSERT(stats_ctx != NULL);
+
+        GGML_ASSERT(group_norm_stats->mode == GroupNormStats::RECORD);
+        struct ggml_tensor* out = NULL;
+        compute(n_threads, x, false, &out, stats_ctx);
+        size_t n = ggml_nelements(out) / x->ne[3];
+        for (int64_t i = 0; i < x->ne[3]; i++) {
+            const float* region = &group_norm_stats->regions[i * 4];
+            double owned        = (double)(region[2] - region[0]) * (region[3] - region[1]);
+            group_norm_stats->accumulate((const float*)out->data + i * n, n, owned);
+        }
+
+        ggml_free(stats_ctx);
+    }
+
     void test() {
         struct ggml_init_params params;
         params.mem_size   = static_cast<size_t>(10 * 1024 * 1024);  // 10 MB